@@ -7,6 +7,10 @@ extern int RTI_TIMEOUT;
 int bRes = 0;
 int count = 10000;
 bool UART_Timeout = false;
+uint32_t dwTimeoutMask = 0;		//Boards that did not answer the last ReadReg
+uint32_t dwCRCFaultMask = 0;	//Boards whose last ReadReg response failed the CRC
+long dwBaudRate = 250000;		//Baudrate the stack and BMS_UART are using
+void (*pfnWriteObserver)(byte bID, uint16_t wAddr, const byte *pData, byte bLen, byte bWriteType) = nullptr;	//Told about every register write
 uint8_t pFrame[(MAXBYTES+6)*TOTALBOARDS];
 byte bBuf[8];
 byte bReturn = 0;
@@ -46,6 +50,7 @@ void Ini_ESP(){
 
     //UART inicilization
     Serial.begin(115200);
+	BMS_UART.setTimeout(2);		//Inter byte timeout in ms so a broken frame never blocks readBytes for 1s
 	//BMS_UART.begin(BAUDRATE, SERIAL_8N1, MySerialRX, MySerialTX);
 	
 
@@ -77,7 +82,10 @@ void CommClear(void){
     pinMode(BMS_TX,OUTPUT);     //RX pin is an output
     digitalWrite(BMS_TX,0);     //RX to low
 
-    delay(17*(BAUDRATE/1000));  //Wait 17 bits periods
+    delayMicroseconds(BitTimeUs(17));  //Wait 17 bits periods (15 to 20) at the current baudrate
+    digitalWrite(BMS_TX,1);     //RX to High
+
+    BMS_UART.begin(dwBaudRate, SERIAL_8N1, MySerialRX, MySerialTX);   //UART inicilization
 }
 
 
@@ -89,69 +97,105 @@ void CommSleepToWake(void) {
     digitalWrite(BMS_TX,0);     //RX to low
 
 	delayMicroseconds(260);     // 250us to 300us, same as wake
+    digitalWrite(BMS_TX,1);     //RX to High
 
-    BMS_UART.begin(BAUDRATE, SERIAL_8N1);   //UART inicilization
+    BMS_UART.begin(dwBaudRate, SERIAL_8N1, MySerialRX, MySerialTX);   //UART inicilization
     
     delayMicroseconds(170*TOTALBOARDS);     //tSU(SLPtoACT) transition time from sleep to active - 170us from wake receive to wake propagate for each device
 }
 
 
 
+//Device go from active to sleep state, every register is kept (CommSleepToWake brings it back)
+void CommGoToSleep(void) {
+    WriteReg(0, CONTROL1, 0x04, 1, FRMWRT_ALL_NR);  //GOTO_SLEEP to every device
+    BMS_UART.flush();                               //the frame has to leave before the UART is touched again
+}
+
+
+
 //Communication Reset
 void CommReset(int BAUD) {
+    uint16_t wCommCtrl;
+
     BMS_UART.end();             //Comunication end
 	pinMode(BMS_TX,OUTPUT);     //RX pin is an output
     digitalWrite(BMS_TX,0);     //RX to low
 	delayMicroseconds(500);     // should cover any possible baud rate
 	digitalWrite(BMS_TX,1);     //RX to High
 
-   BMS_UART.begin(250000, SERIAL_8N1, MySerialRX, MySerialTX);
+    //after a reset the devices talk at 250k
+    dwBaudRate = 250000;
+    BMS_UART.begin(dwBaudRate, SERIAL_8N1, MySerialRX, MySerialTX);
 
     //tell the base device to set its baudrate to the chosen BAUDRATE, and propagate to the rest of the stack
     //then set the microcontroller to the appropriate baudrate to match
     if(BAUD == 1000000)
     {
-        WriteReg(0, COMM_CTRL, 0x3C3C, 2, FRMWRT_ALL_NR);   //set COMM_CTRL and DAISY_CHAIN_CTRL registers
-		delayMicroseconds(500);
-        //ALL 606 DEVICES ARE NOW AT 1M BAUDRATE
-
-        BMS_UART.begin(BAUD, SERIAL_8N1, MySerialRX, MySerialTX);
+        wCommCtrl = 0x3C3C;     //COMM_CTRL and DAISY_CHAIN_CTRL registers
     }
     else if(BAUD == 500000)
     {   
-        WriteReg(0, COMM_CTRL, 0x383C, 2, FRMWRT_ALL_NR);   //set COMM_CTRL and DAISY_CHAIN_CTRL registers
-		delayMicroseconds(250);
-        //ALL 606 DEVICES ARE NOW AT 1M BAUDRATE
-
-        BMS_UART.begin(BAUD, SERIAL_8N1, MySerialRX, MySerialTX);
+        wCommCtrl = 0x383C;
     }
     else if(BAUD == 250000)
     {
-        WriteReg(0, COMM_CTRL, 0x343C, 2, FRMWRT_ALL_NR);   //set COMM_CTRL and DAISY_CHAIN_CTRL registers
-		delayMicroseconds(250);
-        //ALL 606 DEVICES ARE NOW AT 1M BAUDRATE
-
-        //BMS_UART.begin(BAUD, SERIAL_8N1, MySerialRX, MySerialTX);
+        wCommCtrl = 0x343C;
     }
     else if(BAUD == 125000)
     {
-        WriteReg(0, COMM_CTRL, 0x303C, 2, FRMWRT_ALL_NR);   //set COMM_CTRL and DAISY_CHAIN_CTRL registers
-		delayMicroseconds(250);
-        //ALL 606 DEVICES ARE NOW AT 1M BAUDRATE
-
-        BMS_UART.begin(BAUD, SERIAL_8N1, MySerialRX, MySerialTX);
+        wCommCtrl = 0x303C;
     }
     else
     {
         printf("ERROR: INVALID BAUDRATE CHOSEN IN BQ79606.h FILE. Choosing default 1M baudrate:\n\n");
-        WriteReg(0, COMM_CTRL, 0x3C3C, 2, FRMWRT_ALL_NR);
-		delayMicroseconds(250);
-        BMS_UART.begin(1000000, SERIAL_8N1, MySerialRX, MySerialTX);
+        BAUD = 1000000;
+        wCommCtrl = 0x3C3C;
     }
 
+    WriteReg(0, COMM_CTRL, wCommCtrl, 2, FRMWRT_ALL_NR);   //set COMM_CTRL and DAISY_CHAIN_CTRL registers
+    BMS_UART.flush();                                       //wait until the frame has left at the old baudrate
+    delayMicroseconds(BitTimeUs(10));                       //one more character time for the devices to switch
+    //ALL 606 DEVICES ARE NOW AT THE NEW BAUDRATE
+
+    dwBaudRate = BAUD;
+    BMS_UART.begin(dwBaudRate, SERIAL_8N1, MySerialRX, MySerialTX);
+
     delayMicroseconds(100);
 }
 
+
+
+//Baudrate negotiation: starting at BAUD, every supported baudrate is tried from fastest to slowest
+//until the base device answers a DEVADD_USR read. Returns the baudrate in use or 0 if none worked
+long NegotiateBaud(long BAUD) {
+    const long dwBauds[] = {1000000, 500000, 250000, 125000};
+    byte bFrameTest[1 + 6];
+
+    for (unsigned n = 0; n < sizeof(dwBauds) / sizeof(dwBauds[0]); n++)
+    {
+        if (dwBauds[n] > BAUD)
+            continue;
+
+        CommReset(dwBauds[n]);
+
+        //echo read: a good CRC and the register address in the response prove both ends agree on the baudrate
+        if ((ReadReg(0, DEVADD_USR, bFrameTest, 1, VERIFY_TIMEOUT_US, FRMWRT_SGL_R) > 0) &&
+            (((bFrameTest[2] << 8) | bFrameTest[3]) == DEVADD_USR))
+        {
+            return dwBaudRate;
+        }
+    }
+    return 0;
+}
+
+
+
+//Duration in us of nBits bit periods at the current baudrate, rounded up
+uint32_t BitTimeUs(uint32_t nBits) {
+    return (nBits * 1000000UL + dwBaudRate - 1) / dwBaudRate;
+}
+
 //**********
 //END PINGS
 //**********
@@ -161,27 +205,27 @@ void CommReset(int BAUD) {
 //**********************
 //AUTO ADDRESS SEQUENCE
 //**********************
-bool AutoAddress()
+bool AutoAddress(uint16_t wStepDelay, uint32_t dwReadTimeout, bool bPrint)
 {
     memset(response_frame2,0,sizeof(response_frame2)); //clear out the response frame buffer
 
     //dummy write to ECC_TEST (sync DLL)
     WriteReg(0,  ECC_TEST, 0x00, 1, FRMWRT_ALL_NR);
-	delay(100);
+	delay(wStepDelay);
 
 	//clear CONFIG in case it is set
     WriteReg(0, CONFIG, 0x00, 1, FRMWRT_ALL_NR);
-	delay(100);
+	delay(wStepDelay);
 
     //enter auto addressing mode
     WriteReg(0, CONTROL1, 0x01, 1, FRMWRT_ALL_NR);
-	delay(100);
+	delay(wStepDelay);
 
     //set addresses for all boards in daisy-chain
     for (nCurrentBoard = 0; nCurrentBoard < TOTALBOARDS; nCurrentBoard++)
     {
         WriteReg(0, DEVADD_USR, nCurrentBoard, 1, FRMWRT_ALL_NR);
-		delay(100);
+		delay(wStepDelay);
     }
 
 
@@ -191,7 +235,7 @@ bool AutoAddress()
     if(TOTALBOARDS==1)
     {
         WriteReg(0, CONFIG, 0x01, 1, FRMWRT_SGL_NR);	//Base and top device
-		delay(100);
+		delay(wStepDelay);
     }
     //otherwise set the base and top of stack individually
     else
@@ -201,51 +245,54 @@ bool AutoAddress()
 		for (nCurrentBoard = 1; nCurrentBoard < (TOTALBOARDS-1); nCurrentBoard++)
     	{
         	WriteReg(nCurrentBoard, CONFIG, 0x02, 1, FRMWRT_SGL_NR); //Stack
-			delay(100);
+			delay(wStepDelay);
     	}
 		
         WriteReg((TOTALBOARDS - 1), CONFIG, 0x03, 1, FRMWRT_SGL_NR); //top of stack
-		delay(100);
+		delay(wStepDelay);
     }
 
 
 	for (nCurrentBoard = 0; nCurrentBoard < TOTALBOARDS; nCurrentBoard++)
     {
         //dummy read from ECC_TEST (sync DLL)
-    	ReadReg(nCurrentBoard, ECC_TEST, response_frame2, 1, 0, FRMWRT_SGL_R);
-		delay(100);
+    	ReadReg(nCurrentBoard, ECC_TEST, response_frame2, 1, dwReadTimeout, FRMWRT_SGL_R);
+		delay(wStepDelay);
     }
 
     
 
 	WriteReg(0, DAISY_CHAIN_CTRL, 0x0D, 1, FRMWRT_SGL_NR);  //base
-	delay(100);
+	delay(wStepDelay);
 	WriteReg(1, COMM_CTRL, 0x04, 1, FRMWRT_STK_NR);  //stack
-	delay(100);
+	delay(wStepDelay);
 	WriteReg((TOTALBOARDS - 1), DAISY_CHAIN_CTRL, 0x32, 1, FRMWRT_SGL_NR);  //Top
-	delay(100);
+	delay(wStepDelay);
 
 
 
-	Serial.print("Addres: ");
-	delay(10);
+	if(bPrint){
+		Serial.print("Addres: ");
+	}
+	delay(wStepDelay/10);
 
     bool ok=true;
 	for (nCurrentBoard = 0; nCurrentBoard < TOTALBOARDS; nCurrentBoard++) {
         memset(response_frame2, 0, sizeof(response_frame2));
-        ReadReg(nCurrentBoard, DEVADD_USR, response_frame2, 1, 0, FRMWRT_SGL_R);
-		Serial.print((String)"Board "+nCurrentBoard+"= ");
-
-        Serial.print(response_frame2[4]);
+        ReadReg(nCurrentBoard, DEVADD_USR, response_frame2, 1, dwReadTimeout, FRMWRT_SGL_R);
+		if(bPrint){
+			Serial.print((String)"Board "+nCurrentBoard+"= ");
+			Serial.print(response_frame2[4]);
+			Serial.println(".");
+		}
 		//Devuelve false si no se ha hecho bien el autoadressing
 		if(response_frame2[4]!=nCurrentBoard) ok=false; 
-		Serial.println(".");
 
-		delay(10);
+		delay(wStepDelay/10);
 
 	}
 
-	delay(100);
+	delay(wStepDelay);
 
 
 //    //OPTIONAL: read back all device addresses
@@ -353,6 +400,8 @@ int WriteFrame(byte bID, uint16_t wAddr, byte * pData, byte bLen, byte bWriteTyp
 	}
 	*pBuf++ = (wAddr & 0xFF00) >> 8;
 	*pBuf++ = wAddr & 0x00FF;
+	uint8_t * pPayload = pBuf;
+	byte bDataLen = bLen;
 
 	while (bLen--)
 		*pBuf++ = *pData++;
@@ -367,61 +416,104 @@ int WriteFrame(byte bID, uint16_t wAddr, byte * pData, byte bLen, byte bWriteTyp
 	//(Seems to be caused by stack overflow, so take precautions to reduce stack usage in function calls)
 	BMS_UART.write(pFrame, bPktLen);
 
+	//write frames only, read requests also go through here
+	if (pfnWriteObserver && ((bWriteType & 0x10) || (bWriteType == FRMWRT_REV_ALL_NR)))
+		pfnWriteObserver(bID, wAddr, pPayload, bDataLen, bWriteType);
+
 	return bPktLen;
 }
 
 
 
 //Read Register Instruction
+//dwTimeOut is the wait for the first response byte in us (0 uses READ_TIMEOUT_US)
+//Returns the bytes read, BQ_READ_TIMEOUT or BQ_READ_CRC_ERROR. The boards that failed are left in
+//dwTimeoutMask and dwCRCFaultMask (bit n = board n). The frames stay in pData as they arrived: a board
+//that did not answer leaves no gap, use FrameBoard() to know whose frame each one is
 int ReadReg(byte bID, uint16_t wAddr, byte * pData, byte bLen, uint32_t dwTimeOut, byte bWriteType) {
 	bRes = 0;
-	count = 100000;
-	int recepciones = 0;
-	byte recibido [64];
 	int Reciving_Len = 0;
+	int nFrames = 0;
+	uint32_t dwExpected = 0;
+
+	dwTimeoutMask = 0;
+	dwCRCFaultMask = 0;
 
 	if(bWriteType == FRMWRT_SGL_R){
-		Reciving_Len = (bLen + 6);
+		nFrames = 1;
+		dwExpected = 1UL << bID;
 	}
 	else if(bWriteType == FRMWRT_STK_R){
-		Reciving_Len = (bLen + 6) * (TOTALBOARDS - 1);
+		nFrames = TOTALBOARDS - 1;
+		dwExpected = ((1UL << TOTALBOARDS) - 1) & ~1UL;
 	}
 	else if(bWriteType == FRMWRT_ALL_R){
-		Reciving_Len = (bLen + 6) * TOTALBOARDS;
+		nFrames = TOTALBOARDS;
+		dwExpected = (1UL << TOTALBOARDS) - 1;
 	}
+	Reciving_Len = (bLen + 6) * nFrames;
 	
 
 
 	//Correct bWriteType
-	if((bWriteType == FRMWRT_SGL_R) || (bWriteType == FRMWRT_STK_R) || (bWriteType == FRMWRT_ALL_R)){
+	if(nFrames > 0){
 		//Read FRame Request)
 		if(ReadFrameReq(bID, wAddr, bLen, bWriteType) == 0){
 			Serial.println("No se pueden leer mas de 128 bytes");
 		};	
-		memset(pData, 0, sizeof(pData));			//pData = empty
-		//timerStart(Reciving_Timeout);				//Timer timeout start
-
-		int Time = 0;
-		//Waiting firts byte, If not reciving the first byte in 1 second send and error
-		while((BMS_UART.available() == 0) && (Time < 10)){
-			delay(5);
-			Time ++;
-			if(Time == 10){
-				Serial.println("Se ha excedido el tiempo de lectura");
-				bRes = -1;		//Timeout error
-			}
+		memset(pData, 0, Reciving_Len);			//pData = empty
+
+		if(dwTimeOut == 0){
+			dwTimeOut = READ_TIMEOUT_US;
 		}
-			Time = 0;
-		//timerStop(Reciving_Timeout);	//Timer Timeout Stop
-		//timerRestart(Reciving_Timeout);	//Timer Timeout Reset counter value
 
-			
+		//Waiting firts byte, if it does not arrive in dwTimeOut report a timeout to the caller
+		uint32_t dwStart = micros();
+		while((BMS_UART.available() == 0) && ((micros() - dwStart) < dwTimeOut)){
+			if(dwTimeOut > 5000){
+				delay(1);		//Long waits give the CPU back
+			}
+		}
 
 		//Data avalible, start to read all data
 		if(BMS_UART.available() > 0){
-
 			bRes = BMS_UART.readBytes(pData, Reciving_Len);
+		}
+
+		//Check every frame that arrived and account it to the device address it carries
+		uint32_t dwSeen = 0;
+		bool bStrayFrame = false;
+		for(int nFrame = 0; (nFrame + 1) * (bLen + 6) <= bRes; nFrame++){
+			byte *pFrame = &pData[nFrame * (bLen + 6)];
+			int nBoard = FrameBoard(pFrame, bLen);
+
+			if(nBoard < 0){
+				//corrupted: blamed on the address it carries if that board is still missing
+				if((pFrame[1] < TOTALBOARDS) && (dwExpected & ~dwSeen & (1UL << pFrame[1]))){
+					dwCRCFaultMask |= (1UL << pFrame[1]);
+				}
+				else{
+					bStrayFrame = true;
+				}
+			}
+			else if((nBoard >= TOTALBOARDS) || !(dwExpected & (1UL << nBoard)) || (dwSeen & (1UL << nBoard))){
+				//unexpected or repeated address: none of the frames of that address can be trusted
+				if(nBoard < TOTALBOARDS){
+					dwCRCFaultMask |= (1UL << nBoard);
+				}
+				bStrayFrame = true;
+			}
+			else{
+				dwSeen |= (1UL << nBoard);
+			}
+		}
+		dwTimeoutMask = dwExpected & ~dwSeen & ~dwCRCFaultMask;
 
+		if(dwTimeoutMask != 0){
+			bRes = BQ_READ_TIMEOUT;		//Timeout error
+		}
+		else if((dwCRCFaultMask != 0) || bStrayFrame){
+			bRes = BQ_READ_CRC_ERROR;	//Corrupted response
 		}
 	}
 	//InCorrect bWriteType
@@ -495,6 +587,21 @@ uint16_t CRC16(byte *pBuf, int nLen) {
 
 	return wCRC;
 }
+
+
+
+//Response frame CRC check, the CRC of a frame including its own CRC bytes is 0
+bool CheckFrameCRC(byte *pFrame, int nLen) {
+	return CRC16(pFrame, nLen) == 0;
+}
+
+//Device address of a response frame with bLen data bytes, -1 if its length byte or its CRC is wrong
+int FrameBoard(const byte *pFrame, byte bLen) {
+	if((pFrame[0] + 1 != bLen) || !CheckFrameCRC((byte *)pFrame, bLen + 6)){
+		return -1;
+	}
+	return pFrame[1];
+}
 //****************************
 //END WRITE AND READ FUNCTIONS
 //****************************
@@ -523,7 +630,7 @@ bool GetFaultStat() {
 
 
 //Ini Devices in the daisy_Chain
-void InitDevices() {
+void InitDevices(byte uvThresh, byte ovThresh) {
     /*******Optional examples of some initialization functions*****/
 
     delay(1);
@@ -557,22 +664,16 @@ void InitDevices() {
     WriteReg(0, OVUV_BIST_FLT_MSK, 0x03, 1, FRMWRT_ALL_NR); //mask ov/uv bist faults
     WriteReg(0, OTUT_BIST_FLT_MSK, 0xFF, 1, FRMWRT_ALL_NR);
 
-    WriteReg(0, CELL_ADC_CTRL, 0x3F, 1, FRMWRT_ALL_NR); //enables ADC for all 6 cell channels
     WriteReg(0, OVUV_CTRL, 0x3F, 1, FRMWRT_ALL_NR); //enable all cell ov/uv
-    WriteReg(0, UV_THRESH, 0x53, 1, FRMWRT_ALL_NR); //sets cell UV to 2.8V
-    WriteReg(0, OV_THRESH, 0x5B, 1, FRMWRT_ALL_NR); //sets cell OV to 4.3V
+    WriteReg(0, UV_THRESH, uvThresh, 1, FRMWRT_ALL_NR); //sets cell UV (0x53: 2.8V)
+    WriteReg(0, OV_THRESH, ovThresh, 1, FRMWRT_ALL_NR); //sets cell OV (0x5B: 4.3V)
     //WriteReg(0, OTUT_CTRL, 0x3F, 1, FRMWRT_ALL_NR); //enable GPIO OT/UT
     //WriteReg(0, OTUT_THRESH, 0xFF, 1, FRMWRT_ALL_NR); //sets OT to 35% TSREF, UT to 75%, programmabe in 1% increment
-    WriteReg(0, GPIO_ADC_CONF, 0x00, 1, FRMWRT_ALL_NR); //configure GPIO as AUX voltage (absolute voltage, set to 0 for ratiometric)
     for (nCurrentBoard = 0; nCurrentBoard < TOTALBOARDS; nCurrentBoard++) {
         //set adc delay for each device
         WriteReg(nCurrentBoard, ADC_DELAY, 0x00, 1, FRMWRT_SGL_NR);
     }
-    WriteReg(0, AUX_ADC_CONF, 0x0C, 1, FRMWRT_ALL_NR); //1MHz AUX sample rate,  256 decimation  ratio
-    WriteReg(0, CELL_ADC_CONF1, 0x67, 1, FRMWRT_ALL_NR); //256 decimation ratio, 1MHz sample. 1.2 Hz LPF
-    WriteReg(0, CELL_ADC_CONF2, 0x00, 1, FRMWRT_ALL_NR); //single conversion
-    //enable continuous sampling. Otherwise, single conversions with CONTROL2[CELL_ADC_GO]
-    //WriteReg(0,CELL_ADC_CONF2, 0x0A,1,FRMWRT_ALL_NR);//continuous sampling with 5ms interval
+    //cell and AUX ADC channels, decimation and conversion mode are written by AdcSequencer (BQ_ADC)
     WriteReg(0, CONTROL2, 0x10, 1, FRMWRT_ALL_NR);// enable TSREF to give enough settling time
     delay(2); // provides settling time for TSREF
 
@@ -607,9 +708,6 @@ void InitDevices() {
     }
 //  WriteReg(0, CONTROL2, 0x1D, 1, FRMWRT_ALL_NR); // OTUT EN, OVUV EN, Sample all cells
 
-    WriteReg(0, AUX_ADC_CTRL1, 0x01, 1, FRMWRT_ALL_NR); //convert BAT with AUX ADC
-    WriteReg(0, AUX_ADC_CTRL2, 0x00, 1, FRMWRT_ALL_NR); //No AUX ADC measurements from this  register
-    WriteReg(0, AUX_ADC_CTRL3, 0x00, 1, FRMWRT_ALL_NR); //No AUX ADC measurements from this register
     delayMicroseconds(100);
     for (nCurrentBoard = 0; nCurrentBoard < TOTALBOARDS; nCurrentBoard++) {
         //read CB_SW_STAT
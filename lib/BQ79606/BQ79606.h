@@ -6,13 +6,18 @@
 
 // User defines
 #define TOTALBOARDS 4    //MUST SET: total boards in the stack
-#define BAUDRATE  250000    //set global baudrate
+#define BAUDRATE  1000000   //set global baudrate, NegotiateBaud falls back to slower ones if it does not work
 #define MAXBYTES  6*2        //6 CELLS, 2 byteS EACH
 #define Wake_pin  18         //Wake up pin number in ESP32 (4 original)
 #define Fault_pin 2          //Fault pin number in ESP32
 #define BMS_OK    13          //Fault pin number in ESP32
 #define BMS_RX    16         //UART RX pin for BMS (16 origial)
 #define BMS_TX    17         //UART TX pin for BMS (17 original)
+#define READ_TIMEOUT_US 50000 //Default wait for the first byte of a response
+#define VERIFY_TIMEOUT_US 1000 //Wait for the first byte of the baudrate verification read
+
+#define BQ_READ_TIMEOUT   -1 //ReadReg result: some board did not answer
+#define BQ_READ_CRC_ERROR -2 //ReadReg result: some response failed the CRC
 
 
 
@@ -489,16 +494,26 @@
 // Function Prototypes
 void Wake79606();
 void Ini_ESP();
-void InitDevices();
+void InitDevices(byte uvThresh = 0x53, byte ovThresh = 0x5B); //comparator codes, 2.8 V and 4.3 V by default
 void CommClear(void);
 void CommSleepToWake(void);
+void CommGoToSleep(void);
 void CommReset(int BAUD);
-bool AutoAddress(void);
+long NegotiateBaud(long BAUD);
+uint32_t BitTimeUs(uint32_t nBits);
+bool AutoAddress(uint16_t wStepDelay = 100, uint32_t dwReadTimeout = 0, bool bPrint = false);   //wStepDelay: ms between addressing commands, dwReadTimeout: us (0 uses READ_TIMEOUT_US), bPrint: addresses over Serial (setup only)
 bool GetFaultStat();
 
 float Complement(uint16_t rawData, float multiplier);
 
 uint16_t CRC16(byte *pBuf, int nLen);
+bool CheckFrameCRC(byte *pFrame, int nLen);
+int FrameBoard(const byte *pFrame, byte bLen);   //Device address of a good response frame, -1 if it is not usable
+
+extern uint32_t dwTimeoutMask;
+extern uint32_t dwCRCFaultMask;
+extern long dwBaudRate;
+extern void (*pfnWriteObserver)(byte bID, uint16_t wAddr, const byte *pData, byte bLen, byte bWriteType);
 
 int  WriteReg(byte bID, uint16_t wAddr, uint64_t dwData, byte bLen, byte bWriteType);
 int  ReadReg(byte bID, uint16_t wAddr, byte * pData, byte bLen, uint32_t dwTimeOut, byte bWriteType);
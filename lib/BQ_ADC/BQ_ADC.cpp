@@ -0,0 +1,178 @@
+#include "BQ_ADC.h"
+
+// Sorted by address so contiguous registers can be written with one frame
+const uint16_t AdcSequencer::imageAddr[ADC_IMAGE_SIZE] = {
+    CELL_ADC_CONF1, CELL_ADC_CONF2, AUX_ADC_CONF, GPIO_ADC_CONF,
+    GPIO1_CONF, GPIO2_CONF, GPIO3_CONF, GPIO4_CONF, GPIO5_CONF, GPIO6_CONF,
+    CELL_ADC_CTRL, AUX_ADC_CTRL1, AUX_ADC_CTRL2, AUX_ADC_CTRL3};
+
+enum
+{
+    IMG_CELL_ADC_CONF1,
+    IMG_CELL_ADC_CONF2,
+    IMG_AUX_ADC_CONF,
+    IMG_GPIO_ADC_CONF,
+    IMG_GPIO1_CONF,
+    IMG_CELL_ADC_CTRL = IMG_GPIO1_CONF + 6,
+    IMG_AUX_ADC_CTRL1,
+    IMG_AUX_ADC_CTRL2,
+    IMG_AUX_ADC_CTRL3
+};
+
+/**
+ * Returns log2(ratio) - log2(minRatio), the encoding of the decimation
+ * fields, or -1 if the ratio is not a supported power of two.
+ * (CELL_ADC_CONF1 0x67 and AUX_ADC_CONF 0x0C both select 256)
+ */
+int AdcSequencer::decimationCode(uint16_t ratio, uint16_t minRatio, uint16_t maxRatio)
+{
+    int code = 0;
+    for (uint16_t r = minRatio; r <= maxRatio; r <<= 1, code++)
+    {
+        if (r == ratio)
+            return code;
+    }
+    return -1;
+}
+
+/**
+ * Builds the register image of the plan and the write program.
+ *
+ * Cell ADC: CELL_ADC_CTRL enables the channels, CELL_ADC_CONF1 holds the
+ * decimation in [6:4] (64 -> 4 ... 512 -> 7) and the LPF in [2:0],
+ * CELL_ADC_CONF2 the continuous bit [3] and the interval [2:0].
+ * AUX ADC: AUX_ADC_CTRL1 selects BAT [0] and GPIO1-4 [7:4], AUX_ADC_CTRL2
+ * GPIO5-6 [1:0]; AUX_ADC_CONF holds the decimation in [3:2] (32 -> 0 ...
+ * 256 -> 3). Planned GPIOs are configured as ADC inputs and GPIO_ADC_CONF
+ * selects which of them are read relative to TSREF.
+ *
+ * Only registers that differ from what the devices already hold are
+ * written. Contiguous registers go in the same broadcast frame (up to 8
+ * bytes), an unchanged register between two changed ones is rewritten
+ * since one data byte is cheaper than a second 5 byte frame header.
+ *
+ * The wait time follows from the decimation: the sinc3 filter needs 3.5
+ * output periods to settle (7 * DR / 2 us at 1 MHz, 901 us for 256). The
+ * cell channels convert in parallel while the AUX ADC is multiplexed, so
+ * its channels add up. 3 us of re-clocking per board are added on top.
+ */
+bool AdcSequencer::compile(const AdcPlan &plan)
+{
+    int cellDR = decimationCode(plan.cellDecimation, 64, 512);
+    int auxDR = decimationCode(plan.auxDecimation, 32, 256);
+    if ((cellDR < 0) || (auxDR < 0))
+    {
+        Serial.println("Error: unsupported ADC decimation ratio");
+        return false;
+    }
+
+    for (unsigned i = 0; i < ADC_IMAGE_SIZE; i++)
+    {
+        image[i] = 0x00;
+        used[i] = true;
+    }
+
+    image[IMG_CELL_ADC_CONF1] = ((cellDR + 4) << 4) | (plan.cellLPF & 0x07);
+    image[IMG_CELL_ADC_CONF2] = plan.continuous ? (0x08 | (plan.interval & 0x07)) : 0x00;
+    image[IMG_AUX_ADC_CONF] = auxDR << 2;
+    image[IMG_GPIO_ADC_CONF] = plan.ratiometric & 0x3F; // 1 = ratiometric to TSREF, 0 = absolute voltage
+    for (unsigned n = 0; n < 6; n++)
+    {
+        image[IMG_GPIO1_CONF + n] = 0x20;              // GPIO is an ADC input
+        used[IMG_GPIO1_CONF + n] = plan.gpios & (1 << n); // Other GPIOs keep their configuration
+    }
+    image[IMG_CELL_ADC_CTRL] = plan.cells & 0x3F;
+    image[IMG_AUX_ADC_CTRL1] = ((plan.gpios & 0x0F) << 4) | (plan.bat ? 0x01 : 0x00);
+    image[IMG_AUX_ADC_CTRL2] = (plan.gpios >> 4) & 0x03;
+    image[IMG_AUX_ADC_CTRL3] = 0x00;
+
+    // Coalesce the dirty registers into frames
+    programSize = 0;
+    unsigned i = 0;
+    while (i < ADC_IMAGE_SIZE)
+    {
+        if (!dirty(i))
+        {
+            i++;
+            continue;
+        }
+        unsigned last = i;
+        for (unsigned j = i + 1; (j < ADC_IMAGE_SIZE) && used[j] && (imageAddr[j] == imageAddr[j - 1] + 1) && ((j - i) < 8); j++)
+        {
+            if (dirty(j))
+                last = j;
+        }
+
+        RegWrite &w = program[programSize++];
+        w.addr = imageAddr[i];
+        w.len = last - i + 1;
+        w.data = 0;
+        for (unsigned j = i; j <= last; j++)
+            w.data = (w.data << 8) | image[j]; // First register in the most significant byte, as WriteReg sends it
+
+        i = last + 1;
+    }
+
+    // Conversion time
+    unsigned numAux = (plan.bat ? 1 : 0);
+    for (unsigned n = 0; n < 6; n++)
+    {
+        if (plan.gpios & (1 << n))
+            numAux++;
+    }
+    uint32_t cellTime = (plan.cells & 0x3F) ? (7UL * plan.cellDecimation) / 2 + 5 : 0;
+    uint32_t auxTime = numAux * ((7UL * plan.auxDecimation) / 2 + 5);
+    conversionTime = max(cellTime, auxTime) + 3 * TOTALBOARDS;
+    cellConversionTime = cellTime ? cellTime + 3 * TOTALBOARDS : 0;
+
+    goBits = CONTROL2_TSREF_EN;
+    if (plan.cells & 0x3F)
+        goBits |= CONTROL2_CELL_ADC_GO;
+    if (numAux > 0)
+        goBits |= CONTROL2_AUX_ADC_GO;
+
+    return true;
+}
+
+void AdcSequencer::apply()
+{
+    for (unsigned n = 0; n < programSize; n++)
+    {
+        WriteReg(0, program[n].addr, program[n].data, program[n].len, FRMWRT_ALL_NR);
+    }
+    for (unsigned i = 0; i < ADC_IMAGE_SIZE; i++)
+    {
+        if (used[i])
+        {
+            written[i] = image[i];
+            writtenValid[i] = true;
+        }
+    }
+    programSize = 0;
+}
+
+void AdcSequencer::start()
+{
+    WriteReg(0, CONTROL2, goBits, 1, FRMWRT_ALL_NR);
+    tStart = micros();
+}
+
+void AdcSequencer::printProgram()
+{
+    Serial.println((String) "ADC program: " + programSize + " frames, conversion time " + conversionTime + " us (cells " +
+                   cellConversionTime + " us)");
+    for (unsigned n = 0; n < programSize; n++)
+    {
+        Serial.print("0x");
+        Serial.print(program[n].addr, HEX);
+        Serial.print((String) " len " + program[n].len + " data 0x");
+        for (int b = program[n].len - 1; b >= 0; b--)
+        {
+            byte v = (program[n].data >> (8 * b)) & 0xFF;
+            if (v < 0x10)
+                Serial.print("0");
+            Serial.print(v, HEX);
+        }
+        Serial.println();
+    }
+}
@@ -0,0 +1,97 @@
+//********BQ79606 ADC SEQUENCER
+#ifndef BQADC_H
+#define BQADC_H
+
+#include <Arduino.h>
+#include "BQ79606.h"
+
+#define ADC_IMAGE_SIZE 14 // ADC related registers handled by the sequencer
+
+// CONTROL2 bits
+#define CONTROL2_CELL_ADC_GO 0x01
+#define CONTROL2_AUX_ADC_GO  0x02
+#define CONTROL2_TSREF_EN    0x10
+
+// Declarative description of what the stack has to measure
+struct AdcPlan
+{
+    uint8_t cells;           // Cell channels to convert, bit n = cell n+1
+    uint8_t gpios;           // GPIOs converted by the AUX ADC, bit n = GPIO n+1
+    uint8_t ratiometric;     // GPIOs measured relative to TSREF (thermistors), bit n = GPIO n+1
+    bool bat;                // Convert BAT (stack voltage) with the AUX ADC
+    uint16_t cellDecimation; // Main ADC decimation ratio: 64, 128, 256 or 512
+    uint16_t auxDecimation;  // AUX ADC decimation ratio: 32, 64, 128 or 256
+    uint8_t cellLPF;         // Cell low pass filter code (CELL_ADC_CONF1[2:0], 7 = 1.2 Hz)
+    bool continuous;         // Continuous conversions instead of one per CELL_ADC_GO
+    uint8_t interval;        // Continuous conversion interval code (CELL_ADC_CONF2[2:0], 0 = minimum, 2 = 5 ms)
+};
+
+class AdcSequencer
+{
+public:
+    AdcSequencer()
+    {
+        programSize = 0;
+        conversionTime = 0;
+        cellConversionTime = 0;
+        goBits = CONTROL2_TSREF_EN;
+        tStart = 0;
+        invalidate();
+    }
+
+    // Translates the plan into register values and the minimal list of broadcast writes
+    // needed to move the stack from the last applied configuration to this one.
+    // return false if the plan has an unsupported decimation ratio
+    bool compile(const AdcPlan &plan);
+
+    // Writes the compiled program to every device
+    void apply();
+
+    // Starts a conversion (CONTROL2 GO bits, TSREF kept on)
+    void start();
+
+    // True once the conversion started by start() is complete, never waits
+    bool isReady() const { return (micros() - tStart) >= conversionTime; }
+
+    // Time in us from start() until every planned channel has a result
+    uint32_t getConversionTime() const { return conversionTime; }
+
+    // Time in us from start() until the cell channels have a result (the AUX sequence can take longer)
+    uint32_t getCellConversionTime() const { return cellConversionTime; }
+
+    // Forgets what the devices hold, the next compile() writes every register (after a reset or readdressing)
+    void invalidate()
+    {
+        for (unsigned i = 0; i < ADC_IMAGE_SIZE; i++)
+            writtenValid[i] = false;
+    }
+
+    void printProgram();
+
+private:
+    struct RegWrite
+    {
+        uint16_t addr;
+        byte len;
+        uint64_t data;
+    };
+
+    static const uint16_t imageAddr[ADC_IMAGE_SIZE];
+    byte image[ADC_IMAGE_SIZE];   // Register values for the compiled plan
+    bool used[ADC_IMAGE_SIZE];    // Registers the plan writes
+    byte written[ADC_IMAGE_SIZE]; // Register values the devices already have
+    bool writtenValid[ADC_IMAGE_SIZE];
+
+    RegWrite program[ADC_IMAGE_SIZE];
+    unsigned programSize;
+
+    uint32_t conversionTime;
+    uint32_t cellConversionTime;
+    byte goBits;
+    unsigned long tStart;
+
+    static int decimationCode(uint16_t ratio, uint16_t minRatio, uint16_t maxRatio);
+    bool dirty(unsigned i) const { return used[i] && (!writtenValid[i] || (written[i] != image[i])); }
+};
+
+#endif
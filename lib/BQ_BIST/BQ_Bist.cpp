@@ -0,0 +1,118 @@
+#include "BQ_Bist.h"
+
+void BistRunner::step(bool idle, LinkSupervisor &link)
+{
+    if (!link.isUp())
+    {
+        // The devices may be reset by the recovery, start again later
+        state = BIST_IDLE;
+        return;
+    }
+
+    switch (state)
+    {
+    case BIST_IDLE:
+        if (idle && (requested || (period && (millis() - lastRun >= period))))
+            start();
+        break;
+    case BIST_POLLING:
+        poll(link);
+        break;
+    case BIST_RESULT:
+        finish(link);
+        break;
+    }
+}
+
+/**
+ * The BIST faults stay masked (InitDevices()), a failure does not pull the
+ * FAULT line; the status registers latch it anyway.
+ */
+void BistRunner::start()
+{
+    requested = false;
+    polls = 0;
+    runningMask = 0;
+    WriteReg(0, OVUV_BIST_FLT_RST, (OVUV_BIST_FAULT_MASK << 8) | OTUT_BIST_FAULT_MASK, 2, FRMWRT_ALL_NR);
+    WriteReg(0, DIAG_CTRL1, DIAG_CTRL1_OVUV_BIST_GO | DIAG_CTRL1_OTUT_BIST_GO, 1, FRMWRT_ALL_NR);
+    state = BIST_POLLING;
+}
+
+void BistRunner::poll(LinkSupervisor &link)
+{
+    static byte frame[(1 + 6) * TOTALBOARDS];
+
+    polls++;
+    int result = ReadReg(0, DEV_STAT, frame, 1, BIST_READ_TIMEOUT, FRMWRT_ALL_R);
+    link.reportStack(result);
+
+    // A board that did not answer is still counted as running, the others by the address in their frame
+    uint32_t badMask = dwTimeoutMask | dwCRCFaultMask;
+    runningMask = badMask;
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = FrameBoard(&frame[n * (1 + 6)], 1);
+        if ((board < 0) || (board >= TOTALBOARDS) || (badMask & (1UL << board)))
+            continue;
+        if (frame[n * (1 + 6) + 4] & (DEV_STAT_OVUV_BIST_RUN | DEV_STAT_OTUT_BIST_RUN))
+            runningMask |= 1UL << board;
+    }
+
+    if (!runningMask || (polls >= BIST_MAX_POLLS))
+        state = BIST_RESULT;
+}
+
+void BistRunner::finish(LinkSupervisor &link)
+{
+    static byte frame[(2 + 6) * TOTALBOARDS];
+
+    int result = ReadReg(0, OVUV_BIST_FAULT, frame, 2, BIST_READ_TIMEOUT, FRMWRT_ALL_R);
+    link.reportStack(result);
+
+    passMask = 0;
+    failMask = runningMask;
+    missingMask = dwTimeoutMask | dwCRCFaultMask;
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = FrameBoard(&frame[n * (2 + 6)], 2);
+        if ((board < 0) || (board >= TOTALBOARDS) || (missingMask & (1UL << board)))
+            continue;
+        uint32_t bit = 1UL << board;
+        const byte *data = &frame[n * (2 + 6) + 4];
+        ovuvFault[board] = data[0] & OVUV_BIST_FAULT_MASK;
+        otutFault[board] = data[1] & OTUT_BIST_FAULT_MASK;
+        if (ovuvFault[board] || otutFault[board])
+            failMask |= bit;
+    }
+    failMask &= ~missingMask;
+    passMask = ~(failMask | missingMask) & (0xFFFFFFFF >> (32 - TOTALBOARDS));
+
+    numRuns++;
+    if (failMask | missingMask)
+        numFailedRuns++;
+    lastRun = millis();
+    state = BIST_IDLE;
+}
+
+void BistRunner::print()
+{
+    Serial.print((String) "BIST runs: " + numRuns + " failed: " + numFailedRuns);
+    if (!numRuns)
+    {
+        Serial.println();
+        return;
+    }
+    Serial.print(", last:");
+    for (unsigned b = 0; b < TOTALBOARDS; b++)
+    {
+        uint32_t bit = 1UL << b;
+        Serial.print((String) " " + b + "=");
+        if (missingMask & bit)
+            Serial.print("?");
+        else if (failMask & bit)
+            Serial.print((String) "FAIL(0x" + String(ovuvFault[b], HEX) + "/0x" + String(otutFault[b], HEX) + ")");
+        else
+            Serial.print("ok");
+    }
+    Serial.println();
+}
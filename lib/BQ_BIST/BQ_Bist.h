@@ -0,0 +1,78 @@
+//********BQ79606 COMPARATOR SELF-TEST
+#ifndef BQBIST_H
+#define BQBIST_H
+
+#include <Arduino.h>
+#include "BQ79606.h"
+#include "BQ_Link.h"
+
+// Bit positions from the BQ79606A register map
+#define DIAG_CTRL1_OVUV_BIST_GO 0x01 // DIAG_CTRL1: starts the OV/UV comparator BIST
+#define DIAG_CTRL1_OTUT_BIST_GO 0x02 // DIAG_CTRL1: starts the OT/UT comparator BIST
+#define DEV_STAT_OVUV_BIST_RUN  0x10 // DEV_STAT: OV/UV BIST in progress
+#define DEV_STAT_OTUT_BIST_RUN  0x20 // DEV_STAT: OT/UT BIST in progress
+#define OVUV_BIST_FAULT_MASK    0x03 // Meaningful bits of OVUV_BIST_FAULT
+#define OTUT_BIST_FAULT_MASK    0xFF // Meaningful bits of OTUT_BIST_FAULT
+
+#define BIST_READ_TIMEOUT 2000 // First byte timeout of the status reads in us
+#define BIST_MAX_POLLS    3    // Scans the BIST may take before the boards still running count as failed
+
+/**
+ * OV/UV and OT/UT comparator BIST of the whole stack. Every board runs it
+ * at the same time (broadcast writes), so the duration does not depend on
+ * the length of the chain.
+ *
+ * step() is called once per scan by the task that owns the UART and does
+ * at most one register access of the sequence each time:
+ *   start:   broadcast clear of the latched BIST faults and GO
+ *   polling: one stack read of DEV_STAT until no board is running
+ *   result:  one stack read of OVUV_BIST_FAULT/OTUT_BIST_FAULT
+ * A run only starts in an idle window (the caller says when), and it
+ * finishes within BIST_MAX_POLLS scans whatever the devices do; the
+ * measurement reads of those scans carry on as usual.
+ */
+class BistRunner
+{
+public:
+    enum State
+    {
+        BIST_IDLE,
+        BIST_POLLING,
+        BIST_RESULT
+    };
+
+    // Runs a BIST every period ms (0: only on request)
+    void begin(unsigned long _period) { period = _period; }
+
+    // Next idle window, whatever the period. Any task
+    void request() { requested = true; }
+
+    // One access of the sequence. idle: nothing else is using this scan's spare time
+    void step(bool idle, LinkSupervisor &link);
+
+    bool isRunning() const { return state != BIST_IDLE; }
+
+    void print();
+
+    //** BIST RESULT DATA **//
+    uint32_t passMask = 0;                  // Boards that passed the last run
+    uint32_t failMask = 0;                  // Boards with a BIST fault or still running at the end
+    uint32_t missingMask = 0;               // Boards that did not answer the result read
+    uint8_t ovuvFault[TOTALBOARDS] = {};    // OVUV_BIST_FAULT of each board in the last run
+    uint8_t otutFault[TOTALBOARDS] = {};    // OTUT_BIST_FAULT of each board in the last run
+    unsigned long numRuns = 0, numFailedRuns = 0;
+    unsigned long lastRun = 0;              // millis() at the end of the last run
+
+private:
+    State state = BIST_IDLE;
+    volatile bool requested = false;
+    unsigned long period = 0;
+    uint8_t polls = 0;
+    uint32_t runningMask = 0;
+
+    void start();
+    void poll(LinkSupervisor &link);
+    void finish(LinkSupervisor &link);
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include "BQ_Cal.h"
+
+void CellCalibration::begin(const int16_t (*_gain)[CELLS_PER_BOARD], const int16_t (*_offset)[CELLS_PER_BOARD],
+                            int16_t _tolerance)
+{
+    gain = _gain;
+    offset = _offset;
+    tolerance = _tolerance;
+    setCellCalibration(gain, offset);
+}
+
+/**
+ * Six cross-checks (one per cell position, all boards at once), then the
+ * AUX ADC goes back to cell 1 as InitDevices() left it. Blocks for about
+ * six AUX conversions: for the boot or a service window, not for a scan.
+ */
+uint32_t CellCalibration::validate(uint32_t waitUs)
+{
+    badMask = 0;
+    missingMask = 0;
+    for (unsigned b = 0; b < TOTALBOARDS; b++)
+        worstDiff[b] = 0;
+
+    int16_t diff[TOTALBOARDS];
+    uint32_t failMask;
+    for (uint8_t cell = 0; cell < CELLS_PER_BOARD; cell++)
+    {
+        crossCheck(cell, waitUs, diff, failMask);
+        missingMask |= failMask;
+        for (unsigned b = 0; b < TOTALBOARDS; b++)
+        {
+            if (failMask & (1UL << b))
+                continue;
+            int16_t d = abs(diff[b]);
+            if (d > worstDiff[b])
+                worstDiff[b] = d;
+            if (d > tolerance)
+                badMask |= (1UL << b);
+        }
+    }
+    WriteReg(0, DIAG_CTRL2, DIAG_CTRL2_AUX_CELL | 1, 1, FRMWRT_ALL_NR);
+    rotCell = 0;
+    return badMask;
+}
+
+/**
+ * Boards whose cells were not decoded in this scan are skipped, their flag
+ * keeps the last result. A drift counts once, when the flag goes up.
+ */
+int CellCalibration::rotate(PackSnapshot &snap)
+{
+    static byte frame[(2 + 6) * TOTALBOARDS];
+
+    // A timeout of one board fails the read, the others are still compared
+    int result = ReadReg(0, AUX_CELLH, frame, 2, CAL_AUX_READ_TIMEOUT, FRMWRT_ALL_R);
+    uint32_t skip = dwTimeoutMask | dwCRCFaultMask | ~snap.cellValid;
+    uint8_t bit = 1 << rotCell;
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = FrameBoard(&frame[n * (2 + 6)], 2);
+        if ((board < 0) || (board >= TOTALBOARDS) || (skip & (1UL << board)))
+            continue;
+        const byte *data = &frame[n * (2 + 6) + 4];
+        int16_t auxCode = (int16_t)((data[0] << 8) | data[1]);
+        numChecks++;
+        if (abs(snap.cellCode[board][rotCell] - auxCode) > tolerance)
+        {
+            if (!(snap.cellDrift[board] & bit))
+                numDrifts++;
+            snap.cellDrift[board] |= bit;
+        }
+        else
+            snap.cellDrift[board] &= ~bit;
+    }
+
+    // Next position, converted by the time of the next scan
+    rotCell = (rotCell + 1) % CELLS_PER_BOARD;
+    WriteReg(0, DIAG_CTRL2, DIAG_CTRL2_AUX_CELL | (rotCell + 1), 1, FRMWRT_ALL_NR);
+    return result;
+}
+
+bool CellCalibration::crossCheck(uint8_t cell, uint32_t waitUs, int16_t diff[TOTALBOARDS], uint32_t &failMask)
+{
+    static byte frame[(4 + 6) * TOTALBOARDS];
+
+    WriteReg(0, DIAG_CTRL2, DIAG_CTRL2_AUX_CELL | (cell + 1), 1, FRMWRT_ALL_NR);
+    delayMicroseconds(waitUs);
+    // A timeout of one board fails the read, the boards that answered are still compared
+    ReadReg(0, VCELL_FACTCORRH, frame, 4, CAL_AUX_READ_TIMEOUT, FRMWRT_ALL_R);
+    failMask = dwTimeoutMask | dwCRCFaultMask;
+
+    // VCELL_FACTCORRH/L then AUX_CELLH/L, each frame goes to the board whose address it carries
+    for (unsigned b = 0; b < TOTALBOARDS; b++)
+        diff[b] = 0;
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = FrameBoard(&frame[n * (4 + 6)], 4);
+        if ((board < 0) || (board >= TOTALBOARDS) || (failMask & (1UL << board)))
+            continue;
+        const byte *data = &frame[n * (4 + 6) + 4];
+        int16_t mainCode = (int16_t)((data[0] << 8) | data[1]);
+        int16_t auxCode = (int16_t)((data[2] << 8) | data[3]);
+        if (gain)
+            mainCode = calibrateCell(mainCode, gain[board][cell], offset[board][cell]);
+        diff[board] = mainCode - auxCode;
+    }
+    return failMask != (0xFFFFFFFF >> (32 - TOTALBOARDS));
+}
+
+void CellCalibration::print()
+{
+    Serial.print((String) "Calibration check (tolerance " + tolerance + "):");
+    for (unsigned b = 0; b < TOTALBOARDS; b++)
+    {
+        Serial.print((String) " " + b + "=");
+        if (missingMask & (1UL << b))
+            Serial.print("?");
+        else
+            Serial.print((String)worstDiff[b] + ((badMask & (1UL << b)) ? "!" : ""));
+    }
+    Serial.println((String) ", background: " + numChecks + " cells checked, " + numDrifts + " drifts");
+}
@@ -0,0 +1,62 @@
+//********BQ79606 CELL CALIBRATION
+#ifndef BQCAL_H
+#define BQCAL_H
+
+#include <Arduino.h>
+#include "BQ79606.h"
+#include "PackSnapshot.h"
+
+#define DIAG_CTRL2_AUX_CELL   0x40 // DIAG_CTRL2: the AUX ADC measures the cell in [2:0] (1..6)
+#define CAL_AUX_TOLERANCE     26   // Default largest main/AUX difference, 190.73 uV/LSB (5 mV)
+#define CAL_AUX_READ_TIMEOUT  2000 // First byte timeout of the cross-check read in us
+
+/**
+ * Per cell gain and offset on top of the factory trim of the devices.
+ * The correction itself is calibrateCell() in decodeCells(), integer only;
+ * this class hands it the tables and checks the result against the AUX
+ * ADC: with DIAG_CTRL2 selecting a cell, VCELL_FACTCORR (main ADC) and
+ * AUX_CELL (AUX ADC, its own reference) of that cell are 4 consecutive
+ * registers, one stack read gives both for every board.
+ *
+ * In service the check runs in the background, one cell position per scan
+ * (the same one on every board): the AUX_CELL reading is compared with the
+ * calibrated cell of the scan snapshot, and the AUX ADC moves on to the
+ * next position for the following scan. Every cell of the pack is checked
+ * each CELLS_PER_BOARD scans at the cost of one 2 byte stack read and one
+ * broadcast write per scan.
+ */
+class CellCalibration
+{
+public:
+    // Tables from the configuration (gain in 2^-CAL_GAIN_SHIFT, offset in codes), kept by reference
+    void begin(const int16_t (*_gain)[CELLS_PER_BOARD], const int16_t (*_offset)[CELLS_PER_BOARD],
+               int16_t _tolerance = CAL_AUX_TOLERANCE);
+
+    // Compares the calibrated main ADC with the AUX ADC on every cell of every board. waitUs: one AUX
+    // conversion. Returns the boards out of tolerance; boards that did not answer are in missingMask
+    uint32_t validate(uint32_t waitUs);
+
+    // Main minus AUX of one cell on every board, the boards that did not answer in failMask. false if none did
+    bool crossCheck(uint8_t cell, uint32_t waitUs, int16_t diff[TOTALBOARDS], uint32_t &failMask);
+
+    // Background check, after the cells of the scan have been decoded into snap. Returns the ReadReg result
+    int rotate(PackSnapshot &snap);
+
+    // InitDevices() selected cell 1 again (the stack was reconfigured)
+    void restart() { rotCell = 0; }
+
+    void print();
+
+    //** CALIBRATION DATA **//
+    int16_t worstDiff[TOTALBOARDS]; // Largest |main - AUX| of each board in the last validate()
+    uint32_t badMask = 0, missingMask = 0;
+    int16_t tolerance = CAL_AUX_TOLERANCE;
+    unsigned long numChecks = 0, numDrifts = 0; // Cells compared by rotate() and comparisons that went out of tolerance
+
+private:
+    const int16_t (*gain)[CELLS_PER_BOARD] = nullptr;
+    const int16_t (*offset)[CELLS_PER_BOARD] = nullptr;
+    uint8_t rotCell = 0; // Cell position the AUX ADC is measuring
+};
+
+#endif
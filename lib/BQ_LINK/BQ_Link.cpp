@@ -0,0 +1,199 @@
+#include "BQ_Link.h"
+
+/**
+ * Records the result of a single device ReadReg for the given board.
+ * Timeouts and CRC failures are counted separately; a good read clears
+ * the consecutive counters of that board.
+ */
+void LinkSupervisor::report(byte board, int result)
+{
+    if (board >= TOTALBOARDS)
+        return;
+
+    if (result == BQ_READ_TIMEOUT)
+        recordFault(board, true);
+    else if (result == BQ_READ_CRC_ERROR)
+        recordFault(board, false);
+    else
+        recordOK(board);
+}
+
+/**
+ * Records the result of a FRMWRT_ALL_R read. ReadReg leaves the boards
+ * that did not answer or answered with a bad CRC in dwTimeoutMask and
+ * dwCRCFaultMask, so every board is accounted with a single stack read.
+ */
+void LinkSupervisor::reportStack(int result)
+{
+    for (byte board = 0; board < TOTALBOARDS; board++)
+    {
+        if (dwTimeoutMask & (1UL << board))
+            recordFault(board, true);
+        else if (dwCRCFaultMask & (1UL << board))
+            recordFault(board, false);
+        else if (result != 0)
+            recordOK(board); // answered, even if another board made the read fail
+    }
+}
+
+/**
+ * Advances the recovery state machine. Each call runs at most one recovery
+ * action (CommClear, CommSleepToWake, CommReset, readdressing or the
+ * reconfiguration) or one probe read, so the caller is never blocked for
+ * more than a single step. If the probe after an action finds the chain
+ * answering, the link goes back to LINK_OK; otherwise the next, heavier
+ * action is tried. When readdressing also fails the supervisor waits with
+ * an exponential backoff and starts over.
+ *
+ * The two long steps run in different calls. Readdressing reads with the
+ * probe timeout: (4 + 3 * TOTALBOARDS) * LINK_READDRESS_DELAY ms of waits
+ * plus 2 * TOTALBOARDS reads of 2 ms at most, about 115 ms for 16 boards.
+ * The reconfiguration only runs once the probe has found every board at
+ * its address, so its reads do not time out: about 100 ms for 16 boards.
+ * return true if the link is up.
+ */
+bool LinkSupervisor::update()
+{
+    switch (state)
+    {
+    case LINK_OK:
+        break;
+
+    case LINK_DOWN:
+        if ((millis() - tDown) >= retryInterval)
+        {
+            retryInterval = min(retryInterval * 2, (unsigned long)LINK_RETRY_MAX);
+            state = LINK_CLEAR;
+            actionDone = false;
+        }
+        break;
+
+    default:
+        if (!actionDone)
+        {
+            runAction();
+            actionDone = true;
+            tAction = micros();
+        }
+        else if ((micros() - tAction) >= LINK_SETTLE_TIME)
+        {
+            bool answering = probe();
+            if (answering && (state == LINK_READDRESS) && (reconfigure != nullptr))
+            {
+                state = LINK_RECONFIGURE; // Addresses back, the configuration goes in the next call
+            }
+            else if (answering)
+            {
+                // Chain answering again, forget the faults that started the recovery
+                state = LINK_OK;
+                retryInterval = LINK_RETRY_MIN;
+                for (unsigned i = 0; i < TOTALBOARDS; i++)
+                {
+                    consecutiveTimeouts[i] = 0;
+                    consecutiveCRCErrors[i] = 0;
+                }
+            }
+            else if (state >= LINK_READDRESS)
+            {
+                state = LINK_DOWN;
+                tDown = millis();
+            }
+            else
+            {
+                state = (State)(state + 1); // Escalate
+            }
+            actionDone = false;
+        }
+        break;
+    }
+    return state == LINK_OK;
+}
+
+void LinkSupervisor::printStatus()
+{
+    Serial.println((String) "Link state: " + state + " recoveries: " + numRecoveries);
+    for (unsigned i = 0; i < TOTALBOARDS; i++)
+    {
+        Serial.println((String) "Board " + i + " timeouts: " + totalTimeouts[i] + " CRC errors: " + totalCRCErrors[i] +
+                       (isStale(i) ? " (stale)" : ""));
+    }
+}
+
+void LinkSupervisor::recordFault(byte board, bool timeout)
+{
+    valid[board] = false;
+    if (timeout)
+    {
+        consecutiveTimeouts[board]++;
+        totalTimeouts[board]++;
+    }
+    else
+    {
+        consecutiveCRCErrors[board]++;
+        totalCRCErrors[board]++;
+    }
+
+    if ((state == LINK_OK) &&
+        ((consecutiveTimeouts[board] >= LINK_MAX_TIMEOUTS) || (consecutiveCRCErrors[board] >= LINK_MAX_CRC_ERRORS)))
+    {
+        startRecovery();
+    }
+}
+
+void LinkSupervisor::recordOK(byte board)
+{
+    consecutiveTimeouts[board] = 0;
+    consecutiveCRCErrors[board] = 0;
+    lastGoodTime[board] = millis();
+    valid[board] = true;
+}
+
+void LinkSupervisor::startRecovery()
+{
+    state = LINK_CLEAR;
+    actionDone = false;
+    numRecoveries++;
+}
+
+void LinkSupervisor::runAction()
+{
+    switch (state)
+    {
+    case LINK_CLEAR:
+        CommClear();
+        break;
+    case LINK_SLEEP_TO_WAKE:
+        CommSleepToWake();
+        break;
+    case LINK_RESET:
+        NegotiateBaud(BAUDRATE);
+        break;
+    case LINK_READDRESS:
+        AutoAddress(LINK_READDRESS_DELAY, LINK_PROBE_TIMEOUT);
+        break;
+    case LINK_RECONFIGURE:
+        reconfigure();
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Reads DEVADD_USR from the whole stack with one broadcast read and a short
+ * timeout. The chain is considered up if every board answers with a valid
+ * CRC and its own address (the response starts with the top of the stack).
+ */
+bool LinkSupervisor::probe()
+{
+    byte frame[(1 + 6) * TOTALBOARDS];
+    if (ReadReg(0, DEVADD_USR, frame, 1, LINK_PROBE_TIMEOUT, FRMWRT_ALL_R) <= 0)
+        return false;
+
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        if (frame[n * 7 + 4] != (TOTALBOARDS - 1 - n))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,92 @@
+//********BQ79606 DAISY CHAIN LINK SUPERVISOR
+#ifndef BQLINK_H
+#define BQLINK_H
+
+#include <Arduino.h>
+#include "BQ79606.h"
+
+#define LINK_MAX_TIMEOUTS    3      //Consecutive timeouts of a board before starting a recovery
+#define LINK_MAX_CRC_ERRORS  3      //Consecutive CRC failures of a board before starting a recovery
+#define LINK_PROBE_TIMEOUT   2000   //First byte timeout of the probe read in us
+#define LINK_SETTLE_TIME     200    //Time in us between a recovery action and its probe
+#define LINK_READDRESS_DELAY 1      //ms between addressing commands while recovering
+#define LINK_RETRY_MIN       100    //First wait in ms before retrying a failed recovery
+#define LINK_RETRY_MAX       2000   //Maximum wait in ms between recoveries
+
+class LinkSupervisor
+{
+public:
+    // Recovery escalation, each step is only tried if the previous one did not bring the chain back
+    enum State
+    {
+        LINK_OK,
+        LINK_CLEAR,         // CommClear
+        LINK_SLEEP_TO_WAKE, // CommSleepToWake
+        LINK_RESET,         // CommReset with baudrate negotiation
+        LINK_READDRESS,     // AutoAddress
+        LINK_RECONFIGURE,   // The addresses are back, the configuration is written again (next call)
+        LINK_DOWN           // Every step failed, waiting to retry
+    };
+
+    // _reconfigure is called one update() after the stack has been readdressed and answers again
+    LinkSupervisor(void (*_reconfigure)(void) = nullptr)
+    {
+        reconfigure = _reconfigure;
+        state = LINK_OK;
+        actionDone = false;
+        retryInterval = LINK_RETRY_MIN;
+        numRecoveries = 0;
+        for (unsigned i = 0; i < TOTALBOARDS; i++)
+        {
+            consecutiveTimeouts[i] = 0;
+            consecutiveCRCErrors[i] = 0;
+            totalTimeouts[i] = 0;
+            totalCRCErrors[i] = 0;
+            lastGoodTime[i] = 0;
+            valid[i] = false;
+        }
+    }
+
+    // Records the result of a single device ReadReg
+    void report(byte board, int result);
+
+    // Records the result of a stack or broadcast ReadReg using the ReadReg fault masks
+    void reportStack(int result);
+
+    // Runs at most one recovery action per call (readdressing or reconfiguring: ~100 ms for 16 boards,
+    // everything else below 1 ms). Returns true while the link is up
+    bool update();
+
+    bool isUp() const { return state == LINK_OK; }
+    State getState() const { return state; }
+
+    // A board is stale if its last read failed or the link is being recovered
+    bool isStale(byte board) const { return (state != LINK_OK) || !valid[board]; }
+
+    // The measurements themselves live in the PackSnapshot (lib/PACK)
+    unsigned long getLastGoodTime(byte board) const { return lastGoodTime[board]; }
+
+    void printStatus();
+
+    //** LINK STATUS DATA **//
+    unsigned consecutiveTimeouts[TOTALBOARDS], consecutiveCRCErrors[TOTALBOARDS];
+    unsigned long totalTimeouts[TOTALBOARDS], totalCRCErrors[TOTALBOARDS];
+    unsigned long numRecoveries;
+
+private:
+    void (*reconfigure)(void);
+    State state;
+    bool actionDone;
+    unsigned long tAction, tDown, retryInterval;
+
+    unsigned long lastGoodTime[TOTALBOARDS];
+    bool valid[TOTALBOARDS];
+
+    void recordFault(byte board, bool timeout);
+    void recordOK(byte board);
+    void startRecovery();
+    void runAction();
+    bool probe();
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "BQ_OpenWire.h"
+
+void OpenWireCheck::begin(AdcSequencer &_adc, bool _continuous, unsigned long _period, int16_t _threshold)
+{
+    adc = &_adc;
+    continuous = _continuous;
+    period = _period;
+    threshold = _threshold;
+}
+
+void OpenWireCheck::step(bool idle, LinkSupervisor &link)
+{
+    if (!idle || !link.isUp() || !(requested || (period && (millis() - lastRun >= period))))
+        return;
+    requested = false;
+    run(link);
+}
+
+/**
+ * The currents are always switched off before returning, and the sense
+ * filters get one more settle + conversion so the next scan reads the
+ * cells as they are. A board missing from either read keeps its previous
+ * result; the others are decided anyway.
+ */
+bool OpenWireCheck::run(LinkSupervisor &link)
+{
+    static int16_t down[TOTALBOARDS][CELLS_PER_BOARD], up[TOTALBOARDS][CELLS_PER_BOARD];
+
+    unsigned long tStart = micros();
+    missingMask = 0;
+    measure(CB_CS_CTRL_CHANNELS, down, link);
+    measure(CB_CS_CTRL_CHANNELS | CB_CS_CTRL_SOURCE, up, link);
+    WriteReg(0, CB_CS_CTRL, 0x00, 1, FRMWRT_ALL_NR);
+    settle();
+
+    boardMask = 0;
+    for (unsigned b = 0; b < TOTALBOARDS; b++)
+    {
+        if (!(missingMask & (1UL << b)))
+        {
+            uint8_t mask = 0;
+            for (uint8_t k = 0; k <= CELLS_PER_BOARD; k++)
+            {
+                if ((k < CELLS_PER_BOARD) && (down[b][k] - up[b][k] > threshold))
+                    mask |= 1 << k;
+                if ((k > 0) && (up[b][k - 1] - down[b][k - 1] > threshold))
+                    mask |= 1 << k;
+            }
+            if (mask && (mask != openMask[b]))
+                numDetections++;
+            openMask[b] = mask;
+        }
+        if (openMask[b])
+            boardMask |= 1UL << b;
+    }
+
+    bool ok = missingMask != (0xFFFFFFFF >> (32 - TOTALBOARDS));
+    if (ok)
+        numRuns++;
+    lastRun = millis();
+    lastDuration = micros() - tStart;
+    return ok;
+}
+
+// One stack read of the corrected cell registers with the currents in csCtrl, failed boards added to missingMask
+void OpenWireCheck::measure(uint8_t csCtrl, int16_t cells[TOTALBOARDS][CELLS_PER_BOARD], LinkSupervisor &link)
+{
+    static byte frame[(2 * CELLS_PER_BOARD + 6) * TOTALBOARDS];
+
+    WriteReg(0, CB_CS_CTRL, csCtrl, 1, FRMWRT_ALL_NR);
+    settle();
+    int result = ReadReg(0, VCELL1H, frame, 2 * CELLS_PER_BOARD, OW_READ_TIMEOUT, FRMWRT_ALL_R);
+    link.reportStack(result);
+    uint32_t failMask = dwTimeoutMask | dwCRCFaultMask;
+    missingMask |= failMask;
+
+    // Each frame goes to the board whose address it carries, a missing board leaves no gap
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = FrameBoard(&frame[n * (2 * CELLS_PER_BOARD + 6)], 2 * CELLS_PER_BOARD);
+        if ((board < 0) || (board >= TOTALBOARDS) || (failMask & (1UL << board)))
+            continue;
+        const byte *data = &frame[n * (2 * CELLS_PER_BOARD + 6) + 4];
+        for (unsigned c = 0; c < CELLS_PER_BOARD; c++)
+            cells[board][c] = (int16_t)((data[2 * c] << 8) | data[2 * c + 1]);
+    }
+}
+
+// Filter settling, then a whole conversion that starts after it (in continuous mode the one running is discarded)
+void OpenWireCheck::settle()
+{
+    delayMicroseconds(OW_SETTLE_US);
+    if (!continuous)
+        adc->start();
+    delayMicroseconds((continuous ? 2 : 1) * adc->getConversionTime());
+}
+
+void OpenWireCheck::print()
+{
+    Serial.print((String) "Open wire checks: " + numRuns + " detections: " + numDetections + " (" + lastDuration + " us)");
+    for (unsigned b = 0; b < TOTALBOARDS; b++)
+    {
+        if (missingMask & (1UL << b))
+            Serial.print((String) " " + b + "=?");
+        else if (openMask[b])
+            Serial.print((String) " " + b + "=0x" + String(openMask[b], HEX));
+    }
+    Serial.println();
+}
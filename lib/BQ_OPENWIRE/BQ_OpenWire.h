@@ -0,0 +1,70 @@
+//********BQ79606 OPEN WIRE DETECTION
+#ifndef BQOPENWIRE_H
+#define BQOPENWIRE_H
+
+#include <Arduino.h>
+#include "BQ79606.h"
+#include "BQ_ADC.h"
+#include "BQ_Link.h"
+#include "PackSnapshot.h"
+
+// Bit positions from the BQ79606A register map
+#define CB_CS_CTRL_CHANNELS 0x3F // CB_CS_CTRL: current on the sense input of each cell, bit n = cell n+1
+#define CB_CS_CTRL_SOURCE   0x40 // CB_CS_CTRL: source (pull up) instead of sink (pull down)
+
+#define OW_THRESHOLD     2621 // Default pull down/pull up difference of an open wire, 190.73 uV/LSB (0.5 V)
+#define OW_SETTLE_US     5000 // Sense filter settling after switching the currents
+#define OW_READ_TIMEOUT  2000 // First byte timeout of the cell reads in us
+
+/**
+ * Broken sense wires of the whole stack, every board at once. Each cell
+ * is measured twice, with a current pulling its sense inputs down and then
+ * up (CB_CS_CTRL, broadcast). A connected input is held by the cell and
+ * barely moves; an open one follows the current, so of the two cells that
+ * share it the lower one reads higher when pulled down than when pulled up
+ * and the upper one the other way round:
+ *   wire k (C0..C6) is open if  down(k+1) - up(k+1) > threshold  (k < 6)
+ *                          or  up(k) - down(k) > threshold        (k > 0)
+ *
+ * run() blocks for two settle + conversion + read slots plus the settling
+ * after switching the currents off, about 30 ms and independent of the
+ * number of boards except for the two stack reads (3 ms for 16 boards at
+ * 1 Mbaud). step() runs it periodically in an idle scan.
+ */
+class OpenWireCheck
+{
+public:
+    // continuous: the ADC converts by itself, otherwise every measurement starts one
+    void begin(AdcSequencer &_adc, bool _continuous, unsigned long _period, int16_t _threshold = OW_THRESHOLD);
+
+    // Next idle window, whatever the period. Any task
+    void request() { requested = true; }
+
+    // Runs the check if it is due. idle: nothing else is using this scan's spare time
+    void step(bool idle, LinkSupervisor &link);
+
+    // The whole check, blocking. false if no board answered both reads
+    bool run(LinkSupervisor &link);
+
+    void print();
+
+    //** OPEN WIRE DATA **//
+    uint8_t openMask[TOTALBOARDS] = {}; // Bit k = sense wire Ck open in the last check
+    uint32_t boardMask = 0;             // Boards with an open wire
+    uint32_t missingMask = 0;           // Boards that did not answer one of the reads
+    unsigned long numRuns = 0, numDetections = 0;
+    unsigned long lastRun = 0;          // millis() at the end of the last check
+    unsigned long lastDuration = 0;     // us
+
+private:
+    AdcSequencer *adc = nullptr;
+    bool continuous = true;
+    unsigned long period = 0;
+    int16_t threshold = OW_THRESHOLD;
+    volatile bool requested = false;
+
+    void measure(uint8_t csCtrl, int16_t cells[TOTALBOARDS][CELLS_PER_BOARD], LinkSupervisor &link);
+    void settle();
+};
+
+#endif
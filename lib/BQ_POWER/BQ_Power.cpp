@@ -0,0 +1,97 @@
+#include "BQ_Power.h"
+
+void PowerManager::begin(AdcSequencer &_adc, bool _continuous, int32_t _parkCurrent, unsigned long _parkDelay)
+{
+    adc = &_adc;
+    continuous = _continuous;
+    parkCurrent = _parkCurrent;
+    parkDelay = _parkDelay;
+    parked = false;
+    tActive = millis();
+}
+
+bool PowerManager::addWakePin(int pin)
+{
+    if ((pin < 0) || (numWakePins >= POWER_MAX_WAKE_PINS))
+        return false;
+    wakePins[numWakePins++] = pin;
+    return true;
+}
+
+void PowerManager::setCurrent(int32_t mA)
+{
+    highCurrent = abs(mA) > parkCurrent;
+}
+
+bool PowerManager::update(bool busy)
+{
+    if (busy || highCurrent)
+    {
+        tActive = millis();
+        if (parked)
+            Serial.println((String) "Power: active (" + (highCurrent ? "current" : "activity") + ") after " +
+                           numSleeps + " sleeps");
+        parked = false;
+    }
+    else if (!parked && (millis() - tActive >= parkDelay))
+    {
+        parked = true;
+        numParks++;
+        Serial.println("Power: parked");
+    }
+    return parked;
+}
+
+/**
+ * The wake pins are level triggered: one already low would end the light
+ * sleep at once, so then nothing is done and the caller just waits.
+ * Wake up and interrupt type share the pin configuration: the low level is
+ * only set for the light sleep, afterwards the pins go back to the falling
+ * edge of the CanManager ISR (a level would keep firing while INT is low).
+ */
+bool PowerManager::sleep(unsigned long ms)
+{
+    for (unsigned i = 0; i < numWakePins; i++)
+        if (digitalRead(wakePins[i]) == LOW)
+            return false;
+
+    CommGoToSleep();
+
+    esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000);
+    for (unsigned i = 0; i < numWakePins; i++)
+        gpio_wakeup_enable((gpio_num_t)wakePins[i], GPIO_INTR_LOW_LEVEL);
+    if (numWakePins)
+        esp_sleep_enable_gpio_wakeup();
+    unsigned long tSleep = millis();
+    esp_light_sleep_start();
+
+    unsigned long tWake = micros();
+    for (unsigned i = 0; i < numWakePins; i++)
+    {
+        gpio_wakeup_disable((gpio_num_t)wakePins[i]);
+        gpio_set_intr_type((gpio_num_t)wakePins[i], GPIO_INTR_NEGEDGE);
+    }
+    sleptMs += millis() - tSleep;
+    numSleeps++;
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER)
+        numEarlyWakes++;
+
+    // SLEEP to ACTIVE keeps the configuration; only the conversions have to start again.
+    // The wake up scan needs the cells, the longer AUX sequence finishes while they are read
+    CommSleepToWake();
+    if (continuous)
+        adc->start();
+    delayMicroseconds(adc->getCellConversionTime());
+
+    lastResumeUs = micros() - tWake;
+    if (lastResumeUs > maxResumeUs)
+        maxResumeUs = lastResumeUs;
+    return true;
+}
+
+void PowerManager::print()
+{
+    Serial.println((String) "Power: " + (parked ? "parked" : "active") + ", parks: " + numParks + " sleeps: " + numSleeps +
+                   " (" + numEarlyWakes + " early, " + sleptMs + " ms), resume: " + lastResumeUs + " us (max " +
+                   maxResumeUs + ")");
+}
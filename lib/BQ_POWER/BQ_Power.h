@@ -0,0 +1,73 @@
+//********BQ79606 POWER MANAGER
+#ifndef BQPOWER_H
+#define BQPOWER_H
+
+#include <Arduino.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include "BQ79606.h"
+#include "BQ_ADC.h"
+
+#define POWER_PARK_CURRENT 500   // Largest |pack current| in mA that counts as parked
+#define POWER_PARK_DELAY   60000 // ms of low current and no activity before parking
+#define POWER_MAX_WAKE_PINS 4
+
+/**
+ * Parked mode for a vehicle that is not being used. While the pack current
+ * stays low and nothing needs the full scan rate, the scans slow down and
+ * between two of them the whole stack is in SLEEP and the ESP32 in light
+ * sleep. A CAN frame (INT line of an MCP2515) wakes it up early.
+ *
+ * SLEEP keeps every register, so resuming is only CommSleepToWake() and a
+ * conversion: no InitDevices(), no readdressing, the configuration written
+ * at boot is still there. That is about 0.4 ms + 0.17 ms per board plus one
+ * cell conversion before the first sample; lastResumeUs measures it.
+ *
+ * Any current above the limit, or the caller reporting activity, goes back
+ * to the active mode at once.
+ */
+class PowerManager
+{
+public:
+    // continuous: the ADC converts by itself (it has to be restarted after SLEEP)
+    void begin(AdcSequencer &_adc, bool _continuous, int32_t _parkCurrent = POWER_PARK_CURRENT,
+               unsigned long _parkDelay = POWER_PARK_DELAY);
+
+    // Low level on pin wakes the ESP32 from light sleep (its falling edge interrupt is kept). false if there is no room
+    bool addWakePin(int pin);
+
+    // Pack current samples in mA
+    void setCurrent(int32_t mA);
+
+    // Once per scan. busy: something needs the full scan rate (diagnostics, download, self-test...). Returns parked
+    bool update(bool busy);
+
+    bool isParked() const { return parked; }
+
+    // Parked: stack and ESP32 asleep for ms at most, then the stack active and converting again.
+    // false (nothing done) if a wake pin is already low
+    bool sleep(unsigned long ms);
+
+    void print();
+
+    //** POWER DATA **//
+    unsigned long numParks = 0, numSleeps = 0, numEarlyWakes = 0;
+    unsigned long sleptMs = 0;          // Total time in light sleep
+    unsigned long lastResumeUs = 0;     // Wake up to first conversion done, of the last sleep
+    unsigned long maxResumeUs = 0;
+
+private:
+    AdcSequencer *adc = nullptr;
+    bool continuous = true;
+    int32_t parkCurrent = POWER_PARK_CURRENT;
+    unsigned long parkDelay = POWER_PARK_DELAY;
+
+    int wakePins[POWER_MAX_WAKE_PINS];
+    unsigned numWakePins = 0;
+
+    volatile bool highCurrent = false;
+    bool parked = false;
+    unsigned long tActive = 0; // millis() of the last current or activity that kept the node active
+};
+
+#endif
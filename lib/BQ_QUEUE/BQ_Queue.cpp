@@ -0,0 +1,55 @@
+#include "BQ_Queue.h"
+
+/**
+ * Reads go to one board (FRMWRT_SGL_R) and are reported to the link
+ * supervisor like any other read, so a board that stops answering a
+ * diagnostic request counts towards its recovery. Nothing is read while
+ * the link is being recovered. Registers the shadow knows never reach
+ * the UART at all.
+ */
+unsigned BqTransactionQueue::serve(unsigned max, LinkSupervisor &link)
+{
+    unsigned n = 0;
+    BqRequest req;
+    while ((n < max) && (results.size() < BQ_QUEUE_SIZE) && requests.pop(req))
+    {
+        BqResult res;
+        res.board = req.board;
+        res.addr = req.addr;
+        res.len = min(req.len, (uint8_t)BQ_TXN_MAX_BYTES);
+        res.tag = req.tag;
+
+        if (!link.isUp())
+        {
+            res.status = BQ_TXN_LINK_DOWN;
+        }
+        else if (shadow && shadow->lookup(req.board, req.addr, res.data, res.len))
+        {
+            res.status = 0;
+        }
+        else
+        {
+            int result = ReadReg(req.board, req.addr, frame, res.len, BQ_TXN_TIMEOUT_US, FRMWRT_SGL_R);
+            link.report(req.board, result);
+            res.status = (result < 0) ? result : 0;
+            if (result >= 0)
+            {
+                memcpy(res.data, &frame[4], res.len);
+                if (shadow)
+                    shadow->learn(req.board, req.addr, res.data, res.len);
+            }
+        }
+        if (res.status)
+            numFailed++;
+        numServed++;
+        results.push(res);
+        n++;
+    }
+    return n;
+}
+
+void BqTransactionQueue::printStatus()
+{
+    Serial.println((String) "BQ transactions: " + numServed + " failed: " + numFailed + " waiting: " + requests.size() +
+                   " dropped: " + requests.numDropped);
+}
@@ -0,0 +1,68 @@
+//********BQ79606 TRANSACTION QUEUE
+#ifndef BQQUEUE_H
+#define BQQUEUE_H
+
+#include <Arduino.h>
+#include "BQ79606.h"
+#include "BQ_Link.h"
+#include "BQ_Shadow.h"
+#include "spscQueue.h"
+
+#define BQ_QUEUE_SIZE     8    // Transactions waiting in each direction (power of two)
+#define BQ_TXN_MAX_BYTES  128  // Longest register block of one read (ReadFrameReq limit)
+#define BQ_TXN_PER_SCAN   4    // Transactions served after every scan
+#define BQ_TXN_TIMEOUT_US 2000 // First byte timeout of a queued read, a missing board costs this much of the scan
+
+#define BQ_TXN_LINK_DOWN  -3   // BqResult status: the daisy chain was being recovered, nothing was read
+
+// Single device register read asked by another task
+struct BqRequest
+{
+    uint8_t board;
+    uint16_t addr;
+    uint8_t len;
+    uint8_t tag; // Given back in the result
+};
+
+struct BqResult
+{
+    uint8_t board;
+    uint16_t addr;
+    uint8_t len;
+    uint8_t tag;
+    int8_t status; // 0, BQ_READ_TIMEOUT, BQ_READ_CRC_ERROR or BQ_TXN_LINK_DOWN
+    uint8_t data[BQ_TXN_MAX_BYTES];
+};
+
+/**
+ * Register accesses for tasks that do not own the BQ79606 UART. One task
+ * submits requests and polls the results; the acquisition task serves a
+ * few of them after every scan, with a short timeout, so a diagnostic
+ * session can never delay the measurements by more than a bounded time.
+ */
+class BqTransactionQueue
+{
+public:
+    // Submitting task. false if the queue is full
+    bool submit(const BqRequest &req) { return requests.push(req); }
+    bool poll(BqResult &res) { return results.pop(res); }
+
+    // Acquisition task. Runs up to max reads, fewer if the results are not being collected
+    unsigned serve(unsigned max, LinkSupervisor &link);
+
+    // Configuration registers are answered from the shadow when it knows them
+    void setShadow(RegisterShadow *_shadow) { shadow = _shadow; }
+
+    void printStatus();
+
+    //** QUEUE DATA **//
+    unsigned long numServed = 0, numFailed = 0;
+
+private:
+    SpscQueue<BqRequest, BQ_QUEUE_SIZE> requests;
+    SpscQueue<BqResult, BQ_QUEUE_SIZE> results;
+    byte frame[BQ_TXN_MAX_BYTES + 6]; // ReadReg response: header, address, data and CRC
+    RegisterShadow *shadow = nullptr;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include "BQ_Shadow.h"
+
+RegisterShadow *RegisterShadow::observing = nullptr;
+
+void RegisterShadow::attach()
+{
+    invalidate();
+    observing = this;
+    pfnWriteObserver = observe;
+}
+
+void RegisterShadow::invalidate()
+{
+    memset(flags, 0, sizeof(flags));
+    anyDirty = false;
+}
+
+bool RegisterShadow::isShadowed(uint16_t addr)
+{
+    if (addr >= SHADOW_SIZE)
+        return false;
+    switch (addr)
+    {
+    case DEVADD_OTP:
+    case DEVADD_USR:
+    case CONTROL1:
+    case CONTROL2:
+    case OTP_PROG_CTRL:
+    case DIAG_CTRL1:
+        return false;
+    }
+    return (addr < OTP_PROG_UNLOCK1A) || (addr > OTP_PROG_UNLOCK1D);
+}
+
+// Devices a FRMWRT_*_NR frame reaches
+bool RegisterShadow::targets(byte bID, byte type, byte board) const
+{
+    switch (type)
+    {
+    case FRMWRT_SGL_NR:
+        return board == bID;
+    case FRMWRT_STK_NR:
+        return board != 0;
+    default:
+        return true;
+    }
+}
+
+void RegisterShadow::record(byte board, uint16_t addr, byte data, bool written)
+{
+    uint8_t &f = flags[board][addr];
+    if (written)
+    {
+        value[board][addr] = data;
+        f = REG_VALID;
+        return;
+    }
+    if ((f & REG_VALID) && !(f & REG_DIRTY) && (value[board][addr] == data))
+        return;
+    value[board][addr] = data;
+    f = (f & REG_VALID) | REG_DIRTY;
+    anyDirty = true;
+}
+
+/**
+ * Called by WriteFrame() for every write. Whatever was staged for those
+ * registers is overwritten by the frame itself.
+ */
+void RegisterShadow::observe(byte bID, uint16_t wAddr, const byte *pData, byte bLen, byte bWriteType)
+{
+    RegisterShadow *s = observing;
+    for (byte i = 0; i < bLen; i++)
+    {
+        uint16_t addr = wAddr + i;
+        if (!isShadowed(addr))
+            continue;
+        for (byte board = 0; board < TOTALBOARDS; board++)
+            if (s->targets(bID, bWriteType, board))
+                s->record(board, addr, pData[i], true);
+    }
+}
+
+bool RegisterShadow::stage(byte bID, uint16_t addr, uint64_t data, byte len, byte type)
+{
+    if ((len > SHADOW_MAX_LEN) || ((type == FRMWRT_SGL_NR) && (bID >= TOTALBOARDS)))
+        return false;
+    for (byte i = 0; i < len; i++)
+        if (!isShadowed(addr + i))
+            return false;
+    for (byte i = 0; i < len; i++)
+    {
+        byte b = data >> (8 * (len - 1 - i)); // most significant byte first, as WriteReg()
+        for (byte board = 0; board < TOTALBOARDS; board++)
+            if (targets(bID, type, board))
+                record(board, addr + i, b, false);
+    }
+    return true;
+}
+
+unsigned RegisterShadow::write(byte bID, uint16_t addr, uint64_t data, byte len, byte type)
+{
+    if (!stage(bID, addr, data, len, type))
+    {
+        WriteReg(bID, addr, data, len, type);
+        return 1;
+    }
+    unsigned before = numFrames;
+    flush();
+    if (numFrames == before)
+        numSkipped++;
+    return numFrames - before;
+}
+
+unsigned RegisterShadow::flush()
+{
+    if (!anyDirty)
+        return 0;
+    unsigned n = flushBroadcast(0);
+    if (TOTALBOARDS > 2)
+        n += flushBroadcast(1);
+    for (byte board = 0; board < TOTALBOARDS; board++)
+        n += flushSingle(board);
+    anyDirty = false;
+    return n;
+}
+
+// Every device from first up either has or is about to get the same value
+bool RegisterShadow::broadcastable(uint16_t addr, byte first) const
+{
+    for (byte board = first; board < TOTALBOARDS; board++)
+        if (!flags[board][addr] || (value[board][addr] != value[first][addr]))
+            return false;
+    return true;
+}
+
+/**
+ * first 0: broadcast to every device, 1: stack write (all but the base).
+ * A run starts at a dirty broadcastable register and takes the following
+ * broadcastable ones up to SHADOW_MAX_LEN, then drops the clean tail.
+ */
+unsigned RegisterShadow::flushBroadcast(byte first)
+{
+    unsigned n = 0;
+    byte data[SHADOW_MAX_LEN];
+    for (uint16_t addr = 0; addr < SHADOW_SIZE; addr++)
+    {
+        bool dirty = false;
+        for (byte board = first; board < TOTALBOARDS; board++)
+            dirty |= flags[board][addr] & REG_DIRTY;
+        if (!dirty || !broadcastable(addr, first))
+            continue;
+
+        byte len = 0, used = 0;
+        while ((len < SHADOW_MAX_LEN) && (addr + len < SHADOW_SIZE) && isShadowed(addr + len) &&
+               broadcastable(addr + len, first))
+        {
+            data[len] = value[first][addr + len];
+            for (byte board = first; board < TOTALBOARDS; board++)
+                if (flags[board][addr + len] & REG_DIRTY)
+                    used = len + 1;
+            len++;
+        }
+        WriteFrame(first, addr, data, used, first ? FRMWRT_STK_NR : FRMWRT_ALL_NR); // observe() marks them valid
+        numFrames++;
+        n++;
+        addr += used - 1;
+    }
+    return n;
+}
+
+unsigned RegisterShadow::flushSingle(byte board)
+{
+    unsigned n = 0;
+    byte data[SHADOW_MAX_LEN];
+    for (uint16_t addr = 0; addr < SHADOW_SIZE; addr++)
+    {
+        if (!(flags[board][addr] & REG_DIRTY))
+            continue;
+
+        // Dirty bytes, joined over gaps of up to SHADOW_MAX_GAP known registers
+        byte len = 0, used = 0;
+        while ((len < SHADOW_MAX_LEN) && (addr + len < SHADOW_SIZE) && isShadowed(addr + len))
+        {
+            uint8_t f = flags[board][addr + len];
+            if (f & REG_DIRTY)
+                used = len + 1;
+            else if (!(f & REG_VALID) || (len + 1 - used > SHADOW_MAX_GAP))
+                break;
+            data[len] = value[board][addr + len];
+            len++;
+        }
+        WriteFrame(board, addr, data, used, FRMWRT_SGL_NR);
+        numFrames++;
+        n++;
+        addr += used - 1;
+    }
+    return n;
+}
+
+bool RegisterShadow::lookup(byte bID, uint16_t addr, byte *data, byte len)
+{
+    if (bID >= TOTALBOARDS)
+        return false;
+    for (byte i = 0; i < len; i++)
+    {
+        if (!isShadowed(addr + i) || (flags[bID][addr + i] != REG_VALID))
+        {
+            numMisses++;
+            return false;
+        }
+    }
+    memcpy(data, &value[bID][addr], len);
+    numHits++;
+    return true;
+}
+
+void RegisterShadow::learn(byte bID, uint16_t addr, const byte *data, byte len)
+{
+    if (bID >= TOTALBOARDS)
+        return;
+    for (byte i = 0; i < len; i++)
+        if (isShadowed(addr + i) && !(flags[bID][addr + i] & REG_DIRTY))
+            record(bID, addr + i, data[i], true);
+}
+
+void RegisterShadow::print()
+{
+    Serial.println((String) "Register shadow: " + numFrames + " frames, " + numSkipped + " writes skipped, reads " +
+                   numHits + " cached / " + numMisses + " from the stack");
+}
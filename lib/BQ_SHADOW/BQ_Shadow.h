@@ -0,0 +1,81 @@
+//********BQ79606 REGISTER SHADOW
+#ifndef BQSHADOW_H
+#define BQSHADOW_H
+
+#include <Arduino.h>
+#include "BQ79606.h"
+
+#define SHADOW_SIZE     0x0127 // Registers 0x0000..0x0126 are shadowed: configuration and control, fault resets excluded
+#define SHADOW_MAX_GAP  2      // Clean registers a frame may rewrite to join two dirty runs (a frame header costs more)
+#define SHADOW_MAX_LEN  8      // Data bytes of one write frame
+
+/**
+ * What every device of the stack holds in its configuration registers.
+ * It sees every write frame (pfnWriteObserver), whoever sends it, so
+ * InitDevices(), the ADC sequencer and the diagnostics keep it current
+ * without knowing about it; reads of single devices can teach it too.
+ *
+ * Writes through write() or stage()/flush() only send the bytes some
+ * device does not hold already. Dirty bytes are sent as few frames as
+ * possible: a broadcast when every device ends up with the same values, a
+ * stack write when all but the base do, single device frames otherwise,
+ * short clean gaps rewritten to join runs.
+ *
+ * Command registers (CONTROL1/2 GO bits, addressing, OTP, DIAG_CTRL1 BIST
+ * GO, fault resets) are never shadowed: write() passes them straight on.
+ * After a reset or readdressing the stack holds its defaults, not what the
+ * shadow remembers, and invalidate() has to be called.
+ */
+class RegisterShadow
+{
+public:
+    // Starts observing the write frames
+    void attach();
+
+    // Forgets every value (devices reset or readdressed)
+    void invalidate();
+
+    // Write with the FRMWRT_*_NR semantics, only what differs goes out. Returns the frames sent
+    unsigned write(byte bID, uint16_t addr, uint64_t data, byte len, byte type);
+
+    // Records the target value without sending it; flush() sends everything staged
+    bool stage(byte bID, uint16_t addr, uint64_t data, byte len, byte type);
+    unsigned flush();
+
+    // Copies the registers of one device if they are all known. false: read them from the device
+    bool lookup(byte bID, uint16_t addr, byte *data, byte len);
+
+    // Values just read from one device
+    void learn(byte bID, uint16_t addr, const byte *data, byte len);
+
+    static bool isShadowed(uint16_t addr);
+
+    void print();
+
+    //** SHADOW DATA **//
+    unsigned long numFrames = 0;     // Frames sent by flush()
+    unsigned long numSkipped = 0;    // write() calls that sent nothing, the devices already held the values
+    unsigned long numHits = 0, numMisses = 0;
+
+private:
+    enum : uint8_t
+    {
+        REG_VALID = 0x01, // value is what the device holds
+        REG_DIRTY = 0x02  // value is staged, not sent yet
+    };
+
+    byte value[TOTALBOARDS][SHADOW_SIZE];
+    uint8_t flags[TOTALBOARDS][SHADOW_SIZE];
+    bool anyDirty = false;
+
+    static RegisterShadow *observing;
+    static void observe(byte bID, uint16_t wAddr, const byte *pData, byte bLen, byte bWriteType);
+
+    void record(byte board, uint16_t addr, byte data, bool written);
+    bool targets(byte bID, byte type, byte board) const;
+    bool broadcastable(uint16_t addr, byte first) const;
+    unsigned flushBroadcast(byte first);
+    unsigned flushSingle(byte board);
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "BQ_SoC.h"
+
+void SocEstimator::setCurrent(int32_t mA)
+{
+    current_mA = mA;
+}
+
+/**
+ * Runs one estimation step with a new pack snapshot. The charge since the
+ * previous step is added to every cell, then each cell of the boards
+ * decoded in this scan is corrected from its voltage: by the EKF when it
+ * is enabled, otherwise towards the OCV only once the pack has been
+ * resting for config.restTime. Boards are initialised from the OCV the
+ * first time they are decoded. Cells of stale boards are only coulomb
+ * counted.
+ * return false if the snapshot was already processed
+ */
+bool SocEstimator::update(PackSnapshot &snap)
+{
+    if (snap.sequence == lastSequence)
+        return false;
+    lastSequence = snap.sequence;
+
+    unsigned long t0 = micros();
+    unsigned long now = millis();
+    int32_t dSoc = coulombCount(lastUpdate ? now - lastUpdate : 0);
+    lastUpdate = now;
+
+    if (abs(current_mA) >= config.restCurrent_mA)
+        restStart = now;
+    bool resting = (now - restStart) >= config.restTime;
+
+    int64_t sum = 0;
+    unsigned numCells = 0;
+    int32_t minSoc = SOC_ONE, maxSoc = 0;
+    unsigned minCell = 0;
+
+    for (unsigned board = 0; board < TOTALBOARDS; board++)
+    {
+        bool valid = (snap.cellValid >> board) & 1;
+        if (!(initMask & (1UL << board)))
+        {
+            if (!valid)
+                continue;
+            for (unsigned i = 0; i < CELLS_PER_BOARD; i++)
+            {
+                soc[board * CELLS_PER_BOARD + i] = socFromOcv(snap.cellCode[board][i]);
+                variance[board * CELLS_PER_BOARD + i] = SOC_EKF_P0;
+            }
+            initMask |= (1UL << board);
+        }
+        else
+        {
+            for (unsigned i = 0; i < CELLS_PER_BOARD; i++)
+            {
+                unsigned cell = board * CELLS_PER_BOARD + i;
+                soc[cell] += dSoc;
+                if (valid)
+                {
+                    if (config.useEKF)
+                        correctEKF(cell, snap.cellCode[board][i]);
+                    else if (resting)
+                        soc[cell] += (socFromOcv(snap.cellCode[board][i]) - soc[cell]) >> SOC_REST_SHIFT;
+                }
+                soc[cell] = constrain(soc[cell], 0, SOC_ONE);
+            }
+        }
+
+        for (unsigned i = 0; i < CELLS_PER_BOARD; i++)
+        {
+            unsigned cell = board * CELLS_PER_BOARD + i;
+            sum += soc[cell];
+            if (soc[cell] < minSoc)
+            {
+                minSoc = soc[cell];
+                minCell = cell;
+            }
+            if (soc[cell] > maxSoc)
+                maxSoc = soc[cell];
+        }
+        numCells += CELLS_PER_BOARD;
+    }
+
+    if (numCells)
+    {
+        packAverage = toCentiPercent((int32_t)(sum / numCells));
+        packMin = toCentiPercent(minSoc);
+        packMax = toCentiPercent(maxSoc);
+        packMinCell = minCell;
+    }
+
+    for (unsigned cell = 0; cell < TOTALCELLS; cell++)
+        snap.cellSoC[cell / CELLS_PER_BOARD][cell % CELLS_PER_BOARD] = toCentiPercent(soc[cell]);
+    snap.socAverage = packAverage;
+    snap.socMin = packMin;
+    snap.socMax = packMax;
+    snap.socMinCell = packMinCell;
+
+    updateTime = micros() - t0;
+    if (updateTime > maxUpdateTime)
+        maxUpdateTime = updateTime;
+    if (updateTime > SOC_BUDGET_US)
+        numOverruns++;
+    return true;
+}
+
+bool SocEstimator::publish(CAN_BUS &can, const PackSnapshot &snap, unsigned long baseId)
+{
+    bool ok = true;
+    uint16_t packData[4] = {snap.socAverage, snap.socMin, snap.socMax, snap.socMinCell};
+    ok &= can.setPacket(baseId, packData);
+
+    for (unsigned board = 0; board < TOTALBOARDS; board++)
+    {
+        uint8_t cells[CELLS_PER_BOARD];
+        for (unsigned i = 0; i < CELLS_PER_BOARD; i++)
+            cells[i] = snap.cellSoC[board][i] / 50; // 0.5 % per bit
+        ok &= can.setPacket(baseId + 1 + board, cells);
+    }
+    return ok;
+}
+
+void SocEstimator::printSoC(const PackSnapshot &snap)
+{
+    Serial.println((String) "SoC: " + (snap.socAverage / 100.0) + " % min: " + (snap.socMin / 100.0) + " % (cell " +
+                   snap.socMinCell + ") max: " + (snap.socMax / 100.0) + " %");
+}
+
+// SoC for an open circuit cell code by linear interpolation in the OCV table
+int32_t SocEstimator::socFromOcv(int32_t code)
+{
+    if (code <= soc::ocv.code[0])
+        return 0;
+    if (code >= soc::ocv.code[SOC_OCV_POINTS - 1])
+        return SOC_ONE;
+
+    unsigned lo = 0, hi = SOC_OCV_POINTS - 1;
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (code < soc::ocv.code[mid])
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return (int32_t)(((int64_t)lo << SOC_SHIFT) / (SOC_OCV_POINTS - 1) +
+                     ((int64_t)(code - soc::ocv.code[lo]) << SOC_SHIFT) / soc::ocv.slope[lo]);
+}
+
+// OCV code for a SoC, slope returns dOCV/dSoC of the segment (the EKF jacobian)
+int32_t SocEstimator::ocvFromSoc(int32_t socQ24, int32_t &slope)
+{
+    int32_t s = constrain(socQ24, 0, SOC_ONE - 1);
+    unsigned seg = ((int64_t)s * (SOC_OCV_POINTS - 1)) >> SOC_SHIFT;
+    int32_t frac = s - (int32_t)(((int64_t)seg << SOC_SHIFT) / (SOC_OCV_POINTS - 1));
+    slope = soc::ocv.slope[seg];
+    return soc::ocv.code[seg] + (int32_t)(((int64_t)slope * frac) >> SOC_SHIFT);
+}
+
+// Charge since the last update as Q24 SoC, the division remainder is kept so small currents are not lost
+int32_t SocEstimator::coulombCount(unsigned long dt)
+{
+    int64_t capacity = (int64_t)config.capacity_mAh * 3600000; // mA*ms
+    int64_t charge = (int64_t)current_mA * dt * SOC_ONE + chargeRemainder;
+    int64_t dSoc = charge / capacity;
+    chargeRemainder = charge - dSoc * capacity;
+    return (int32_t)dSoc;
+}
+
+/**
+ * Scalar EKF step of one cell. Model: V = OCV(SoC) + I * R0, with the
+ * jacobian taken from the OCV segment slope. Units are chosen so that
+ * every product fits in 64 bits: P in Q32 of SoC^2, H in codes per unit
+ * SoC and R in codes^2.
+ */
+void SocEstimator::correctEKF(unsigned cell, int32_t code)
+{
+    int32_t h;
+    int32_t predicted = ocvFromSoc(soc[cell], h) + (int32_t)(((int64_t)current_mA * SOC_CELL_R0_UOHM) / SOC_CELL_LSB_NV);
+    int64_t p = (int64_t)variance[cell] + SOC_EKF_Q;
+    if (p > SOC_EKF_P0)
+        p = SOC_EKF_P0;
+
+    int64_t s = (((int64_t)h * h * p) >> 32) + SOC_EKF_R;
+    soc[cell] += (int32_t)(((p * h * (code - predicted)) / s) >> (32 - SOC_SHIFT));
+    variance[cell] = (uint32_t)((p * SOC_EKF_R) / s);
+}
@@ -0,0 +1,135 @@
+//********PACK STATE OF CHARGE ESTIMATOR
+#ifndef BQSOC_H
+#define BQSOC_H
+
+#include <Arduino.h>
+#include "PackSnapshot.h"
+#include "MART_CAN.h"
+
+// SoC fixed point format: 1.0 (100 %) = 1 << SOC_SHIFT
+#define SOC_SHIFT        24
+#define SOC_ONE          (1L << SOC_SHIFT)
+
+// OCV curve of the cells, SOC_OCV_POINTS points equally spaced from 0 % to 100 %
+#define SOC_OCV_POINTS   21
+#define SOC_CELL_LSB_NV  190730 // Cell code LSB in nV
+
+#define SOC_CAPACITY_MAH 50000 // Nominal cell capacity
+#define SOC_CELL_R0_UOHM 1500  // Cell ohmic resistance used by the EKF voltage model
+#define SOC_REST_CURRENT 500   // |current| in mA below which the pack is resting
+#define SOC_REST_TIME    30000 // ms at rest before the OCV is trusted
+#define SOC_REST_SHIFT   4     // Fraction (1/16) of the OCV error corrected per scan at rest
+#define SOC_EKF_P0       42949673 // Initial variance (0.1^2) in Q32
+#define SOC_EKF_Q        43       // Process noise per scan (1e-4^2) in Q32
+#define SOC_EKF_R        2704     // Measurement noise (10 mV^2) in codes^2
+#define SOC_BUDGET_US    10000    // Time allowed for one update of the whole pack
+
+namespace soc
+{
+    // Open circuit voltage in mV every 5 % (NMC cell at 25 C)
+    constexpr uint16_t ocvMilliVolts[SOC_OCV_POINTS] = {
+        3000, 3280, 3420, 3500, 3550, 3590, 3620, 3650, 3680, 3710, 3750,
+        3790, 3830, 3870, 3910, 3950, 3990, 4030, 4070, 4120, 4180};
+
+    // OCV in cell codes and the slope of every segment in codes per unit of SoC, generated by the compiler
+    struct OcvTable
+    {
+        int32_t code[SOC_OCV_POINTS];
+        int32_t slope[SOC_OCV_POINTS - 1];
+        constexpr OcvTable() : code(), slope()
+        {
+            for (int i = 0; i < SOC_OCV_POINTS; i++)
+                code[i] = (int32_t)(((int64_t)ocvMilliVolts[i] * 1000000 + SOC_CELL_LSB_NV / 2) / SOC_CELL_LSB_NV);
+            for (int i = 0; i < SOC_OCV_POINTS - 1; i++)
+                slope[i] = (code[i + 1] - code[i]) * (SOC_OCV_POINTS - 1);
+        }
+    };
+
+    constexpr OcvTable ocv{};
+}
+
+/**
+ * Per cell state of charge from OCV lookup and coulomb counting, with an
+ * optional scalar extended Kalman filter per cell. All the math is integer:
+ * SoC in Q24, variances in Q32 and voltages in raw cell codes, so the
+ * snapshot is used as it is and no code is converted to volts.
+ */
+class SocEstimator
+{
+public:
+    struct Config
+    {
+        bool useEKF;            // Correct every scan with an EKF instead of only at rest
+        uint32_t capacity_mAh;  // Cell capacity
+        int32_t restCurrent_mA; // Current below which the pack is resting
+        uint32_t restTime;      // ms at rest before the OCV correction starts
+    } config;
+
+    SocEstimator()
+    {
+        config.useEKF = false;
+        config.capacity_mAh = SOC_CAPACITY_MAH;
+        config.restCurrent_mA = SOC_REST_CURRENT;
+        config.restTime = SOC_REST_TIME;
+
+        current_mA = 0;
+        initMask = 0;
+        lastSequence = 0;
+        lastUpdate = 0;
+        restStart = 0;
+        chargeRemainder = 0;
+        updateTime = 0;
+        maxUpdateTime = 0;
+        numOverruns = 0;
+        packAverage = packMin = packMax = packMinCell = 0;
+        for (unsigned i = 0; i < TOTALCELLS; i++)
+        {
+            soc[i] = 0;
+            variance[i] = SOC_EKF_P0;
+        }
+    }
+
+    // Pack current in mA, positive while charging (fed from the current sensor over CAN)
+    void setCurrent(int32_t mA);
+
+    // Runs one estimation step with a new snapshot and stores the results in it.
+    // return false if the snapshot was already processed
+    bool update(PackSnapshot &snap);
+
+    // Cell SoC in 0.01 %
+    uint16_t getCellSoC(unsigned cell) const { return toCentiPercent(soc[cell]); }
+    // Pack SoC in 0.01 %: average, and the limiting cells
+    uint16_t getPackSoC() const { return packAverage; }
+    uint16_t getMinSoC() const { return packMin; }
+    uint16_t getMaxSoC() const { return packMax; }
+
+    // Stores the SoC packets of a snapshot in DataOUT: baseId = pack {average, min, max, min cell},
+    // baseId+1+board = 6 cells in 0.5 %. Only reads the snapshot, so it can run on the CAN side
+    static bool publish(CAN_BUS &can, const PackSnapshot &snap, unsigned long baseId);
+
+    uint32_t getUpdateTime() const { return updateTime; }
+    static void printSoC(const PackSnapshot &snap);
+
+    //** SOC STATUS DATA **//
+    uint32_t maxUpdateTime;
+    unsigned long numOverruns; // Updates longer than SOC_BUDGET_US
+
+private:
+    int32_t soc[TOTALCELLS];      // Q24
+    uint32_t variance[TOTALCELLS]; // EKF P in Q32
+    uint32_t initMask;             // Boards whose cells were initialised from the OCV
+    int32_t current_mA;
+    uint32_t lastSequence;
+    unsigned long lastUpdate, restStart;
+    int64_t chargeRemainder;
+    uint32_t updateTime;
+    uint16_t packAverage, packMin, packMax, packMinCell;
+
+    static int32_t socFromOcv(int32_t code);
+    static int32_t ocvFromSoc(int32_t socQ24, int32_t &slope);
+    static uint16_t toCentiPercent(int32_t socQ24) { return (uint16_t)(((int64_t)socQ24 * 10000) >> SOC_SHIFT); }
+    int32_t coulombCount(unsigned long dt);
+    void correctEKF(unsigned cell, int32_t code);
+};
+
+#endif
@@ -0,0 +1,15 @@
+#include "BQ_Temp.h"
+
+/**
+ * Converts a block of ratiometric GPIO codes to temperatures in 0.1 C.
+ * The lookup table is built at compile time from the Steinhart-Hart
+ * equation, so the loop only does a clamp, a table read and one
+ * multiply-shift interpolation per sensor instead of a log().
+ */
+void thermistorConvert(const int16_t *codes, int16_t *deciC, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+    {
+        deciC[i] = thermistorToDeciC(codes[i]);
+    }
+}
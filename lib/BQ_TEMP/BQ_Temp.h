@@ -0,0 +1,98 @@
+//********BQ79606 THERMISTOR TEMPERATURE CONVERSION
+#ifndef BQTEMP_H
+#define BQTEMP_H
+
+#include <Arduino.h>
+
+// Thermistor divider: NTC from GPIO to ground, pull-up from GPIO to TSREF
+#define THERM_R_PULLUP   10000.0 // Pull-up resistor in ohms
+#define THERM_SH_A       1.009249522e-3 // Steinhart-Hart coefficients of the NTC (10k, B~3950)
+#define THERM_SH_B       2.378405444e-4
+#define THERM_SH_C       2.019202697e-7
+
+// Ratiometric GPIO result: code = 0x8000 * VGPIO / TSREF
+#define THERM_FULL_SCALE 32768
+#define THERM_TABLE_BITS 7                                      // 128 segments
+#define THERM_TABLE_SIZE ((1 << THERM_TABLE_BITS) + 1)
+#define THERM_SEG_SHIFT  (15 - THERM_TABLE_BITS)                // Codes per segment = 1 << THERM_SEG_SHIFT
+#define THERM_T_MIN      (-400)                                 // Table limits in 0.1 C
+#define THERM_T_MAX      1250
+
+namespace therm
+{
+    // constexpr natural logarithm: x = m * 2^k with m in [1,2), ln(m) = 2 atanh((m-1)/(m+1))
+    constexpr double ln(double x)
+    {
+        int k = 0;
+        while (x >= 2.0)
+        {
+            x /= 2.0;
+            k++;
+        }
+        while (x < 1.0)
+        {
+            x *= 2.0;
+            k--;
+        }
+        double y = (x - 1.0) / (x + 1.0);
+        double y2 = y * y;
+        double term = y;
+        double sum = 0.0;
+        for (int n = 1; n < 40; n += 2)
+        {
+            sum += term / n;
+            term *= y2;
+        }
+        return 2.0 * sum + k * 0.69314718055994530942;
+    }
+
+    // Temperature in 0.1 C for a ratiometric code, clamped to the table limits
+    constexpr int16_t steinhartHart(long code)
+    {
+        if (code <= 0)
+            return THERM_T_MAX; // Shorted NTC reads as hottest
+        if (code >= THERM_FULL_SCALE)
+            return THERM_T_MIN; // Open NTC reads as coldest
+
+        double ratio = (double)code / THERM_FULL_SCALE;
+        double r = THERM_R_PULLUP * ratio / (1.0 - ratio);
+        double lnR = ln(r);
+        double kelvin = 1.0 / (THERM_SH_A + THERM_SH_B * lnR + THERM_SH_C * lnR * lnR * lnR);
+        double deci = (kelvin - 273.15) * 10.0;
+        if (deci > THERM_T_MAX)
+            return THERM_T_MAX;
+        if (deci < THERM_T_MIN)
+            return THERM_T_MIN;
+        return (int16_t)(deci + (deci >= 0 ? 0.5 : -0.5));
+    }
+
+    // Temperature at the start of every segment, generated by the compiler
+    struct Table
+    {
+        int16_t t[THERM_TABLE_SIZE];
+        constexpr Table() : t()
+        {
+            for (int i = 0; i < THERM_TABLE_SIZE; i++)
+                t[i] = steinhartHart((long)i << THERM_SEG_SHIFT);
+        }
+    };
+
+    constexpr Table table{};
+}
+
+// Converts one ratiometric GPIO code to 0.1 C by linear interpolation in the table
+inline int16_t thermistorToDeciC(int16_t code)
+{
+    int32_t c = code < 0 ? 0 : code; // Negative codes are noise around 0
+    int32_t idx = c >> THERM_SEG_SHIFT;
+    int32_t frac = c & ((1 << THERM_SEG_SHIFT) - 1);
+    int32_t t0 = therm::table.t[idx];
+    int32_t t1 = therm::table.t[idx + 1];
+    return (int16_t)(t0 + (((t1 - t0) * frac) >> THERM_SEG_SHIFT));
+}
+
+// Converts n ratiometric codes to 0.1 C in one pass (whole pack: TOTALBOARDS * 6 GPIOs).
+// No branches or floating point in the loop, so the compiler can unroll and vectorize it.
+void thermistorConvert(const int16_t *codes, int16_t *deciC, unsigned n);
+
+#endif
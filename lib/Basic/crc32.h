@@ -0,0 +1,24 @@
+#ifndef __CRC32
+#define __CRC32
+
+#include <Arduino.h>
+
+// CRC-32 (IEEE 802.3, as zlib and crc32 on a PC), computed in pieces:
+// crc = crc32Update(0, a, n); crc = crc32Update(crc, b, m);
+// Nibble table, 64 bytes of flash instead of 1 KB.
+inline uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t len)
+{
+  static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+#endif
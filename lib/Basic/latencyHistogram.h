@@ -0,0 +1,70 @@
+#ifndef __LATENCYHISTOGRAM
+#define __LATENCYHISTOGRAM
+
+#include <Arduino.h>
+
+#define LATENCY_BUCKETS 21 // Bucket n counts samples in [2^(n-1), 2^n) us, the last one everything above ~1 s
+
+// Logarithmic histogram of latencies in us. record() is O(1) and never allocates,
+// so it can be called from the task being measured; print it from anywhere else.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram()
+  {
+    reset();
+  }
+
+  void record(uint32_t us)
+  {
+    unsigned bucket = (us == 0) ? 0 : (32 - __builtin_clz(us));
+    if (bucket >= LATENCY_BUCKETS)
+      bucket = LATENCY_BUCKETS - 1;
+    buckets[bucket]++;
+    count++;
+    if (us > maxValue)
+      maxValue = us;
+  }
+
+  void reset()
+  {
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++)
+      buckets[i] = 0;
+    count = 0;
+    maxValue = 0;
+  }
+
+  // Upper bound in us of the bucket holding the given percentile (0-100)
+  uint32_t percentile(unsigned p) const
+  {
+    uint32_t target = ((uint64_t)count * p + 99) / 100;
+    uint32_t acc = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++)
+    {
+      acc += buckets[i];
+      if (acc >= target && acc > 0)
+        return (1UL << i) - 1;
+    }
+    return maxValue;
+  }
+
+  uint32_t getCount() const { return count; }
+  uint32_t getMax() const { return maxValue; }
+
+  void print(const char *name) const
+  {
+    Serial.println((String)name + " n= " + count + " p50< " + percentile(50) + " us p99< " + percentile(99) +
+                   " us max= " + maxValue + " us");
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++)
+    {
+      if (buckets[i])
+        Serial.println((String) "  <" + ((1UL << i) - 1) + " us: " + buckets[i]);
+    }
+  }
+
+private:
+  volatile uint32_t buckets[LATENCY_BUCKETS];
+  volatile uint32_t count, maxValue;
+};
+
+#endif
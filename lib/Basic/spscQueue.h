@@ -0,0 +1,52 @@
+#ifndef __SPSCQUEUE
+#define __SPSCQUEUE
+
+#include <Arduino.h>
+#include <atomic>
+
+// Lock-free queue for one producer task and one consumer task (they can run on different cores).
+// N must be a power of two; push() fails instead of blocking when the queue is full.
+template <typename T, size_t N>
+class SpscQueue
+{
+  static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+  SpscQueue() : numDropped(0), head(0), tail(0) {}
+
+  // Producer side
+  bool push(const T &item)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N)
+    {
+      numDropped++;
+      return false;
+    }
+    items[h & (N - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side
+  bool pop(T &item)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+      return false;
+    item = items[t & (N - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+  size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+  unsigned long numDropped; // Items lost because the queue was full (written by the producer only)
+
+private:
+  T items[N];
+  std::atomic<size_t> head, tail;
+};
+
+#endif
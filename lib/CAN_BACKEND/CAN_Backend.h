@@ -0,0 +1,71 @@
+//********MART CAN BACKEND LIBRARY
+#ifndef CANBACKEND_H
+#define CANBACKEND_H
+
+#include <Arduino.h>
+#include "common.h"
+#include "CAN_Filter.h"
+
+// Error flags, same layout as the MCP2515 EFLG register whatever the controller is
+#define CAN_EFLG_EWARN  0x01 // TEC or REC >= 96
+#define CAN_EFLG_RXWAR  0x02
+#define CAN_EFLG_TXWAR  0x04
+#define CAN_EFLG_RXEP   0x08 // REC >= 128
+#define CAN_EFLG_TXEP   0x10 // TEC >= 128
+#define CAN_EFLG_TXBO   0x20 // Bus-off
+#define CAN_EFLG_RX0OVR 0x40
+#define CAN_EFLG_RX1OVR 0x80
+
+// Events returned by CanBackend::poll()
+#define CAN_EVENT_RX            0x01 // At least one frame waiting to be read
+#define CAN_EVENT_ERROR         0x02 // The error flags changed
+#define CAN_EVENT_RX_OVERFLOW   0x04 // Frames were lost because the RX buffers were full
+#define CAN_EVENT_MESSAGE_ERROR 0x08 // A frame with an error was seen on the bus
+
+/**
+ * A CAN controller as CAN_BUS and the error supervisor use it. Received
+ * frames keep the MCP_CAN id convention: bit 31 set for extended ids, the
+ * extended and RRF flags are also filled in the packet.
+ */
+class CanBackend
+{
+public:
+    virtual ~CanBackend() {}
+
+    // Starts the controller in normal mode at kbps (125, 250, 500, anything else 1000)
+    virtual bool begin(int kbps) = 0;
+
+    // Pending events, cheap when there is nothing to do (no bus access if the INT line is high)
+    virtual uint8_t poll() = 0;
+
+    // Reads one frame, false if there was none
+    virtual bool read(CanPacketRawData &frame) = 0;
+
+    // Sends (or queues for sending) one data or remote frame
+    virtual bool write(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data) = 0;
+
+    virtual uint8_t getErrorFlags() = 0;
+    virtual uint8_t errorCountRX() = 0;
+    virtual uint8_t errorCountTX() = 0;
+
+    // Drops the frames waiting to be sent
+    virtual void abortTx() = 0;
+
+    // Every frame given to write() has left the controller
+    virtual bool txIdle() { return true; }
+
+    // Leaves bus-off, the error counters start again from zero
+    virtual void restart() = 0;
+
+    // Programs the acceptance filters of the controller so they admit at least
+    // what the software filter accepts. false if the controller admits every frame
+    virtual bool applyFilter(const CanIdFilter & /*filter*/) { return false; }
+
+    // What the hardware filters let through, to check them against the software filter
+    virtual bool hwAccepts(unsigned long /*id*/, bool /*extended*/) const { return true; }
+
+    // Pin of the interrupt line, -1 if the controller has to be polled
+    virtual int interruptPin() const { return -1; }
+};
+
+#endif
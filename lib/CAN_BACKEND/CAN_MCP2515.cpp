@@ -0,0 +1,239 @@
+#include "CAN_MCP2515.h"
+
+bool Mcp2515Backend::begin(int kbps)
+{
+    byte speed;
+    if (kbps == 125)
+        speed = CAN_125KBPS;
+    else if (kbps == 250)
+        speed = CAN_250KBPS;
+    else if (kbps == 500)
+        speed = CAN_500KBPS;
+    else
+        speed = CAN_1000KBPS;
+
+    // Filters enabled, with the masks at zero they admit every frame until applyFilter()
+    bool ok = (mcp.begin(MCP_STDEXT, speed, MCP_8MHZ) == CAN_OK);
+    hwFiltering = false;
+    mcp.setMode(MCP_NORMAL); // Change to normal mode to allow messages to be transmitted
+
+    // ERRIF/MERRF also drive the INT line
+    mcp.clearInterruptFlags(MCP_ERRIF | MCP_MERRF);
+    mcp.setInterruptMask(MCP_ERRIF | MCP_MERRF, MCP_ERRIF | MCP_MERRF);
+    return ok;
+}
+
+/**
+ * INT is shared by the RX and the error interrupts. ERRIF is raised on
+ * every EFLG change: RX overflows are cleared right away, otherwise the
+ * flag stays set and the INT line never releases.
+ */
+uint8_t Mcp2515Backend::poll()
+{
+    if (digitalRead(mcp.pinINT))
+        return 0;
+
+    byte flags = mcp.getInterruptFlags();
+    uint8_t events = 0;
+    if (flags & MCP_ERRIF)
+    {
+        events |= CAN_EVENT_ERROR;
+        if (mcp.getError() & (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR))
+        {
+            events |= CAN_EVENT_RX_OVERFLOW;
+            mcp.clearRXOverflow();
+        }
+    }
+    if (flags & MCP_MERRF)
+        events |= CAN_EVENT_MESSAGE_ERROR;
+    if (flags & (MCP_ERRIF | MCP_MERRF))
+        mcp.clearInterruptFlags(flags & (MCP_ERRIF | MCP_MERRF));
+
+    if (flags & (MCP_RX0IF | MCP_RX1IF))
+        events |= CAN_EVENT_RX;
+    return events;
+}
+
+bool Mcp2515Backend::read(CanPacketRawData &frame)
+{
+    if (mcp.readMsgBuf(&frame.id, &frame.size, frame.bytes) != CAN_OK) // Read data: len = data length, buf = data byte(s)
+        return false;
+
+    frame.typeExtendedId = (frame.id > 0x7FF) ? 1 : 0;
+    if ((frame.id & 0x40000000) == 0x40000000)
+    {
+        frame.id &= ~(1UL << 30);
+        frame.rrf = true;
+        DEBUG_PRINTLN("Received RRF");
+    }
+    else
+        frame.rrf = false;
+    return true;
+}
+
+bool Mcp2515Backend::write(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data)
+{
+    if (rtr)
+        id |= 0x40000000; // MCP_CAN takes the remote flag in the id
+    if (extended)
+        id |= 0x80000000;
+    return mcp.sendMsgBuf(id, len, const_cast<uint8_t *>(data)) == CAN_OK;
+}
+
+// A frame that could not be sent keeps its TX buffer busy until it is aborted
+void Mcp2515Backend::abortTx()
+{
+    mcp.abortTX();
+    mcp.clearAbortTX();
+}
+
+// Configuration mode and back resets the protocol engine and the error counters
+void Mcp2515Backend::restart()
+{
+    abortTx();
+    mcp.setMode(MODE_CONFIG);
+    mcp.setMode(MCP_NORMAL);
+    mcp.clearRXOverflow();
+    mcp.clearInterruptFlags(MCP_ERRIF | MCP_MERRF);
+}
+
+/**
+ * The MCP2515 only has 2 masks and 6 filters, so the hardware gets a
+ * superset of the software filter: it drops most of the traffic before it
+ * costs an interrupt and an SPI read, the software filter has the final
+ * word. Extended rules are not worth the registers, with any of them the
+ * controller admits everything.
+ */
+bool Mcp2515Backend::applyFilter(const CanIdFilter &filter)
+{
+    hwFiltering = !filter.empty() && !filter.hasExtended();
+    if (hwFiltering)
+    {
+        planFilters(filter.standardIds());
+        for (uint8_t i = 0; i < 2; i++)
+            mcp.init_Mask(i, 0, (uint32_t)hwMasks[i] << 16); // Low 16 bits: data bytes of standard frames, not compared
+        for (uint8_t i = 0; i < 6; i++)
+            mcp.init_Filt(i, 0, (uint32_t)hwFilters[i] << 16);
+    }
+    else
+    {
+        // Zero masks, one extended and one standard filter per buffer as after begin()
+        mcp.init_Mask(0, 0, 0);
+        mcp.init_Mask(1, 0, 0);
+        for (uint8_t i = 0; i < 6; i++)
+            mcp.init_Filt(i, (i % 2) ? 0 : 1, 0);
+    }
+    return hwFiltering;
+}
+
+bool Mcp2515Backend::hwAccepts(unsigned long id, bool extended) const
+{
+    if (!hwFiltering)
+        return true;
+    if (extended)
+        return false;
+    for (uint8_t i = 0; i < 6; i++)
+    {
+        uint16_t mask = hwMasks[(i < 2) ? 0 : 1];
+        if ((id & mask) == (hwFilters[i] & mask))
+            return true;
+    }
+    return false;
+}
+
+// Number of different values of ids[] under mask
+static unsigned countMasked(const uint16_t *ids, unsigned count, uint16_t mask)
+{
+    std::bitset<CAN_STD_IDS> seen;
+    for (unsigned i = 0; i < count; i++)
+        seen.set(ids[i] & mask);
+    return seen.count();
+}
+
+/**
+ * Clears mask bits, always the one that merges more IDs, until the IDs fit
+ * in numFilters filters. Returns how many standard IDs the group admits.
+ */
+static unsigned reduceGroup(const uint16_t *ids, unsigned count, unsigned numFilters, uint16_t &mask, uint16_t *filters)
+{
+    mask = CAN_STD_IDS - 1; // Exact match if the group is empty
+    if (count == 0)
+        return 0;
+
+    unsigned values = countMasked(ids, count, mask);
+    while (values > numFilters)
+    {
+        unsigned best = values + 1;
+        uint16_t bestMask = mask;
+        for (uint16_t bit = 1; bit < CAN_STD_IDS; bit <<= 1)
+        {
+            if (!(mask & bit))
+                continue;
+            unsigned n = countMasked(ids, count, mask & ~bit);
+            if (n < best)
+            {
+                best = n;
+                bestMask = mask & ~bit;
+            }
+        }
+        mask = bestMask;
+        values = best;
+    }
+
+    // One filter per masked value, the spare ones repeat the first
+    unsigned n = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint16_t value = ids[i] & mask;
+        bool found = false;
+        for (unsigned j = 0; j < n; j++)
+            found |= (filters[j] == value);
+        if (!found)
+            filters[n++] = value;
+    }
+    for (unsigned j = n; j < numFilters; j++)
+        filters[j] = filters[0];
+
+    unsigned dontCare = 0;
+    for (uint16_t bit = 1; bit < CAN_STD_IDS; bit <<= 1)
+        dontCare += !(mask & bit);
+    return n << dontCare;
+}
+
+/**
+ * The sorted IDs are split in two runs, the first for RXB0 (2 filters) and
+ * the rest for RXB1 (4 filters). Every split is tried on short lists and
+ * the one that admits fewer IDs wins; long lists (ranges) are split at a
+ * third.
+ */
+void Mcp2515Backend::planFilters(const std::bitset<CAN_STD_IDS> &idSet)
+{
+    std::vector<uint16_t> ids;
+    for (uint16_t id = 0; id < CAN_STD_IDS; id++)
+        if (idSet[id])
+            ids.push_back(id);
+
+    unsigned count = ids.size();
+    unsigned first = 0, last = count;
+    if (count > 64)
+        first = last = count / 3;
+
+    unsigned best = CAN_STD_IDS * 2;
+    for (unsigned split = first; split <= last; split++)
+    {
+        uint16_t masks[2], filters[6];
+        unsigned admitted = reduceGroup(ids.data(), split, 2, masks[0], filters) +
+                            reduceGroup(ids.data() + split, count - split, 4, masks[1], filters + 2);
+        if (admitted >= best)
+            continue;
+
+        // An empty group repeats an ID of the other one instead of admitting ID 0
+        if (split == 0)
+            filters[0] = filters[1] = ids[0];
+        if (split == count)
+            filters[2] = filters[3] = filters[4] = filters[5] = ids[0];
+        best = admitted;
+        memcpy(hwMasks, masks, sizeof(hwMasks));
+        memcpy(hwFilters, filters, sizeof(hwFilters));
+    }
+}
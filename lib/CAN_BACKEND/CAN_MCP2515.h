@@ -0,0 +1,48 @@
+//********MART CAN MCP2515 BACKEND LIBRARY
+#ifndef CANMCP2515_H
+#define CANMCP2515_H
+
+#include <Arduino.h>
+#include "mcp_can.h"
+#include "CAN_Backend.h"
+
+/**
+ * External MCP2515 over SPI. Every register access is one SPI transaction,
+ * so poll() only reads CANINTF when the INT line is low.
+ */
+class Mcp2515Backend : public CanBackend
+{
+public:
+    Mcp2515Backend(int pinCs) : mcp(pinCs) {}
+    Mcp2515Backend(SPIClass *spi, int pinCs, int pinInt) : mcp(spi, pinCs) { mcp.pinINT = pinInt; }
+
+    bool begin(int kbps) override;
+    uint8_t poll() override;
+    bool read(CanPacketRawData &frame) override;
+    bool write(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data) override;
+
+    uint8_t getErrorFlags() override { return mcp.getError(); }
+    uint8_t errorCountRX() override { return mcp.errorCountRX(); }
+    uint8_t errorCountTX() override { return mcp.errorCountTX(); }
+
+    void abortTx() override;
+    bool txIdle() override { return mcp.txPending() == 0; }
+    void restart() override;
+
+    bool applyFilter(const CanIdFilter &filter) override;
+    bool hwAccepts(unsigned long id, bool extended) const override;
+
+    int interruptPin() const override { return mcp.pinINT; }
+
+    MCP_CAN mcp;
+
+private:
+    // RXB0 has mask 0 and filters 0-1, RXB1 mask 1 and filters 2-5 (standard IDs only)
+    uint16_t hwMasks[2] = {0, 0};
+    uint16_t hwFilters[6] = {0, 0, 0, 0, 0, 0};
+    bool hwFiltering = false;
+
+    void planFilters(const std::bitset<CAN_STD_IDS> &ids);
+};
+
+#endif
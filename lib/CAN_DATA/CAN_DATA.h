@@ -11,6 +11,7 @@ private:
     CanPacketRawData *lastAddedPacket;       // Pointer to the last added packet
     std::vector<unsigned long> removableIds; // List of IDs whose packets should be auto-removed after being read
     bool allIdsRemovable;                    // Flag to indicate if all IDs are removable
+    CanPacketRawData takenPacket;            // Copy of the last packet removed by getPacketById
 public:
     CAN_DATA()
     {
@@ -22,11 +23,14 @@ public:
     // Adds a CAN packet to the storage, keeping packets sorted by their ID
     void addPacket(const CanPacketRawData &packet)
     {
-        // Use std::find_if to check if a packet with the same id already exists
-        auto it = std::find_if(packets.begin(), packets.end(), [&packet](const CanPacketRawData &a)
-                               { return a.id == packet.id; });
+        // Packets are sorted, so the existing packet (or the insertion point) is found with a binary search
+        auto it = std::lower_bound(packets.begin(), packets.end(), packet.id,
+                                   [](const CanPacketRawData &a, unsigned long id)
+                                   {
+                                       return a.id < id;
+                                   });
 
-        if (it != packets.end())
+        if ((it != packets.end()) && (it->id == packet.id))
         {
             // If a packet with the same id is found, update its information
             it->size = packet.size;
@@ -36,20 +40,35 @@ public:
         else
         {
             // If no packet with the same id exists, add the new packet in sorted order
-            auto insertIt = std::lower_bound(packets.begin(), packets.end(), packet,
-                                             [](const CanPacketRawData &a, const CanPacketRawData &b)
-                                             {
-                                                 return a.id < b.id;
-                                             });
-            auto insertedIt = packets.insert(insertIt, packet); // Insert and get iterator to the new element
-            lastAddedPacket = &(*insertedIt);                   // Update the pointer to the last added packet
+            auto insertedIt = packets.insert(it, packet); // Insert and get iterator to the new element
+            lastAddedPacket = &(*insertedIt);             // Update the pointer to the last added packet
+            generation++;
         }
     }
 
+    // Index of the packet with that ID, -1 if not stored. Valid until generation changes
+    int indexOf(unsigned long id) const
+    {
+        auto it = std::lower_bound(packets.begin(), packets.end(), id,
+                                   [](const CanPacketRawData &a, unsigned long id)
+                                   {
+                                       return a.id < id;
+                                   });
+        if ((it != packets.end()) && (it->id == id))
+            return it - packets.begin();
+        return -1;
+    }
+
+    CanPacketRawData &packetAt(size_t index) { return packets[index]; }
+    size_t size() const { return packets.size(); }
+
+    // Changes every time packets are inserted or removed, so stored indexes can be revalidated
+    unsigned long generation = 0;
     
     // Removes a CAN packet from the storage by its ID
     void removePacket(unsigned long id)
     {
+        generation++;
         packets.erase(std::remove_if(packets.begin(), packets.end(),
                                      [id](const CanPacketRawData &packet)
                                      {
@@ -63,16 +82,19 @@ public:
     // Retrieves a packet by its ID and removes it if its ID is in the removable list or if all IDs are marked as removable
     const CanPacketRawData *getPacketById(unsigned long id)
     {
-        auto it = std::find_if(packets.begin(), packets.end(),
-                               [id](const CanPacketRawData &packet)
-                               { return packet.id == id; });
-        if (it != packets.end())
+        int index = indexOf(id);
+        if (index >= 0)
         {
+            auto it = packets.begin() + index;
             CanPacketRawData *foundPacket = &(*it);
             // Check if this ID should be auto-removed or if all IDs are removable
             if (allIdsRemovable || std::find(removableIds.begin(), removableIds.end(), id) != removableIds.end())
             {
+                // The caller gets a copy, the erased slot is taken by the next packet
+                takenPacket = *it;
+                foundPacket = &takenPacket;
                 packets.erase(it); // Remove the packet
+                generation++;
             }
             return foundPacket;
         }
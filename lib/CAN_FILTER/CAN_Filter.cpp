@@ -0,0 +1,118 @@
+#include "CAN_Filter.h"
+
+void CanIdFilter::addId(unsigned long id, bool extended)
+{
+    if (!extended)
+    {
+        stdIds.set(id & (CAN_STD_IDS - 1));
+        return;
+    }
+    uint32_t extId = id & 0x1FFFFFFF;
+    auto it = std::lower_bound(extIds.begin(), extIds.end(), extId);
+    if ((it == extIds.end()) || (*it != extId))
+        extIds.insert(it, extId);
+}
+
+/**
+ * Standard ranges go into the bit map, small extended ranges into the ID
+ * table and the rest are kept as a rule.
+ */
+void CanIdFilter::addRange(unsigned long first, unsigned long last, bool extended)
+{
+    if (first > last)
+        return;
+    if (!extended)
+    {
+        for (unsigned long id = first; (id <= last) && (id < CAN_STD_IDS); id++)
+            stdIds.set(id);
+        return;
+    }
+    first &= 0x1FFFFFFF;
+    last &= 0x1FFFFFFF;
+    if (last - first < CAN_FILTER_EXT_EXPAND)
+    {
+        for (unsigned long id = first; id <= last; id++)
+            addId(id, true);
+        return;
+    }
+    extRules.push_back({(uint32_t)first, (uint32_t)last, true});
+}
+
+void CanIdFilter::addMask(unsigned long match, unsigned long mask, bool extended)
+{
+    if (!extended)
+    {
+        mask &= CAN_STD_IDS - 1;
+        for (unsigned long id = 0; id < CAN_STD_IDS; id++)
+            if ((id & mask) == (match & mask))
+                stdIds.set(id);
+        return;
+    }
+    mask &= 0x1FFFFFFF;
+    if (mask == 0x1FFFFFFF)
+        addId(match, true);
+    else
+        extRules.push_back({(uint32_t)(match & mask), (uint32_t)mask, false});
+}
+
+void CanIdFilter::add(const CanIdFilter &other)
+{
+    stdIds |= other.stdIds;
+    for (uint32_t id : other.extIds)
+        addId(id, true);
+    extRules.insert(extRules.end(), other.extRules.begin(), other.extRules.end());
+}
+
+void CanIdFilter::clear()
+{
+    stdIds.reset();
+    extIds.clear();
+    extRules.clear();
+}
+
+bool CanIdFilter::acceptsExtended(uint32_t id) const
+{
+    if (std::binary_search(extIds.begin(), extIds.end(), id))
+        return true;
+    for (const ExtRule &rule : extRules)
+    {
+        if (rule.range ? ((id >= rule.a) && (id <= rule.b)) : ((id & rule.b) == rule.a))
+            return true;
+    }
+    return false;
+}
+
+void CanIdFilter::print() const
+{
+    Serial.println((String) "Standard IDs: " + stdIds.count() + " extended IDs: " + extIds.size() +
+                   " extended rules: " + extRules.size());
+    for (unsigned id = 0; id < CAN_STD_IDS; id++)
+    {
+        if (!stdIds[id])
+            continue;
+        unsigned last = id;
+        while ((last + 1 < CAN_STD_IDS) && stdIds[last + 1])
+            last++;
+        Serial.print("  0x");
+        Serial.print(id, HEX);
+        if (last != id)
+        {
+            Serial.print("-0x");
+            Serial.print(last, HEX);
+        }
+        Serial.println();
+        id = last;
+    }
+    for (uint32_t id : extIds)
+    {
+        Serial.print("  x0x");
+        Serial.println(id, HEX);
+    }
+    for (const ExtRule &rule : extRules)
+    {
+        Serial.print("  x0x");
+        Serial.print(rule.a, HEX);
+        Serial.print(rule.range ? "-0x" : "/0x");
+        Serial.println(rule.b, HEX);
+    }
+}
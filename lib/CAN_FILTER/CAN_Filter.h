@@ -0,0 +1,58 @@
+//********MART CAN ID FILTER LIBRARY
+#ifndef CANFILTER_H
+#define CANFILTER_H
+
+#include <Arduino.h>
+#include <bitset>
+#include <vector>
+
+#define CAN_STD_IDS           2048 // 11 bit identifiers
+#define CAN_FILTER_EXT_EXPAND 64   // Extended ranges up to this size are stored as single IDs
+
+/**
+ * Software acceptance filter. Standard IDs, ranges and masks are expanded
+ * into a 2048 bit map, so accepting a standard frame is a single bit test.
+ * Extended IDs are kept in a sorted table (binary search) plus a short list
+ * of range and mask rules that are only checked when the table misses.
+ * An empty filter accepts nothing, the caller decides what "no filter" means.
+ */
+class CanIdFilter
+{
+public:
+    // id without the MCP_CAN flags (bits 30/31)
+    void addId(unsigned long id, bool extended);
+    void addRange(unsigned long first, unsigned long last, bool extended);
+    // Accepts every id with (id & mask) == (match & mask)
+    void addMask(unsigned long match, unsigned long mask, bool extended);
+    // Accepts what any of both filters accepts
+    void add(const CanIdFilter &other);
+    void clear();
+
+    bool accepts(unsigned long id, bool extended) const
+    {
+        if (!extended)
+            return stdIds[id & (CAN_STD_IDS - 1)];
+        return acceptsExtended(id & 0x1FFFFFFF);
+    }
+
+    bool empty() const { return stdIds.none() && !hasExtended(); }
+    bool hasExtended() const { return !extIds.empty() || !extRules.empty(); }
+    const std::bitset<CAN_STD_IDS> &standardIds() const { return stdIds; }
+
+    void print() const;
+
+private:
+    struct ExtRule
+    {
+        uint32_t a, b; // first/last for ranges, match/mask for masks
+        bool range;
+    };
+
+    std::bitset<CAN_STD_IDS> stdIds;
+    std::vector<uint32_t> extIds; // Sorted, no duplicates
+    std::vector<ExtRule> extRules;
+
+    bool acceptsExtended(uint32_t id) const;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include "CAN_IsoTp.h"
+
+int IsoTp::open(unsigned long txId, unsigned long rxId, bool extended, uint8_t *rxBuf, uint16_t rxSize,
+                uint8_t blockSize, uint8_t stMin)
+{
+    if (numSessions >= ISOTP_MAX_SESSIONS)
+        return -1;
+
+    Session &ss = sessions[numSessions];
+    memset(&ss, 0, sizeof(ss));
+    ss.txId = txId;
+    ss.rxId = rxId;
+    ss.extended = extended;
+    ss.rxBuf = rxBuf;
+    ss.rxSize = rxSize;
+    ss.blockSize = blockSize;
+    ss.stMin = stMin;
+    ss.rxState = RX_IDLE;
+    ss.txState = TX_IDLE;
+
+    // The frames of the session are consumed before the software filter, the controller has to let them in
+    bus.admitFrames(extended ? (rxId | 0x80000000) : rxId, 0x9FFFFFFF);
+    return numSessions++;
+}
+
+bool IsoTp::send(int s, const uint8_t *data, uint16_t len)
+{
+    Session &ss = sessions[s];
+    if ((ss.txState != TX_IDLE) || (len == 0) || (len > ISOTP_MAX_LENGTH))
+        return false;
+
+    ss.txData = data;
+    ss.txLen = len;
+    ss.txWaits = 0;
+    ss.txTime = millis();
+    ss.txState = TX_START;
+    sendStart(ss);
+    return true;
+}
+
+bool IsoTp::onFrame(const CanPacketRawData &frame)
+{
+    if (frame.rrf || (frame.size == 0))
+        return false;
+
+    unsigned long id = frame.id & 0x1FFFFFFF;
+    for (unsigned s = 0; s < numSessions; s++)
+    {
+        Session &ss = sessions[s];
+        if ((ss.rxId != id) || (ss.extended != (bool)frame.typeExtendedId))
+            continue;
+
+        if ((frame.bytes[0] & 0xF0) == ISOTP_FLOW_CONTROL)
+            onFlowControl(ss, frame.bytes);
+        else
+            onData(ss, frame);
+        return true;
+    }
+    return false;
+}
+
+void IsoTp::update()
+{
+    for (unsigned s = 0; s < numSessions; s++)
+    {
+        Session &ss = sessions[s];
+
+        if ((ss.rxState == RX_RECEIVING) && ((millis() - ss.rxTime) > ISOTP_TIMEOUT_CR))
+        {
+            ss.rxState = RX_IDLE;
+            numRxErrors++;
+        }
+
+        // Retries the single or first frame if the bus did not take it
+        if (ss.txState == TX_START)
+            sendStart(ss);
+        if (((ss.txState == TX_START) || (ss.txState == TX_WAIT_FC)) && ((millis() - ss.txTime) > ISOTP_TIMEOUT_BS))
+        {
+            ss.txState = TX_IDLE;
+            numTxErrors++;
+        }
+        if ((ss.txState == TX_SENDING) && ((micros() - ss.txLast) > ISOTP_TIMEOUT_CR * 1000UL))
+        {
+            ss.txState = TX_IDLE; // The receiver has given up by now
+            numTxErrors++;
+        }
+        sendBlock(ss);
+    }
+}
+
+void IsoTp::printStatus()
+{
+    Serial.println((String) "ISO-TP sessions: " + numSessions + " rx: " + numRxMessages + " tx: " + numTxMessages +
+                   " rx errors: " + numRxErrors + " tx errors: " + numTxErrors + " rx overflows: " + numRxOverflows);
+}
+
+bool IsoTp::sendFrame(Session &ss, const uint8_t *frame)
+{
+    return bus.sendFrame(ss.txId, ss.extended, 8, frame);
+}
+
+bool IsoTp::sendFlowControl(Session &ss, uint8_t status)
+{
+    uint8_t frame[8];
+    memset(frame, ISOTP_PADDING, sizeof(frame));
+    frame[0] = ISOTP_FLOW_CONTROL | status;
+    frame[1] = ss.blockSize;
+    frame[2] = ss.stMin;
+    return sendFrame(ss, frame);
+}
+
+/**
+ * Up to 7 bytes go in a single frame, longer messages start with a first
+ * frame and wait for the flow control of the receiver.
+ */
+bool IsoTp::sendStart(Session &ss)
+{
+    uint8_t frame[8];
+    if (ss.txLen <= 7)
+    {
+        memset(frame, ISOTP_PADDING, sizeof(frame));
+        frame[0] = ISOTP_SINGLE_FRAME | ss.txLen;
+        memcpy(frame + 1, ss.txData, ss.txLen);
+        if (!sendFrame(ss, frame))
+            return false;
+        ss.txState = TX_IDLE;
+        numTxMessages++;
+        return true;
+    }
+
+    frame[0] = ISOTP_FIRST_FRAME | (ss.txLen >> 8);
+    frame[1] = ss.txLen & 0xFF;
+    memcpy(frame + 2, ss.txData, 6);
+    if (!sendFrame(ss, frame))
+        return false;
+    ss.txPos = 6;
+    ss.txSn = 1;
+    ss.txState = TX_WAIT_FC;
+    ss.txTime = millis();
+    return true;
+}
+
+// Consecutive frames while STmin allows, up to ISOTP_TX_BURST, the TX buffers of the controller set the pace
+void IsoTp::sendBlock(Session &ss)
+{
+    for (unsigned n = 0; (n < ISOTP_TX_BURST) && (ss.txState == TX_SENDING); n++)
+    {
+        if ((micros() - ss.txLast) < ss.txStMin)
+            break;
+        if (!sendConsecutive(ss))
+            break;
+    }
+}
+
+// Next consecutive frame, the last one is padded
+bool IsoTp::sendConsecutive(Session &ss)
+{
+    uint8_t frame[8];
+    uint16_t n = min((uint16_t)7, (uint16_t)(ss.txLen - ss.txPos));
+    frame[0] = ISOTP_CONSECUTIVE_FRAME | ss.txSn;
+    memcpy(frame + 1, ss.txData + ss.txPos, n);
+    if (n < 7)
+        memset(frame + 1 + n, ISOTP_PADDING, 7 - n);
+    if (!sendFrame(ss, frame))
+        return false; // Retried by update()
+
+    ss.txLast = micros();
+    ss.txPos += n;
+    ss.txSn = (ss.txSn + 1) & 0x0F;
+    if (ss.txPos >= ss.txLen)
+    {
+        ss.txState = TX_IDLE;
+        numTxMessages++;
+    }
+    else if (ss.txBlockSize && (++ss.txBlock >= ss.txBlockSize))
+    {
+        ss.txState = TX_WAIT_FC;
+        ss.txTime = millis();
+    }
+    return true;
+}
+
+void IsoTp::onFlowControl(Session &ss, const uint8_t *frame)
+{
+    if (ss.txState != TX_WAIT_FC)
+        return;
+
+    switch (frame[0] & 0x0F)
+    {
+    case ISOTP_FC_CTS:
+        ss.txBlockSize = frame[1];
+        ss.txBlock = 0;
+        ss.txStMin = stMinToUs(frame[2]);
+        ss.txWaits = 0;
+        ss.txState = TX_SENDING;
+        ss.txLast = micros() - ss.txStMin; // The first frame of the block can go now
+        sendBlock(ss);
+        break;
+    case ISOTP_FC_WAIT:
+        if (++ss.txWaits > ISOTP_MAX_WAIT)
+        {
+            ss.txState = TX_IDLE;
+            numTxErrors++;
+        }
+        else
+            ss.txTime = millis();
+        break;
+    default:
+        ss.txState = TX_IDLE;
+        numTxErrors++;
+        break;
+    }
+}
+
+void IsoTp::onData(Session &ss, const CanPacketRawData &frame)
+{
+    const uint8_t *b = frame.bytes;
+    switch (b[0] & 0xF0)
+    {
+    case ISOTP_SINGLE_FRAME:
+    {
+        uint8_t len = b[0] & 0x0F;
+        if ((len == 0) || (len > 7) || (len >= frame.size))
+            return;
+        if ((ss.rxState == RX_DONE) || (len > ss.rxSize))
+        {
+            numRxOverflows++;
+            return;
+        }
+        memcpy(ss.rxBuf, b + 1, len);
+        ss.rxLen = len;
+        ss.rxState = RX_DONE;
+        numRxMessages++;
+        break;
+    }
+    case ISOTP_FIRST_FRAME:
+    {
+        uint16_t len = ((b[0] & 0x0F) << 8) | b[1];
+        if ((len < 8) || (frame.size < 8))
+            return;
+        if (ss.rxState == RX_RECEIVING)
+            numRxErrors++; // A new first frame aborts the message in progress
+        if ((ss.rxState == RX_DONE) || (len > ss.rxSize))
+        {
+            numRxOverflows++;
+            sendFlowControl(ss, ISOTP_FC_OVERFLOW);
+            return;
+        }
+        memcpy(ss.rxBuf, b + 2, 6);
+        ss.rxLen = len;
+        ss.rxPos = 6;
+        ss.rxSn = 1;
+        ss.rxBlock = 0;
+        ss.rxTime = millis();
+        ss.rxState = RX_RECEIVING;
+        sendFlowControl(ss, ISOTP_FC_CTS);
+        break;
+    }
+    case ISOTP_CONSECUTIVE_FRAME:
+    {
+        if (ss.rxState != RX_RECEIVING)
+            return;
+        if ((b[0] & 0x0F) != ss.rxSn)
+        {
+            ss.rxState = RX_IDLE;
+            numRxErrors++;
+            return;
+        }
+        uint16_t n = min((uint16_t)(frame.size - 1), (uint16_t)(ss.rxLen - ss.rxPos));
+        memcpy(ss.rxBuf + ss.rxPos, b + 1, n);
+        ss.rxPos += n;
+        ss.rxSn = (ss.rxSn + 1) & 0x0F;
+        ss.rxTime = millis();
+        if (ss.rxPos >= ss.rxLen)
+        {
+            ss.rxState = RX_DONE;
+            numRxMessages++;
+        }
+        else if (ss.blockSize && (++ss.rxBlock >= ss.blockSize))
+        {
+            ss.rxBlock = 0;
+            sendFlowControl(ss, ISOTP_FC_CTS);
+        }
+        break;
+    }
+    }
+}
+
+// STmin: 0-127 ms, 0xF1-0xF9 100-900 us, reserved values are taken as the longest
+uint32_t IsoTp::stMinToUs(uint8_t stMin)
+{
+    if (stMin <= 0x7F)
+        return stMin * 1000UL;
+    if ((stMin >= 0xF1) && (stMin <= 0xF9))
+        return (stMin - 0xF0) * 100UL;
+    return 127000UL;
+}
@@ -0,0 +1,122 @@
+//********MART ISO-TP LIBRARY
+#ifndef CANISOTP_H
+#define CANISOTP_H
+
+#include <Arduino.h>
+#include "MART_CAN.h"
+
+#define ISOTP_MAX_SESSIONS 4    // Pairs of IDs the node talks ISO-TP on
+#define ISOTP_MAX_LENGTH   4095 // Longest message (12 bit length, no escape sequence)
+#define ISOTP_TIMEOUT_BS   1000 // ms waiting for a flow control frame (N_Bs)
+#define ISOTP_TIMEOUT_CR   1000 // ms waiting for the next consecutive frame (N_Cr)
+#define ISOTP_MAX_WAIT     10   // Flow control WAIT frames accepted in a row before giving up
+#define ISOTP_TX_BURST     8    // Consecutive frames sent per update() when STmin is 0
+#define ISOTP_PADDING      0xCC // Unused bytes of the frames, every frame has DLC 8
+
+// Protocol control information, high nibble of the first byte
+#define ISOTP_SINGLE_FRAME      0x00
+#define ISOTP_FIRST_FRAME       0x10
+#define ISOTP_CONSECUTIVE_FRAME 0x20
+#define ISOTP_FLOW_CONTROL      0x30
+
+// Flow status of a flow control frame
+#define ISOTP_FC_CTS      0x00
+#define ISOTP_FC_WAIT     0x01
+#define ISOTP_FC_OVERFLOW 0x02
+
+/**
+ * ISO 15765-2 transport on top of CAN_BUS, for messages that do not fit in
+ * one frame. Every session is a pair of IDs with its own receive buffer,
+ * given by the caller: consecutive frames are copied straight from the CAN
+ * frame to their place in it and the message stays there until release().
+ * send() does not copy either, the data has to stay valid until txBusy()
+ * is false. onFrame() and update() must run in the task that owns the bus.
+ */
+class IsoTp
+{
+public:
+    IsoTp(CAN_BUS &_bus) : bus(_bus) {}
+
+    // Opens a session: frames from rxId are reassembled in rxBuf, frames are sent with txId.
+    // blockSize and stMin go in the flow control frames this node sends. Returns the session or -1
+    int open(unsigned long txId, unsigned long rxId, bool extended, uint8_t *rxBuf, uint16_t rxSize,
+             uint8_t blockSize = 0, uint8_t stMin = 0);
+
+    // Starts sending a message, false if the session is already sending or len is too long
+    bool send(int s, const uint8_t *data, uint16_t len);
+    bool txBusy(int s) const { return sessions[s].txState != TX_IDLE; }
+    // A message of the session is being sent, received or waits to be released
+    bool busy(int s) const { return txBusy(s) || (sessions[s].rxState != RX_IDLE); }
+
+    // A whole message is waiting in the receive buffer of the session
+    bool available(int s) const { return sessions[s].rxState == RX_DONE; }
+    const uint8_t *data(int s) const { return sessions[s].rxBuf; }
+    uint16_t length(int s) const { return sessions[s].rxLen; }
+    // The buffer can take the next message
+    void release(int s) { sessions[s].rxState = RX_IDLE; }
+
+    // Called with every received frame, true if it belonged to a session
+    bool onFrame(const CanPacketRawData &frame);
+
+    // Sends the consecutive frames that are due and drops stalled transfers
+    void update();
+
+    void printStatus();
+
+    //** ISO-TP DATA **//
+    unsigned long numRxMessages = 0, numTxMessages = 0;
+    unsigned long numRxErrors = 0;   // Wrong sequence numbers and N_Cr timeouts
+    unsigned long numTxErrors = 0;   // N_Bs timeouts, overflows reported by the receiver, frames the bus did not take
+    unsigned long numRxOverflows = 0; // First frames refused because the buffer was busy or too small
+
+private:
+    enum RxState
+    {
+        RX_IDLE,
+        RX_RECEIVING,
+        RX_DONE
+    };
+    enum TxState
+    {
+        TX_IDLE,
+        TX_START,    // Single or first frame waiting for the bus
+        TX_WAIT_FC,  // First frame or a block sent, waiting for flow control
+        TX_SENDING
+    };
+
+    struct Session
+    {
+        unsigned long txId, rxId;
+        bool extended;
+        uint8_t blockSize, stMin; // Sent in our flow control frames
+
+        uint8_t *rxBuf;
+        uint16_t rxSize, rxLen, rxPos;
+        uint8_t rxSn, rxBlock;
+        RxState rxState;
+        unsigned long rxTime; // millis() of the last frame received
+
+        const uint8_t *txData;
+        uint16_t txLen, txPos;
+        uint8_t txSn, txBlock, txBlockSize, txWaits;
+        uint32_t txStMin;     // us between consecutive frames asked by the receiver
+        TxState txState;
+        unsigned long txTime; // millis() of the start or of the last frame before waiting for flow control
+        uint32_t txLast;      // micros() of the last consecutive frame
+    };
+
+    CAN_BUS &bus;
+    Session sessions[ISOTP_MAX_SESSIONS];
+    unsigned numSessions = 0;
+
+    bool sendFrame(Session &ss, const uint8_t *frame);
+    bool sendFlowControl(Session &ss, uint8_t status);
+    bool sendStart(Session &ss);
+    void sendBlock(Session &ss);
+    bool sendConsecutive(Session &ss);
+    void onFlowControl(Session &ss, const uint8_t *frame);
+    void onData(Session &ss, const CanPacketRawData &frame);
+    static uint32_t stMinToUs(uint8_t stMin);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "CAN_Manager.h"
+
+int CanManager::addController(CAN_BUS &bus)
+{
+    if (numControllers >= CAN_MAX_CONTROLLERS)
+        return -1;
+
+    Controller &c = controllers[numControllers];
+    c.bus = &bus;
+    c.lock = xSemaphoreCreateRecursiveMutex();
+    c.manager = this;
+    c.index = numControllers;
+    bus.setLock(c.lock);
+
+    // Controllers without an INT line (TWAI) are polled on every dispatch()
+    int pin = bus.controller.interruptPin();
+    if (pin >= 0)
+    {
+        pinMode(pin, INPUT_PULLUP);
+        attachInterruptArg(pin, interrupt, &c, FALLING);
+    }
+    return numControllers++;
+}
+
+bool CanManager::addGatewayRule(const GatewayRule &rule)
+{
+    if ((numRules >= CAN_MAX_GATEWAY_RULES) || (rule.from >= numControllers) || (rule.to >= numControllers) ||
+        (rule.from == rule.to))
+        return false;
+    rules[numRules++] = rule;
+    controllers[rule.from].bus->admitFrames(rule.match, rule.mask); // Source frames may be filtered out otherwise
+    return true;
+}
+
+/**
+ * The INT line of an MCP2515 stays low while any flag is set, and an edge
+ * can be missed while it is already low, so a controller is serviced when
+ * it is pending or its line is still low. Each one is read at most burst
+ * times per call so a busy bus cannot starve the others.
+ */
+unsigned CanManager::dispatch(unsigned burst)
+{
+    uint32_t mask = pending.exchange(0);
+    unsigned numRead = 0;
+
+    for (unsigned i = 0; i < numControllers; i++)
+    {
+        CAN_BUS &bus = *controllers[i].bus;
+        int pin = bus.controller.interruptPin();
+        if (!(mask & (1UL << i)) && (pin >= 0) && (digitalRead(pin) == HIGH))
+            continue;
+
+        for (unsigned n = 0; n < burst; n++)
+        {
+            if (!bus.receive())
+                break;
+            numRead++;
+            if (numRules)
+                forward(i, bus.DataIN.dataRaw);
+        }
+    }
+    return numRead;
+}
+
+void CanManager::printStatus()
+{
+    for (unsigned i = 0; i < numControllers; i++)
+    {
+        Serial.println((String) "Bus " + i + ":");
+        controllers[i].bus->errorSupervisor.printStatus();
+    }
+    Serial.println((String) "Gateway rules: " + numRules + " forwarded: " + numForwarded + " drops: " + numForwardDrops);
+}
+
+// Sends the received frame on every destination bus straight from the source DataIN buffer
+void CanManager::forward(uint8_t from, const CanPacketRawData &frame)
+{
+    if (frame.rrf)
+        return; // Remote requests are answered by each bus, not forwarded
+
+    for (unsigned r = 0; r < numRules; r++)
+    {
+        const GatewayRule &rule = rules[r];
+        if ((rule.from != from) || ((frame.id & rule.mask) != rule.match))
+            continue;
+
+        unsigned long id = rule.translatedId ? rule.translatedId : frame.id;
+        bool extended = rule.translatedId ? (id > 0x7FF) : frame.typeExtendedId;
+        if (controllers[rule.to].bus->sendFrame(id, extended, frame.size, frame.bytes))
+            numForwarded++;
+        else
+            numForwardDrops++;
+    }
+}
+
+void IRAM_ATTR CanManager::interrupt(void *arg)
+{
+    Controller *c = (Controller *)arg;
+    CanManager *m = c->manager;
+    m->lastInterruptTime = micros();
+    m->pending.fetch_or(1UL << c->index);
+
+    if (m->taskToNotify != nullptr)
+    {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(m->taskToNotify, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
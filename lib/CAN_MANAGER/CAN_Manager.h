@@ -0,0 +1,84 @@
+//********MART CAN MANAGER LIBRARY
+#ifndef CANMANAGER_H
+#define CANMANAGER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "MART_CAN.h"
+
+#define CAN_MAX_CONTROLLERS  4  // MCP2515s handled by one manager
+#define CAN_MAX_GATEWAY_RULES 16
+
+/**
+ * Several MCP2515s, usually on one SPI host with a chip select each. Every
+ * controller gets its own recursive mutex (set with CAN_BUS::setLock) so
+ * the tasks that use it never interleave register sequences, while the
+ * SPI host itself is arbitrated by SPIClass::beginTransaction(). The INT
+ * lines are merged: the ISRs only mark the controller as pending and wake
+ * one task, which calls dispatch() to empty them in turn and apply the
+ * gateway rules.
+ */
+class CanManager
+{
+public:
+    // Frames received on bus "from" whose (id & mask) == match are sent again on bus "to"
+    struct GatewayRule
+    {
+        uint8_t from, to;
+        unsigned long match, mask;
+        unsigned long translatedId; // 0 keeps the original id
+    };
+
+    CanManager() : pending(0)
+    {
+        numControllers = 0;
+        numRules = 0;
+        taskToNotify = nullptr;
+        numForwarded = 0;
+        numForwardDrops = 0;
+        lastInterruptTime = 0;
+    }
+
+    // Registers a controller and attaches its INT pin. return its index, -1 if there is no room
+    int addController(CAN_BUS &bus);
+
+    // Task woken from the INT interrupts, the one that calls dispatch()
+    void setTaskToNotify(TaskHandle_t task) { taskToNotify = task; }
+
+    bool addGatewayRule(const GatewayRule &rule);
+
+    // Reads up to burst frames from every controller that raised its INT line (or still holds it low)
+    // and forwards them as the rules say. return the number of frames read
+    unsigned dispatch(unsigned burst);
+
+    CAN_BUS &operator[](unsigned i) { return *controllers[i].bus; }
+    unsigned size() const { return numControllers; }
+
+    void printStatus();
+
+    //** MANAGER DATA **//
+    unsigned long numForwarded;    // Frames sent through a gateway rule
+    unsigned long numForwardDrops; // Frames a rule could not send (destination busy or bus-off)
+    volatile unsigned long lastInterruptTime; // micros() of the last INT edge of any controller
+
+private:
+    struct Controller
+    {
+        CAN_BUS *bus;
+        SemaphoreHandle_t lock;
+        CanManager *manager;
+        uint8_t index;
+    };
+
+    Controller controllers[CAN_MAX_CONTROLLERS];
+    unsigned numControllers;
+    GatewayRule rules[CAN_MAX_GATEWAY_RULES];
+    unsigned numRules;
+    std::atomic<uint32_t> pending; // One bit per controller with an INT edge not yet serviced
+    TaskHandle_t taskToNotify;
+
+    void forward(uint8_t from, const CanPacketRawData &frame);
+    static void IRAM_ATTR interrupt(void *arg);
+};
+
+#endif
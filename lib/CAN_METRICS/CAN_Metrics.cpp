@@ -0,0 +1,200 @@
+#include "CAN_Metrics.h"
+
+/**
+ * Counts a received frame and updates the inter-arrival statistics of its
+ * ID. The mean interval and the jitter are exponential filters, so they
+ * follow changes in the sender period without storing any history.
+ */
+void CanMetrics::onRx(unsigned long id, bool extended, bool rtr, uint8_t dlc, const uint8_t *data)
+{
+    windowBits += frameBits(id, extended, rtr, dlc, data);
+
+    IdStats *stats = track(id);
+    if (stats == nullptr)
+        return;
+
+    uint32_t now = micros();
+    if (stats->rxCount > 0)
+    {
+        int32_t interval = now - stats->lastRx;
+        if (stats->rxCount == 1)
+        {
+            stats->meanInterval = interval;
+        }
+        else
+        {
+            int32_t deviation = abs(interval - (int32_t)stats->meanInterval);
+            stats->jitter += (deviation - (int32_t)stats->jitter) >> CAN_JITTER_SHIFT;
+            stats->meanInterval += (interval - (int32_t)stats->meanInterval) >> CAN_JITTER_SHIFT;
+            if ((uint32_t)deviation > stats->maxJitter)
+                stats->maxJitter = deviation;
+        }
+    }
+    stats->lastRx = now;
+    stats->rxCount++;
+}
+
+void CanMetrics::onTx(unsigned long id, bool extended, bool rtr, uint8_t dlc, const uint8_t *data)
+{
+    windowBits += frameBits(id, extended, rtr, dlc, data);
+
+    IdStats *stats = track(id);
+    if (stats != nullptr)
+        stats->txCount++;
+}
+
+void CanMetrics::sampleErrors(uint8_t _rec, uint8_t _tec, uint8_t _eflg)
+{
+    rec = _rec;
+    tec = _tec;
+    eflg = _eflg;
+    if (rec > maxRec)
+        maxRec = rec;
+    if (tec > maxTec)
+        maxTec = tec;
+    eflgSeen |= eflg;
+}
+
+void CanMetrics::update()
+{
+    unsigned long elapsed = millis() - windowStart;
+    if (elapsed < CAN_METRICS_WINDOW)
+        return;
+
+    // bits / (bitrate * s), in 0.1 %
+    busLoad = (uint16_t)min((uint64_t)1000, ((uint64_t)windowBits * 1000000) / ((uint64_t)bitrate * elapsed));
+    if (busLoad > peakBusLoad)
+        peakBusLoad = busLoad;
+    windowBits = 0;
+    windowStart = millis();
+}
+
+const CanMetrics::IdStats *CanMetrics::getIdStats(unsigned long id) const
+{
+    auto it = std::lower_bound(ids, ids + numIds, id, [](const IdStats &a, unsigned long id)
+                               { return a.id < id; });
+    if ((it != ids + numIds) && (it->id == id))
+        return it;
+    return nullptr;
+}
+
+void CanMetrics::reset()
+{
+    numIds = 0;
+    numUntrackedIds = 0;
+    rec = tec = eflg = 0;
+    maxRec = maxTec = 0;
+    eflgSeen = 0;
+    windowBits = 0;
+    windowStart = millis();
+    busLoad = peakBusLoad = 0;
+    txWait.reset();
+}
+
+void CanMetrics::print()
+{
+    Serial.println((String) "Bus load: " + (busLoad / 10.0) + " % peak: " + (peakBusLoad / 10.0) + " % at " +
+                   (bitrate / 1000) + " kbps");
+    Serial.println((String) "REC: " + rec + " (max " + maxRec + ") TEC: " + tec + " (max " + maxTec + ") EFLG: " + eflg +
+                   " seen: " + eflgSeen);
+    txWait.print("TX queue wait");
+    for (unsigned i = 0; i < numIds; i++)
+    {
+        const IdStats &s = ids[i];
+        Serial.println((String) "ID " + s.id + " rx: " + s.rxCount + " tx: " + s.txCount + " period: " + s.meanInterval +
+                       " us jitter: " + s.jitter + " us max: " + s.maxJitter + " us");
+    }
+    if (numUntrackedIds)
+        Serial.println((String) "Untracked IDs: " + numUntrackedIds);
+}
+
+// Stats of an ID, added in order the first time it is seen. nullptr if the table is full
+CanMetrics::IdStats *CanMetrics::track(unsigned long id)
+{
+    IdStats *it = std::lower_bound(ids, ids + numIds, id, [](const IdStats &a, unsigned long id)
+                                   { return a.id < id; });
+    if ((it != ids + numIds) && (it->id == id))
+        return it;
+
+    if (numIds >= CAN_METRICS_MAX_IDS)
+    {
+        numUntrackedIds++;
+        return nullptr;
+    }
+    memmove(it + 1, it, (ids + numIds - it) * sizeof(IdStats));
+    *it = {id, 0, 0, 0, 0, 0, 0};
+    numIds++;
+    return it;
+}
+
+/**
+ * SOF to the end of the CRC is built bit by bit to count the stuff bits
+ * (one after every five equal bits, the stuff bit counts for the next
+ * run), then CRC delimiter, ACK, EOF and intermission are added.
+ */
+uint32_t CanMetrics::frameBits(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data)
+{
+    uint8_t bitsBuf[128];
+    unsigned n = 0;
+    auto put = [&](uint32_t value, unsigned count)
+    {
+        for (int b = count - 1; b >= 0; b--)
+            bitsBuf[n++] = (value >> b) & 1;
+    };
+
+    put(0, 1); // SOF
+    if (extended)
+    {
+        put((id >> 18) & 0x7FF, 11);
+        put(1, 1); // SRR
+        put(1, 1); // IDE
+        put(id & 0x3FFFF, 18);
+        put(rtr, 1);
+        put(0, 2); // r1, r0
+    }
+    else
+    {
+        put(id & 0x7FF, 11);
+        put(rtr, 1);
+        put(0, 2); // IDE, r0
+    }
+    len = min(len, (uint8_t)8);
+    put(len, 4);
+    if (!rtr)
+    {
+        for (unsigned i = 0; i < len; i++)
+            put(data[i], 8);
+    }
+
+    uint16_t crc = 0;
+    for (unsigned i = 0; i < n; i++)
+    {
+        bool next = bitsBuf[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7FFF;
+        if (next)
+            crc ^= 0x4599;
+    }
+    put(crc, 15);
+
+    uint32_t stuffed = 0;
+    unsigned run = 1;
+    uint8_t last = bitsBuf[0];
+    for (unsigned i = 1; i < n; i++)
+    {
+        if (bitsBuf[i] == last)
+        {
+            if (++run == 5)
+            {
+                stuffed++;
+                last = !last; // The stuff bit starts the next run
+                run = 1;
+            }
+        }
+        else
+        {
+            last = bitsBuf[i];
+            run = 1;
+        }
+    }
+    return n + stuffed + 1 + 2 + 7 + 3; // CRC delimiter, ACK slot + delimiter, EOF, intermission
+}
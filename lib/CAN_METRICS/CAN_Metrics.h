@@ -0,0 +1,78 @@
+//********MART CAN METRICS LIBRARY
+#ifndef CANMETRICS_H
+#define CANMETRICS_H
+
+#include <Arduino.h>
+#include "latencyHistogram.h"
+
+#define CAN_METRICS_MAX_IDS   64   // IDs with their own counters, the rest are only counted in the bus load
+#define CAN_METRICS_WINDOW    1000 // Bus load window in ms
+#define CAN_METRICS_SAMPLE_MS 100  // Period of the REC/TEC/EFLG sampling
+#define CAN_JITTER_SHIFT      4    // Jitter and mean interval filters (1/16 per frame, as RFC 3550)
+
+class CanMetrics
+{
+public:
+    struct IdStats
+    {
+        unsigned long id;
+        uint32_t rxCount, txCount;
+        uint32_t lastRx;       // micros() of the last frame received
+        uint32_t meanInterval; // Filtered time between frames in us
+        uint32_t jitter;       // Filtered deviation from meanInterval in us
+        uint32_t maxJitter;    // Largest single deviation seen
+    };
+
+    CanMetrics()
+    {
+        bitrate = 1000000;
+        reset();
+    }
+
+    void setBitrate(uint32_t bps) { bitrate = bps; }
+
+    // Called by CAN_BUS for every frame that goes through the controller
+    void onRx(unsigned long id, bool extended, bool rtr, uint8_t dlc, const uint8_t *data);
+    void onTx(unsigned long id, bool extended, bool rtr, uint8_t dlc, const uint8_t *data);
+
+    // Time a frame spent in the TX queue before the MCP2515 accepted it
+    void onTxWait(uint32_t us) { txWait.record(us); }
+
+    // Last REC, TEC and EFLG read from the MCP2515
+    void sampleErrors(uint8_t _rec, uint8_t _tec, uint8_t _eflg);
+
+    // Closes the bus load window when CAN_METRICS_WINDOW has elapsed
+    void update();
+
+    // Bus load of the last window in 0.1 %, frames seen by this node with their real stuff bits
+    uint16_t getBusLoad() const { return busLoad; }
+    uint16_t getPeakBusLoad() const { return peakBusLoad; }
+
+    const IdStats *getIdStats(unsigned long id) const;
+
+    // Bits on the bus of a frame, stuff bits and interframe space included
+    static uint32_t frameBits(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data);
+
+    void reset();
+    void print();
+
+    //** METRICS DATA **//
+    LatencyHistogram txWait;
+    uint8_t rec, tec, eflg;     // Last sample
+    uint8_t maxRec, maxTec;     // Highest counters seen
+    uint8_t eflgSeen;           // Every EFLG bit seen since the last reset
+    unsigned long numUntrackedIds;
+
+private:
+    IdStats ids[CAN_METRICS_MAX_IDS]; // Sorted by id
+    unsigned numIds;
+
+    uint32_t bitrate;
+    uint32_t windowBits;
+    unsigned long windowStart;
+    uint16_t busLoad, peakBusLoad;
+
+    IdStats *track(unsigned long id);
+};
+
+#endif
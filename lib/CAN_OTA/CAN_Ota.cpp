@@ -0,0 +1,178 @@
+#include "CAN_Ota.h"
+
+/**
+ * Only one memory region: the image, from address 0. A new download is
+ * refused while one is being received or checked; after a failure or a
+ * finished image it starts over.
+ */
+uint8_t CanOta::requestDownload(uint32_t address, uint32_t size, uint16_t &maxBlock)
+{
+    uint8_t s = state;
+    if ((s == OTA_RECEIVING) || (s == OTA_FINISHING))
+        return UDS_NRC_DOWNLOAD_NOT_ACCEPTED;
+    if ((address != 0) || (size == 0) || (size > sink.maxSize()))
+        return UDS_NRC_REQUEST_OUT_OF_RANGE;
+    if (!sink.begin(size))
+        return UDS_NRC_DOWNLOAD_NOT_ACCEPTED;
+
+    imageSize = size;
+    received = 0;
+    written = 0;
+    numBlocks = numRepeated = 0;
+    full[0] = full[1] = false;
+    head = tail = 0;
+    counter = 0;
+    crc = 0;
+    checkCrc = false;
+    failNrc = 0;
+    tStart = millis();
+    tEnd = 0;
+    lastBlock = tStart;
+    state = OTA_RECEIVING;
+
+    maxBlock = OTA_BLOCK_SIZE + 2;
+    return 0;
+}
+
+/**
+ * The block counter starts at 1 and wraps from 0xFF to 0x00. The last block
+ * sent again (its response was lost) is answered without writing it twice.
+ */
+uint8_t CanOta::transferData(uint8_t blockCounter, const uint8_t *data, uint16_t len)
+{
+    uint8_t s = state;
+    if (s == OTA_FAILED)
+        return failNrc;
+    if (s != OTA_RECEIVING)
+        return UDS_NRC_SEQUENCE_ERROR;
+    if ((numBlocks > 0) && (blockCounter == counter))
+    {
+        numRepeated++;
+        return 0;
+    }
+    if (blockCounter != (uint8_t)(counter + 1))
+        return UDS_NRC_WRONG_BLOCK_COUNTER;
+    if ((len == 0) || (len > OTA_BLOCK_SIZE))
+        return UDS_NRC_INCORRECT_LENGTH;
+    if (received + len > imageSize)
+        return UDS_NRC_TRANSFER_SUSPENDED;
+
+    // Both buffers still waiting for the flash: the request stays in the ISO-TP buffer
+    if (full[head])
+        return OTA_BUSY;
+    memcpy(buffers[head], data, len);
+    bufferLen[head] = len;
+    full[head] = true;
+    head ^= 1;
+    wakeWriter();
+
+    counter = blockCounter;
+    received += len;
+    numBlocks++;
+    lastBlock = millis();
+    return 0;
+}
+
+// param: nothing or the CRC-32 of the whole image, big endian
+uint8_t CanOta::requestExit(const uint8_t *param, uint16_t len)
+{
+    if (state == OTA_FAILED)
+        return failNrc;
+    if ((len != 0) && (len != 4))
+        return UDS_NRC_INCORRECT_LENGTH;
+    if ((state != OTA_RECEIVING) || (received != imageSize))
+        return UDS_NRC_SEQUENCE_ERROR;
+
+    checkCrc = (len == 4);
+    if (checkCrc)
+        expectedCrc = ((uint32_t)param[0] << 24) | ((uint32_t)param[1] << 16) | ((uint32_t)param[2] << 8) | param[3];
+
+    // The writer may have failed in the meantime
+    uint8_t expected = OTA_RECEIVING;
+    if (!state.compare_exchange_strong(expected, OTA_FINISHING))
+        return failNrc;
+    wakeWriter();
+    return 0;
+}
+
+uint8_t CanOta::exitResult() const
+{
+    switch (state)
+    {
+    case OTA_FINISHING:
+        return OTA_BUSY;
+    case OTA_DONE:
+        return 0;
+    case OTA_FAILED:
+        return failNrc;
+    default:
+        return UDS_NRC_SEQUENCE_ERROR;
+    }
+}
+
+/**
+ * Writer task: programs the buffers in the order they were filled. While
+ * the flash is busy the CAN task keeps receiving into the other buffer.
+ */
+bool CanOta::service()
+{
+    uint8_t s = state;
+    if ((s != OTA_RECEIVING) && (s != OTA_FINISHING))
+        return false;
+
+    if (full[tail])
+    {
+        bool ok = sink.write(buffers[tail], bufferLen[tail]);
+        crc = crc32Update(crc, buffers[tail], bufferLen[tail]);
+        written += bufferLen[tail];
+        full[tail] = false;
+        tail ^= 1;
+        if (!ok)
+            fail(UDS_NRC_PROGRAMMING_FAILURE);
+        return true;
+    }
+
+    if (s == OTA_FINISHING)
+    {
+        tEnd = millis();
+        if ((written != imageSize) || (checkCrc && (crc != expectedCrc)))
+            fail(UDS_NRC_PROGRAMMING_FAILURE);
+        else if (!sink.end())
+        {
+            failNrc = UDS_NRC_PROGRAMMING_FAILURE;
+            state = OTA_FAILED; // end() already released the partition
+        }
+        else
+            state = OTA_DONE;
+        return true;
+    }
+
+    if ((millis() - lastBlock) > OTA_TIMEOUT)
+    {
+        fail(UDS_NRC_TRANSFER_SUSPENDED);
+        return true;
+    }
+    return false;
+}
+
+void CanOta::printStatus()
+{
+    static const char *names[] = {"idle", "receiving", "finishing", "done", "failed"};
+    unsigned long ms = (tEnd ? tEnd : millis()) - tStart;
+    Serial.println((String) "OTA " + names[state] + ": " + written.load() + "/" + imageSize + " bytes, blocks: " + numBlocks +
+                   " repeated: " + numRepeated +
+                   (ms ? (String) ", " + (written.load() / ms) + " kB/s" : (String) ""));
+}
+
+void CanOta::fail(uint8_t nrc)
+{
+    failNrc = nrc;
+    sink.abort();
+    state = OTA_FAILED;
+}
+
+void CanOta::wakeWriter()
+{
+    if (writerTask)
+        xTaskNotifyGive(writerTask);
+}
@@ -0,0 +1,105 @@
+//********MART CAN FIRMWARE UPDATE LIBRARY
+#ifndef CANOTA_H
+#define CANOTA_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "CAN_Uds.h"
+#include "crc32.h"
+
+#define OTA_BLOCK_SIZE (UDS_MAX_REQUEST - 2) // Image bytes per TransferData (request = SID + counter + data)
+#define OTA_TIMEOUT    5000                   // ms without blocks before an unfinished download is dropped
+
+/**
+ * Where the image goes: the inactive OTA partition on the ESP32, memory or
+ * a file on the host. begin() must be quick, write() and end() run in the
+ * writer task and may take as long as the flash needs.
+ */
+class FirmwareSink
+{
+public:
+    virtual ~FirmwareSink() {}
+
+    virtual uint32_t maxSize() = 0;
+    virtual bool begin(uint32_t size) = 0;
+    virtual bool write(const uint8_t *data, size_t len) = 0;
+    // Checks the whole image and makes it the one that boots next, in one step
+    virtual bool end() = 0;
+    virtual void abort() = 0;
+};
+
+/**
+ * Firmware download through the UDS block transfer (RequestDownload,
+ * TransferData, RequestTransferExit). Blocks are copied into one of two
+ * buffers: the CAN task answers a block as soon as it has a free buffer,
+ * so the next block is already on the bus while the writer task programs
+ * the previous one. The CRC-32 of the image is updated as the blocks are
+ * written and compared with the one in RequestTransferExit; only then is
+ * the image handed to FirmwareSink::end().
+ *
+ * requestDownload(), transferData() and exitResult() belong to the CAN task,
+ * service() to the writer task.
+ */
+class CanOta
+{
+public:
+    // transferData() / exitResult(): nothing can be said yet, ask again later
+    static const uint8_t OTA_BUSY = 0xFF;
+
+    CanOta(FirmwareSink &_sink) : sink(_sink) {}
+
+    // Task woken when a block is ready to be written (nullptr: service() is polled)
+    void setWriterTask(TaskHandle_t task) { writerTask = task; }
+
+    // Each returns 0 or a negative response code. maxBlock: longest TransferData request accepted
+    uint8_t requestDownload(uint32_t address, uint32_t size, uint16_t &maxBlock);
+    uint8_t transferData(uint8_t blockCounter, const uint8_t *data, uint16_t len);
+    uint8_t requestExit(const uint8_t *param, uint16_t len);
+    uint8_t exitResult() const;
+
+    // Writes a full buffer or finishes the image. true if it did something
+    bool service();
+
+    // A download is in progress (between RequestDownload and the end of the image check)
+    bool isBusy() const { return (state == OTA_RECEIVING) || (state == OTA_FINISHING); }
+    // The writer task is checking the image and selecting the boot partition
+    bool isFinishing() const { return state == OTA_FINISHING; }
+
+    void printStatus();
+
+    //** OTA DATA **//
+    uint32_t imageSize = 0, received = 0;
+    std::atomic<uint32_t> written{0};
+    unsigned long numBlocks = 0, numRepeated = 0;
+    unsigned long tStart = 0, tEnd = 0; // millis() of RequestDownload and of the end of the image
+
+private:
+    enum State : uint8_t
+    {
+        OTA_IDLE,
+        OTA_RECEIVING,
+        OTA_FINISHING, // Exit received, the writer drains the buffers and checks the image
+        OTA_DONE,
+        OTA_FAILED
+    };
+
+    FirmwareSink &sink;
+    TaskHandle_t writerTask = nullptr;
+    std::atomic<uint8_t> state{OTA_IDLE};
+    uint8_t failNrc = 0;
+
+    uint8_t buffers[2][OTA_BLOCK_SIZE];
+    uint16_t bufferLen[2];
+    std::atomic<bool> full[2] = {{false}, {false}};
+    unsigned head = 0, tail = 0; // Next buffer to fill (CAN task) and to write (writer task)
+
+    uint8_t counter = 0; // Last block accepted
+    uint32_t crc = 0, expectedCrc = 0;
+    bool checkCrc = false;
+    std::atomic<unsigned long> lastBlock{0};
+
+    void fail(uint8_t nrc);
+    void wakeWriter();
+};
+
+#endif
@@ -0,0 +1,271 @@
+#include "CAN_Sim.h"
+
+int VirtualCanBus::attach(SimBackend &node)
+{
+    if (numNodes >= SIM_MAX_NODES)
+        return -1;
+    nodes[numNodes] = &node;
+    return numNodes++;
+}
+
+void VirtualCanBus::injectErrors(uint32_t ppm, unsigned long match, unsigned long mask)
+{
+    errorRate = ppm;
+    errorMatch = match;
+    errorMask = mask;
+}
+
+// Order of the arbitration field on the wire, the lowest value wins: base ID, RTR/SRR, IDE, ID extension, RTR
+static uint64_t arbitrationKey(unsigned long id, bool extended, bool rtr)
+{
+    if (extended)
+        return ((uint64_t)((id >> 18) & 0x7FF) << 21) | (1ULL << 20) | (1ULL << 19) | ((uint64_t)(id & 0x3FFFF) << 1) | rtr;
+    return ((uint64_t)(id & 0x7FF) << 21) | ((uint64_t)rtr << 20);
+}
+
+/**
+ * The frames waiting when the bus becomes free (or the first one to be
+ * queued after an idle period) take part in the arbitration. A frame that
+ * has not finished by micros() is left for the next call, so the result
+ * does not depend on how often update() is called.
+ */
+void VirtualCanBus::update()
+{
+    uint32_t now = micros();
+    for (;;)
+    {
+        // The head of every TX queue competes, the start is when the bus is free and someone is waiting
+        bool waiting = false;
+        uint32_t firstQueued = 0;
+        for (unsigned i = 0; i < numNodes; i++)
+        {
+            SimBackend *n = nodes[i];
+            if (!n->online() || n->txFrames.empty())
+                continue;
+            if (!waiting || ((int32_t)(n->txFrames.front().queuedAt - firstQueued) < 0))
+                firstQueued = n->txFrames.front().queuedAt;
+            waiting = true;
+        }
+        if (!waiting)
+            return;
+
+        uint32_t start = ((int32_t)(firstQueued - busFreeAt) > 0) ? firstQueued : busFreeAt;
+        if ((int32_t)(start - now) > 0)
+            return;
+
+        SimBackend *sender = nullptr;
+        uint64_t bestKey = 0;
+        for (unsigned i = 0; i < numNodes; i++)
+        {
+            SimBackend *n = nodes[i];
+            if (!n->online() || n->txFrames.empty() || ((int32_t)(n->txFrames.front().queuedAt - start) > 0))
+                continue;
+            const SimBackend::Frame &f = n->txFrames.front();
+            uint64_t key = arbitrationKey(f.id, f.extended, f.rtr);
+            if ((sender == nullptr) || (key < bestKey))
+            {
+                sender = n;
+                bestKey = key;
+            }
+        }
+
+        const SimBackend::Frame &frame = sender->txFrames.front();
+        uint32_t bits = CanMetrics::frameBits(frame.id, frame.extended, frame.rtr, frame.len, frame.data);
+        uint32_t end = start + (uint32_t)(((uint64_t)bits * 1000000) / bitrate);
+        if ((int32_t)(end - now) > 0)
+            return; // Still on the wire
+
+        bool ack = false;
+        for (unsigned i = 0; i < numNodes; i++)
+            ack |= (nodes[i] != sender) && nodes[i]->online();
+
+        bool error = errorRate && ((frame.id & errorMask) == errorMatch) && ((random() % 1000000) < errorRate);
+        if (error)
+        {
+            numErrorFrames++;
+            for (unsigned i = 0; i < numNodes; i++)
+            {
+                if ((nodes[i] != sender) && nodes[i]->online())
+                    nodes[i]->onRxError();
+            }
+            sender->onTxDone(true, false);
+            end += (uint32_t)(((uint64_t)SIM_ERROR_BITS * 1000000) / bitrate);
+            numBits += bits + SIM_ERROR_BITS;
+        }
+        else if (!ack)
+        {
+            // Nobody acknowledges: the sender sees an ACK error and retries
+            sender->onTxDone(true, true);
+            numBits += bits;
+        }
+        else
+        {
+            if (trace)
+                trace->record(end, frame.id, frame.extended, frame.rtr, false, frame.len, frame.data, sender->index);
+            numFrames++;
+            for (unsigned i = 0; i < numNodes; i++)
+            {
+                if ((nodes[i] != sender) && nodes[i]->online())
+                    nodes[i]->deliver(frame);
+            }
+            sender->onTxDone(false, false);
+            numBits += bits;
+        }
+        busFreeAt = end;
+    }
+}
+
+void VirtualCanBus::printStatus()
+{
+    Serial.println((String) "Virtual bus: " + numNodes + " nodes at " + (bitrate / 1000) + " kbps, frames: " + numFrames +
+                   " error frames: " + numErrorFrames + " bits: " + (unsigned long)numBits);
+    for (unsigned i = 0; i < numNodes; i++)
+    {
+        SimBackend *n = nodes[i];
+        Serial.println((String) "Node " + i + " tx: " + n->numTx + " rx: " + n->numRx + " TEC: " + n->tec +
+                       " REC: " + n->rec + (n->busOff ? " bus-off" : ""));
+    }
+}
+
+// xorshift32, repeatable from the seed
+uint32_t VirtualCanBus::random()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+bool SimBackend::begin(int kbps)
+{
+    if (index < 0)
+        return false;
+    bus.setBitrate(((kbps == 125) || (kbps == 250) || (kbps == 500)) ? kbps * 1000UL : 1000000UL);
+    running = true;
+    return true;
+}
+
+uint8_t SimBackend::poll()
+{
+    bus.update();
+    uint8_t e = events;
+    events = 0;
+    if (!rxFrames.empty())
+        e |= CAN_EVENT_RX;
+    return e;
+}
+
+bool SimBackend::read(CanPacketRawData &frame)
+{
+    if (rxFrames.empty())
+        return false;
+
+    const Frame &f = rxFrames.front();
+    frame.id = f.extended ? (f.id | 0x80000000) : f.id; // MCP_CAN convention, see CanBackend
+    frame.typeExtendedId = f.extended;
+    frame.rrf = f.rtr;
+    frame.size = f.len;
+    memcpy(frame.bytes, f.data, f.len);
+    rxFrames.erase(rxFrames.begin());
+    return true;
+}
+
+/**
+ * Waits up to SIM_TX_TIMEOUT for a free TX buffer running the bus and the
+ * wait hook meanwhile; on the native build delayMicroseconds() moves the clock.
+ */
+bool SimBackend::write(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data)
+{
+    if (!online())
+        return false;
+
+    uint32_t t0 = micros();
+    while (txFrames.size() >= SIM_TX_BUFFERS)
+    {
+        if ((micros() - t0) >= SIM_TX_TIMEOUT)
+            return false;
+        delayMicroseconds(10);
+        bus.update();
+        if (bus.waitHook)
+            bus.waitHook(index);
+        if (!online())
+            return false;
+    }
+
+    Frame f = {id & (extended ? 0x1FFFFFFF : 0x7FF), extended, rtr, min(len, (uint8_t)8), {0}, (uint32_t)micros()};
+    if (!rtr)
+        memcpy(f.data, data, f.len);
+    txFrames.push_back(f);
+    bus.update();
+    return true;
+}
+
+uint8_t SimBackend::getErrorFlags()
+{
+    uint8_t flags = 0;
+    if (busOff)
+        flags |= CAN_EFLG_TXBO;
+    if (rec >= 96)
+        flags |= CAN_EFLG_RXWAR | CAN_EFLG_EWARN;
+    if (tec >= 96)
+        flags |= CAN_EFLG_TXWAR | CAN_EFLG_EWARN;
+    if (rec >= 128)
+        flags |= CAN_EFLG_RXEP;
+    if (tec >= 128)
+        flags |= CAN_EFLG_TXEP;
+    return flags;
+}
+
+void SimBackend::restart()
+{
+    txFrames.clear();
+    tec = rec = 0;
+    busOff = false;
+}
+
+void SimBackend::deliver(const Frame &frame)
+{
+    if (rec > 0)
+        rec--;
+    if (!hwAccepts(frame.id, frame.extended))
+        return;
+    if (rxFrames.size() >= SIM_RX_BUFFERS)
+    {
+        events |= CAN_EVENT_RX_OVERFLOW;
+        return;
+    }
+    rxFrames.push_back(frame);
+    numRx++;
+}
+
+// TEC +8 on an error, -1 on success. An error passive sender does not count ACK errors (ISO 11898-1),
+// so a node alone on the bus stays error passive instead of going bus-off
+void SimBackend::onTxDone(bool error, bool ackError)
+{
+    uint8_t before = getErrorFlags();
+    if (!error)
+    {
+        if (tec > 0)
+            tec--;
+        txFrames.erase(txFrames.begin());
+        numTx++;
+    }
+    else if (!(ackError && (tec >= 128)))
+    {
+        tec += 8;
+        if (tec > 255)
+            busOff = true;
+    }
+    if (getErrorFlags() != before)
+        events |= CAN_EVENT_ERROR;
+}
+
+void SimBackend::onRxError()
+{
+    uint8_t before = getErrorFlags();
+    if (rec < 255)
+        rec++;
+    events |= CAN_EVENT_MESSAGE_ERROR;
+    if (getErrorFlags() != before)
+        events |= CAN_EVENT_ERROR;
+}
@@ -0,0 +1,155 @@
+//********MART CAN SIMULATION LIBRARY
+#ifndef CANSIM_H
+#define CANSIM_H
+
+#include <Arduino.h>
+#include <vector>
+#include "CAN_Backend.h"
+#include "CAN_Trace.h"
+#include "CAN_Metrics.h"
+
+#define SIM_MAX_NODES   8
+#define SIM_TX_BUFFERS  3    // Frames a node can have waiting for the bus (MCP2515: 3 TX buffers)
+#define SIM_RX_BUFFERS  2    // Received frames a node holds before overflowing (MCP2515: RXB0 + RXB1)
+#define SIM_TX_TIMEOUT  2000 // us write() waits for a free TX buffer, as sendMsgBuf() waits for TXREQ
+#define SIM_ERROR_BITS  20   // Error flag + delimiter + intermission after a destroyed frame
+
+class SimBackend;
+
+/**
+ * In-memory CAN bus. The nodes are SimBackends; a frame takes the bus for
+ * its real length (bit stuffing included) at the configured bit rate and
+ * the bus time follows micros(), so on the native build the caller moves
+ * the clock forward and calls update(). When several nodes are waiting
+ * the lowest arbitration field wins, as on a real bus. Errors can be
+ * injected on chosen IDs: the frame is destroyed by an error frame, the
+ * error counters move as ISO 11898 says and the sender retries. Every
+ * frame on the wire can be recorded in a CanTrace, the channel being the
+ * index of the transmitting node.
+ */
+class VirtualCanBus
+{
+public:
+    VirtualCanBus(uint32_t _bitrate = 1000000) : bitrate(_bitrate)
+    {
+        numNodes = 0;
+        busFreeAt = 0;
+        errorRate = 0;
+        errorMatch = errorMask = 0;
+        rng = 1;
+        trace = nullptr;
+        numFrames = numErrorFrames = numBits = 0;
+    }
+
+    void setBitrate(uint32_t bps) { bitrate = bps; }
+    uint32_t getBitrate() const { return bitrate; }
+
+    // Called by SimBackend, return the node index or -1 if the bus is full
+    int attach(SimBackend &node);
+
+    // Destroys a frame whose (id & mask) == match with probability ppm / 1000000
+    void injectErrors(uint32_t ppm, unsigned long match = 0, unsigned long mask = 0);
+    void setSeed(uint32_t seed) { rng = seed ? seed : 1; }
+
+    // Runs the bus up to micros(): arbitration, transmission, delivery
+    void update();
+
+    // Frames transmitted successfully are recorded at the time they end (nullptr stops recording)
+    void setTrace(CanTrace *_trace) { trace = _trace; }
+
+    // Called while a node waits for a free TX buffer, with the index of that node: on a single thread
+    // the harness services the other nodes here, as their own tasks would on real hardware
+    void setWaitHook(void (*hook)(int node)) { waitHook = hook; }
+
+    void printStatus();
+
+    //** BUS DATA **//
+    unsigned long numFrames;      // Frames transmitted successfully
+    unsigned long numErrorFrames; // Frames destroyed by an injected error
+    uint64_t numBits;             // Bus time used, in bits
+
+private:
+    SimBackend *nodes[SIM_MAX_NODES];
+    unsigned numNodes;
+    uint32_t bitrate;
+    uint32_t busFreeAt; // micros() when the current frame ends
+
+    uint32_t errorRate; // ppm
+    unsigned long errorMatch, errorMask;
+    uint32_t rng;
+
+    CanTrace *trace;
+    void (*waitHook)(int node) = nullptr;
+
+    friend class SimBackend;
+    uint32_t random();
+};
+
+/**
+ * One node of a VirtualCanBus, used by CAN_BUS like any other controller.
+ * TX and RX buffers and the error counters follow the MCP2515.
+ */
+class SimBackend : public CanBackend
+{
+public:
+    SimBackend(VirtualCanBus &_bus) : bus(_bus)
+    {
+        index = bus.attach(*this);
+        running = false;
+        tec = rec = 0;
+        busOff = false;
+        events = 0;
+        numTx = numRx = 0;
+    }
+
+    bool begin(int kbps) override;
+    uint8_t poll() override;
+    bool read(CanPacketRawData &frame) override;
+    bool write(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data) override;
+
+    uint8_t getErrorFlags() override;
+    uint8_t errorCountRX() override { return min(rec, (uint16_t)255); }
+    uint8_t errorCountTX() override { return min(tec, (uint16_t)255); }
+
+    void abortTx() override { txFrames.clear(); }
+    void restart() override;
+
+    // Exact acceptance filter, as a controller with filters to spare: the RX buffers only get what the node wants
+    bool applyFilter(const CanIdFilter &_filter) override
+    {
+        filter = _filter;
+        return !filter.empty();
+    }
+    bool hwAccepts(unsigned long id, bool extended) const override { return filter.empty() || filter.accepts(id, extended); }
+
+    int getIndex() const { return index; }
+    unsigned long numTx, numRx;
+
+private:
+    friend class VirtualCanBus;
+
+    struct Frame
+    {
+        unsigned long id;
+        bool extended, rtr;
+        uint8_t len;
+        uint8_t data[8];
+        uint32_t queuedAt;
+    };
+
+    VirtualCanBus &bus;
+    int index;
+    bool running, busOff;
+    uint16_t tec, rec;
+    uint8_t events;
+    std::vector<Frame> txFrames; // Waiting for the bus, at most SIM_TX_BUFFERS
+    std::vector<Frame> rxFrames; // Waiting to be read, at most SIM_RX_BUFFERS
+    CanIdFilter filter;          // Empty: every frame
+
+    bool online() const { return running && !busOff; }
+    void deliver(const Frame &frame);
+    void onTxDone(bool error, bool ackError);
+    void onRxError();
+};
+
+#endif
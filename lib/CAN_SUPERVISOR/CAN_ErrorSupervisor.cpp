@@ -0,0 +1,97 @@
+#include "CAN_ErrorSupervisor.h"
+
+/**
+ * The backend has already cleared the flags in the controller; a change in
+ * the error flags is read again to follow the state, frames with errors
+ * are only counted.
+ */
+void CanErrorSupervisor::onEvents(uint8_t events)
+{
+    if (events & CAN_EVENT_RX_OVERFLOW)
+        numRxOverflows++;
+    if (events & CAN_EVENT_ERROR)
+        updateState(can.getErrorFlags());
+    if (events & CAN_EVENT_MESSAGE_ERROR)
+        numMessageErrors++;
+}
+
+void CanErrorSupervisor::onTxFailure()
+{
+    // A frame that could not be sent keeps its TX buffer busy; abort so the next attempt
+    // does not wait for a free buffer first
+    can.abortTx();
+    updateState(can.getErrorFlags());
+
+    backoff = backoff ? min(backoff * 2, (unsigned long)CAN_BACKOFF_MAX) : CAN_BACKOFF_MIN;
+    tBackoff = millis();
+}
+
+bool CanErrorSupervisor::canTransmit()
+{
+    if ((state == CAN_BUS_OFF) || (backoff && ((millis() - tBackoff) < backoff)))
+    {
+        numTxBlocked++;
+        return false;
+    }
+    return true;
+}
+
+void CanErrorSupervisor::update(uint8_t _eflg)
+{
+    updateState(_eflg);
+
+    if ((state == CAN_BUS_OFF) && ((millis() - tBusOff) >= CAN_BUSOFF_RECOVERY) &&
+        ((millis() - tLastRecovery) >= CAN_RECOVERY_RETRY))
+    {
+        restart();
+    }
+}
+
+void CanErrorSupervisor::printStatus()
+{
+    Serial.println((String) "CAN state: " + state + " EFLG: " + eflg + " backoff: " + backoff + " ms");
+    Serial.println((String) "RX overflows: " + numRxOverflows + " message errors: " + numMessageErrors +
+                   " error passive: " + numErrorPassive + " bus-off: " + numBusOff + " restarts: " + numRestarts +
+                   " TX blocked: " + numTxBlocked);
+}
+
+void CanErrorSupervisor::updateState(uint8_t _eflg)
+{
+    eflg = _eflg;
+    State newState;
+    if (eflg & CAN_EFLG_TXBO)
+        newState = CAN_BUS_OFF;
+    else if (eflg & (CAN_EFLG_TXEP | CAN_EFLG_RXEP))
+        newState = CAN_ERROR_PASSIVE;
+    else if (eflg & CAN_EFLG_EWARN)
+        newState = CAN_ERROR_WARNING;
+    else
+        newState = CAN_ERROR_ACTIVE;
+
+    if (newState == state)
+        return;
+
+    if (newState == CAN_BUS_OFF)
+    {
+        numBusOff++;
+        tBusOff = millis();
+        can.abortTx();
+    }
+    else if (newState == CAN_ERROR_PASSIVE)
+    {
+        numErrorPassive++;
+    }
+    else if (newState == CAN_ERROR_ACTIVE)
+    {
+        backoff = 0; // Bus healthy again
+    }
+    state = newState;
+}
+
+void CanErrorSupervisor::restart()
+{
+    can.restart();
+    numRestarts++;
+    tLastRecovery = millis();
+    updateState(can.getErrorFlags());
+}
@@ -0,0 +1,83 @@
+//********MART CAN ERROR SUPERVISOR LIBRARY
+#ifndef CANERRORSUPERVISOR_H
+#define CANERRORSUPERVISOR_H
+
+#include <Arduino.h>
+#include "CAN_Backend.h"
+
+#define CAN_BACKOFF_MIN       10   // ms without transmitting after the first failed frame
+#define CAN_BACKOFF_MAX       1000 // Maximum backoff, doubled on every consecutive failure
+#define CAN_BUSOFF_RECOVERY   200  // ms in bus-off before restarting the controller (the MCP2515 normally
+                                   // recovers by itself after 128 x 11 recessive bits, TWAI does not)
+#define CAN_RECOVERY_RETRY    1000 // ms between controller restarts while the bus stays off
+
+/**
+ * Follows the controller error state from the events of CanBackend::poll()
+ * and the EFLG style error flags. Error passive is only followed and counted:
+ * the node can still transmit, and only frames that fail to go out hold the
+ * next ones back with an exponential backoff instead of waiting for every
+ * sendMsgBuf() timeout. In bus-off nothing is sent and the controller is
+ * restarted if it does not recover by itself.
+ */
+class CanErrorSupervisor
+{
+public:
+    enum State
+    {
+        CAN_ERROR_ACTIVE,
+        CAN_ERROR_WARNING, // TEC or REC >= 96
+        CAN_ERROR_PASSIVE, // TEC or REC >= 128
+        CAN_BUS_OFF        // TEC > 255
+    };
+
+    CanErrorSupervisor(CanBackend &_can) : can(_can)
+    {
+        state = CAN_ERROR_ACTIVE;
+        eflg = 0;
+        backoff = 0;
+        tBackoff = 0;
+        tBusOff = 0;
+        tLastRecovery = 0;
+        numRxOverflows = 0;
+        numMessageErrors = 0;
+        numBusOff = 0;
+        numRestarts = 0;
+        numTxBlocked = 0;
+        numErrorPassive = 0;
+    }
+
+    // Handles the error events of CanBackend::poll() (CAN_EVENT_RX is left for the caller)
+    void onEvents(uint8_t events);
+
+    void onTxSuccess() { backoff = 0; }
+    // Frees the TX buffers and starts or extends the backoff
+    void onTxFailure();
+
+    // false while backing off or in bus-off, the caller keeps its frames for later
+    bool canTransmit();
+
+    // Periodic check with a fresh EFLG value, restarts the controller if it stays in bus-off
+    void update(uint8_t _eflg);
+
+    State getState() const { return state; }
+    void printStatus();
+
+    //** ERROR SUPERVISOR DATA **//
+    unsigned long numRxOverflows;   // RX0OVR/RX1OVR seen (frames lost)
+    unsigned long numMessageErrors; // Frames with errors (MERRF, TWAI bus errors)
+    unsigned long numBusOff;        // Times the controller went bus-off
+    unsigned long numRestarts;      // Controller restarts forced by the supervisor
+    unsigned long numTxBlocked;     // Transmissions held back
+    unsigned long numErrorPassive;  // Times the controller became error passive
+
+private:
+    CanBackend &can;
+    State state;
+    uint8_t eflg;
+    unsigned long backoff, tBackoff, tBusOff, tLastRecovery;
+
+    void updateState(uint8_t _eflg);
+    void restart();
+};
+
+#endif
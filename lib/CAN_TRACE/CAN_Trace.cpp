@@ -0,0 +1,176 @@
+#include "CAN_Trace.h"
+
+void CanTrace::record(uint32_t time, unsigned long id, bool extended, bool rtr, bool tx, uint8_t len,
+                      const uint8_t *data, uint8_t bus)
+{
+    if (!running.load(std::memory_order_acquire) || ring.empty())
+        return;
+
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= ring.size())
+    {
+        numDropped++;
+        if (!overwrite)
+            return;
+        // Oldest record lost, pop() skips it
+    }
+
+    if (overwrite)
+        xSemaphoreTake(lock, portMAX_DELAY);
+
+    TraceRecord &rec = ring[h % ring.size()];
+    rec.time = time;
+    rec.id = (id & CAN_TRACE_ID) | (extended ? CAN_TRACE_EXT : 0) | (rtr ? CAN_TRACE_RTR : 0) | (tx ? CAN_TRACE_TX : 0);
+    rec.len = min(len, (uint8_t)8);
+    rec.bus = bus;
+    memset(rec.data, 0, sizeof(rec.data));
+    if (!rtr)
+        memcpy(rec.data, data, rec.len);
+
+    head.store(h + 1, std::memory_order_release);
+    if (overwrite)
+        xSemaphoreGive(lock);
+    numRecorded++;
+}
+
+bool CanTrace::pop(TraceRecord &rec)
+{
+    if (overwrite)
+        xSemaphoreTake(lock, portMAX_DELAY);
+
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    if (h - t > ring.size())
+        t = h - ring.size(); // Overwritten by record(), the oldest record left is the one after head
+
+    bool found = (t != h);
+    if (found)
+    {
+        rec = ring[t % ring.size()];
+        tail.store(t + 1, std::memory_order_release);
+    }
+
+    if (overwrite)
+        xSemaphoreGive(lock);
+    return found;
+}
+
+size_t CanTrace::formatCandump(char *line, size_t size, uint64_t timeUs, const TraceRecord &rec)
+{
+    int pos = snprintf(line, size, "(%lu.%06lu) can%u %0*lX#", (unsigned long)(timeUs / 1000000),
+                       (unsigned long)(timeUs % 1000000), rec.bus, (rec.id & CAN_TRACE_EXT) ? 8 : 3,
+                       (unsigned long)(rec.id & CAN_TRACE_ID));
+    if (rec.id & CAN_TRACE_RTR)
+    {
+        pos += snprintf(line + pos, size - pos, "R");
+    }
+    else
+    {
+        for (unsigned i = 0; i < rec.len; i++)
+            pos += snprintf(line + pos, size - pos, "%02X", rec.data[i]);
+    }
+    pos += snprintf(line + pos, size - pos, "\n");
+    return min((size_t)pos, size - 1);
+}
+
+/**
+ * Accepts what candump -l writes: "(1436509052.249713) can0 123#DEADBEEF",
+ * 8 hex digits for extended IDs and "#R" for remote frames. The interface
+ * number (can0, vcan1, ...) goes to the bus field.
+ */
+bool CanTrace::parseCandump(const char *line, TraceRecord &rec, uint64_t &timeUs)
+{
+    unsigned long seconds, micro;
+    char iface[16], frame[40];
+    if (sscanf(line, " (%lu.%lu) %15s %39s", &seconds, &micro, iface, frame) != 4)
+        return false;
+
+    const char *hash = strchr(frame, '#');
+    if ((hash == nullptr) || (hash == frame))
+        return false;
+
+    size_t idDigits = hash - frame;
+    char *end;
+    unsigned long id = strtoul(frame, &end, 16);
+    if (end != hash)
+        return false;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.id = (id & CAN_TRACE_ID) | ((idDigits > 3) ? CAN_TRACE_EXT : 0);
+
+    const char *p = iface + strlen(iface);
+    while ((p > iface) && isdigit((unsigned char)p[-1]))
+        p--;
+    rec.bus = atoi(p);
+
+    const char *data = hash + 1;
+    if ((*data == 'R') || (*data == 'r'))
+    {
+        rec.id |= CAN_TRACE_RTR;
+    }
+    else
+    {
+        while (isxdigit((unsigned char)data[0]) && isxdigit((unsigned char)data[1]) && (rec.len < 8))
+        {
+            char byteStr[3] = {data[0], data[1], 0};
+            rec.data[rec.len++] = strtoul(byteStr, nullptr, 16);
+            data += 2;
+        }
+    }
+
+    timeUs = (uint64_t)seconds * 1000000 + micro;
+    rec.time = (uint32_t)timeUs;
+    return true;
+}
+
+// 64 bit time from the 32 bit micros() of consecutive records
+uint64_t CanTrace::unwrap(uint32_t time)
+{
+    if (time < unwrapLast)
+        unwrapBase += 1ULL << 32;
+    unwrapLast = time;
+    return unwrapBase + time;
+}
+
+void ReplayBackend::rewind()
+{
+    next = 0;
+    skipTx();
+    startTime = micros();
+    firstTime = (next < records.size()) ? records[next].time : 0;
+}
+
+uint8_t ReplayBackend::poll()
+{
+    if (finished())
+        return 0;
+    if (speed <= 0)
+        return CAN_EVENT_RX;
+
+    // Recorded time since the first frame, scaled, against the time since rewind()
+    uint32_t due = (uint32_t)((records[next].time - firstTime) / speed);
+    return ((micros() - startTime) >= due) ? CAN_EVENT_RX : 0;
+}
+
+bool ReplayBackend::read(CanPacketRawData &frame)
+{
+    if (finished())
+        return false;
+
+    const TraceRecord &rec = records[next++];
+    bool extended = rec.id & CAN_TRACE_EXT;
+    frame.id = (rec.id & CAN_TRACE_ID) | (extended ? 0x80000000 : 0); // MCP_CAN convention, see CanBackend
+    frame.typeExtendedId = extended;
+    frame.rrf = rec.id & CAN_TRACE_RTR;
+    frame.size = rec.len;
+    memcpy(frame.bytes, rec.data, sizeof(frame.bytes));
+    skipTx();
+    return true;
+}
+
+// Our own transmissions are produced again by the CAN_BUS, they are not replayed
+void ReplayBackend::skipTx()
+{
+    while ((next < records.size()) && (records[next].id & CAN_TRACE_TX))
+        next++;
+}
@@ -0,0 +1,165 @@
+//********MART CAN TRACE LIBRARY
+#ifndef CANTRACE_H
+#define CANTRACE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <vector>
+#include "common.h"
+#include "CAN_Backend.h"
+
+#define CAN_TRACE_EXT 0x80000000UL // TraceRecord::id flags, the ID itself is in the low 29 bits
+#define CAN_TRACE_RTR 0x40000000UL
+#define CAN_TRACE_TX  0x20000000UL // Sent by this node (candump has no direction, it is lost on export)
+#define CAN_TRACE_ID  0x1FFFFFFFUL
+
+#define CANDUMP_LINE_SIZE 64 // "(%lu.%06lu) can0 12345678#0011223344556677\n" and some margin
+
+// One frame, 20 bytes in the ring and in the binary files
+struct TraceRecord
+{
+    uint32_t time; // micros()
+    uint32_t id;   // ID | CAN_TRACE_* flags
+    uint8_t len;
+    uint8_t bus;   // Channel, canN on export
+    uint8_t data[8];
+};
+
+/**
+ * Ring of the frames a CAN_BUS receives and sends. record() is called by
+ * the CAN task only; flush() can run on another task (the SPSC indexes
+ * are atomic) to stream the records to a file, in which case the ring
+ * drops new frames when it is full. With overwrite enabled it keeps the
+ * last frames instead, as a flight recorder read after stop(): record()
+ * and pop() then share a mutex and pop() skips the overwritten records,
+ * only record() moves head and only pop() moves tail.
+ */
+class CanTrace
+{
+public:
+    CanTrace(size_t capacity, bool _overwrite = false) : ring(capacity), overwrite(_overwrite), head(0), tail(0)
+    {
+        lock = overwrite ? xSemaphoreCreateMutex() : nullptr;
+        running = true;
+        numRecorded = 0;
+        numDropped = 0;
+    }
+
+    void start() { running = true; }
+    void stop() { running = false; }
+
+    void record(uint32_t time, unsigned long id, bool extended, bool rtr, bool tx, uint8_t len, const uint8_t *data,
+                uint8_t bus);
+    void record(const CanPacketRawData &frame, bool tx, uint8_t bus)
+    {
+        record(micros(), frame.id, frame.typeExtendedId, frame.rrf, tx, frame.size, frame.bytes, bus);
+    }
+
+    size_t size() const
+    {
+        return min(head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire), ring.size());
+    }
+    bool pop(TraceRecord &rec);
+    void clear() { tail.store(head.load(std::memory_order_acquire), std::memory_order_release); }
+
+    // Writes and removes every record in binary, out.write(const uint8_t *, size_t) as fs::File or Print.
+    // return the number of records written
+    template <typename Writer>
+    size_t flush(Writer &out)
+    {
+        size_t n = 0;
+        TraceRecord rec;
+        while (pop(rec))
+        {
+            out.write((const uint8_t *)&rec, sizeof(rec));
+            n++;
+        }
+        return n;
+    }
+
+    // Same in candump -l text, timestamps counted from epochUs (micros() wraps are followed)
+    template <typename Writer>
+    size_t exportCandump(Writer &out, uint64_t epochUs = 0)
+    {
+        size_t n = 0;
+        TraceRecord rec;
+        char line[CANDUMP_LINE_SIZE];
+        while (pop(rec))
+        {
+            size_t len = formatCandump(line, sizeof(line), unwrap(rec.time) + epochUs, rec);
+            out.write((const uint8_t *)line, len);
+            n++;
+        }
+        return n;
+    }
+
+    // "(seconds.micros) canN ID#DATA\n", return the length
+    static size_t formatCandump(char *line, size_t size, uint64_t timeUs, const TraceRecord &rec);
+    // Parses one candump -l line, false if it is not a CAN frame
+    static bool parseCandump(const char *line, TraceRecord &rec, uint64_t &timeUs);
+
+    //** TRACE DATA **//
+    std::atomic<bool> running;
+    unsigned long numRecorded;
+    unsigned long numDropped; // Frames lost because the ring was full (or overwritten)
+
+private:
+    std::vector<TraceRecord> ring;
+    bool overwrite;
+    SemaphoreHandle_t lock; // Overwrite mode only, a record is never copied out while it is being overwritten
+    std::atomic<size_t> head, tail;
+    uint64_t unwrapBase = 0;
+    uint32_t unwrapLast = 0;
+
+    uint64_t unwrap(uint32_t time);
+};
+
+/**
+ * Controller that plays a recorded trace as if it came from the bus, so
+ * CAN_BUS::receive() runs its real path (filters, RRF answers, metrics).
+ * Frames recorded as TX are skipped and frames sent by the CAN_BUS are
+ * only counted. Speed 1 keeps the recorded timing, 10 plays ten times
+ * faster and 0 as fast as receive() is called (throughput benchmark).
+ */
+class ReplayBackend : public CanBackend
+{
+public:
+    ReplayBackend() : numTx(0), speed(1), next(0), startTime(0), firstTime(0) {}
+
+    void load(const std::vector<TraceRecord> &_records) { records = _records; }
+    void setSpeed(float _speed) { speed = _speed; }
+    void rewind();
+    bool finished() const { return next >= records.size(); }
+    size_t position() const { return next; }
+
+    bool begin(int /*kbps*/) override
+    {
+        rewind();
+        return true;
+    }
+    uint8_t poll() override;
+    bool read(CanPacketRawData &frame) override;
+    bool write(unsigned long /*id*/, bool /*extended*/, bool /*rtr*/, uint8_t /*len*/, const uint8_t * /*data*/) override
+    {
+        numTx++;
+        return true;
+    }
+
+    uint8_t getErrorFlags() override { return 0; }
+    uint8_t errorCountRX() override { return 0; }
+    uint8_t errorCountTX() override { return 0; }
+    void abortTx() override {}
+    void restart() override {}
+
+    unsigned long numTx;
+
+private:
+    std::vector<TraceRecord> records;
+    float speed;
+    size_t next;
+    uint32_t startTime, firstTime;
+
+    void skipTx();
+};
+
+#endif
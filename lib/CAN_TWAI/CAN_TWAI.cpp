@@ -0,0 +1,156 @@
+#include "CAN_TWAI.h"
+
+#define TWAI_ALERTS (TWAI_ALERT_RX_QUEUE_FULL | TWAI_ALERT_BUS_ERROR | TWAI_ALERT_ABOVE_ERR_WARN | \
+                     TWAI_ALERT_ERR_PASS | TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_BUS_OFF |            \
+                     TWAI_ALERT_BUS_RECOVERED | TWAI_ALERT_TX_FAILED)
+
+bool TwaiBackend::begin(int kbps)
+{
+    twai_general_config_t general = TWAI_GENERAL_CONFIG_DEFAULT((gpio_num_t)pinTx, (gpio_num_t)pinRx, TWAI_MODE_NORMAL);
+    general.tx_queue_len = TWAI_TX_QUEUE_LEN;
+    general.rx_queue_len = TWAI_RX_QUEUE_LEN;
+    general.alerts_enabled = TWAI_ALERTS;
+
+    twai_timing_config_t timing125 = TWAI_TIMING_CONFIG_125KBITS();
+    twai_timing_config_t timing250 = TWAI_TIMING_CONFIG_250KBITS();
+    twai_timing_config_t timing500 = TWAI_TIMING_CONFIG_500KBITS();
+    twai_timing_config_t timing1000 = TWAI_TIMING_CONFIG_1MBITS();
+    const twai_timing_config_t *timing = &timing1000;
+    if (kbps == 125)
+        timing = &timing125;
+    else if (kbps == 250)
+        timing = &timing250;
+    else if (kbps == 500)
+        timing = &timing500;
+
+    // Filtering is done by CAN_BUS, the driver takes every frame
+    twai_filter_config_t filter = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+    // Started again (new bit rate): the driver only installs once
+    if (installed)
+    {
+        twai_stop();
+        if (twai_driver_uninstall() != ESP_OK)
+            return false;
+        installed = false;
+    }
+
+    if (twai_driver_install(&general, timing, &filter) != ESP_OK)
+        return false;
+    installed = true;
+    return twai_start() == ESP_OK;
+}
+
+uint8_t TwaiBackend::poll()
+{
+    uint8_t events = 0;
+    uint32_t alerts = 0;
+    if (twai_read_alerts(&alerts, 0) == ESP_OK)
+    {
+        if (alerts & TWAI_ALERT_RX_QUEUE_FULL)
+            events |= CAN_EVENT_RX_OVERFLOW;
+        if (alerts & TWAI_ALERT_BUS_ERROR)
+            events |= CAN_EVENT_MESSAGE_ERROR;
+        if (alerts & (TWAI_ALERT_ABOVE_ERR_WARN | TWAI_ALERT_ERR_PASS | TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_BUS_OFF |
+                      TWAI_ALERT_BUS_RECOVERED | TWAI_ALERT_TX_FAILED))
+            events |= CAN_EVENT_ERROR;
+
+        // After the recovery the driver is stopped, it has to be started again to join the bus
+        if (alerts & TWAI_ALERT_BUS_RECOVERED)
+            twai_start();
+    }
+
+    twai_status_info_t status;
+    if ((twai_get_status_info(&status) == ESP_OK) && (status.msgs_to_rx > 0))
+        events |= CAN_EVENT_RX;
+    return events;
+}
+
+bool TwaiBackend::read(CanPacketRawData &frame)
+{
+    twai_message_t msg;
+    if (twai_receive(&msg, 0) != ESP_OK)
+        return false;
+
+    frame.id = msg.identifier;
+    if (msg.extd)
+        frame.id |= 0x80000000; // MCP_CAN convention, see CanBackend
+    frame.typeExtendedId = msg.extd;
+    frame.rrf = msg.rtr;
+    frame.size = min(msg.data_length_code, (uint8_t)8);
+    if (!msg.rtr)
+        memcpy(frame.bytes, msg.data, frame.size);
+    return true;
+}
+
+bool TwaiBackend::write(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data)
+{
+    twai_message_t msg = {};
+    msg.identifier = id & (extended ? 0x1FFFFFFF : 0x7FF);
+    msg.extd = extended;
+    msg.rtr = rtr;
+    msg.data_length_code = min(len, (uint8_t)8);
+    if (!rtr)
+        memcpy(msg.data, data, msg.data_length_code);
+
+    // Queued for the driver, never waits for the bus
+    return twai_transmit(&msg, 0) == ESP_OK;
+}
+
+uint8_t TwaiBackend::getErrorFlags()
+{
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) != ESP_OK)
+        return 0;
+
+    uint8_t flags = 0;
+    // Stopped or recovering also means not on the bus
+    if (status.state != TWAI_STATE_RUNNING)
+        flags |= CAN_EFLG_TXBO;
+    if (status.rx_error_counter >= 96)
+        flags |= CAN_EFLG_RXWAR | CAN_EFLG_EWARN;
+    if (status.tx_error_counter >= 96)
+        flags |= CAN_EFLG_TXWAR | CAN_EFLG_EWARN;
+    if (status.rx_error_counter >= 128)
+        flags |= CAN_EFLG_RXEP;
+    if (status.tx_error_counter >= 128)
+        flags |= CAN_EFLG_TXEP;
+    return flags;
+}
+
+uint8_t TwaiBackend::errorCountRX()
+{
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) != ESP_OK)
+        return 0;
+    return min(status.rx_error_counter, (uint32_t)255);
+}
+
+uint8_t TwaiBackend::errorCountTX()
+{
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) != ESP_OK)
+        return 0;
+    return min(status.tx_error_counter, (uint32_t)255);
+}
+
+bool TwaiBackend::txIdle()
+{
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) != ESP_OK)
+        return true;
+    return status.msgs_to_tx == 0;
+}
+
+// Recovery takes 128 x 11 recessive bits, poll() starts the driver again when it is done
+void TwaiBackend::restart()
+{
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) != ESP_OK)
+        return;
+    abortTx();
+    if (status.state == TWAI_STATE_BUS_OFF)
+        twai_initiate_recovery();
+    else if (status.state == TWAI_STATE_STOPPED)
+        twai_start();
+}
@@ -0,0 +1,41 @@
+//********MART CAN TWAI BACKEND LIBRARY
+#ifndef CANTWAI_H
+#define CANTWAI_H
+
+#include <Arduino.h>
+#include "driver/twai.h"
+#include "CAN_Backend.h"
+
+#define TWAI_TX_QUEUE_LEN 16
+#define TWAI_RX_QUEUE_LEN 32 // Frames buffered by the driver between two CAN task wake ups
+
+/**
+ * On-chip TWAI controller of the ESP32-S3 through the ESP-IDF driver. The
+ * hardware FIFO is emptied into the driver RX queue from its own interrupt,
+ * so reading a frame is a queue copy instead of several SPI transactions.
+ * There is no INT line: poll() reads the driver alerts without blocking.
+ */
+class TwaiBackend : public CanBackend
+{
+public:
+    TwaiBackend(int _pinTx, int _pinRx) : pinTx(_pinTx), pinRx(_pinRx) {}
+
+    bool begin(int kbps) override;
+    uint8_t poll() override;
+    bool read(CanPacketRawData &frame) override;
+    bool write(unsigned long id, bool extended, bool rtr, uint8_t len, const uint8_t *data) override;
+
+    uint8_t getErrorFlags() override;
+    uint8_t errorCountRX() override;
+    uint8_t errorCountTX() override;
+
+    void abortTx() override { twai_clear_transmit_queue(); }
+    bool txIdle() override;
+    void restart() override;
+
+private:
+    int pinTx, pinRx;
+    bool installed = false;
+};
+
+#endif
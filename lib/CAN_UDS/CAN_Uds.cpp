@@ -0,0 +1,413 @@
+#include "CAN_Uds.h"
+#include "CAN_Ota.h"
+
+bool UdsServer::begin(unsigned long txId, unsigned long rxId, bool extended)
+{
+    session = tp.open(txId, rxId, extended, request, sizeof(request));
+    return session >= 0;
+}
+
+bool UdsServer::addDataIdentifier(uint16_t did, DataReader read, DataWriter write)
+{
+    if ((numLocalDids >= UDS_MAX_LOCAL_DIDS) || ((did & 0xE000) == UDS_REG_DID))
+        return false;
+    localDids[numLocalDids++] = {did, read, write};
+    return true;
+}
+
+/**
+ * One request at a time: a new one is only taken when the previous
+ * response has left, until then it waits in the ISO-TP buffer. So does a
+ * TransferData block while both flash buffers are busy, which is what
+ * paces the tester to the speed of the flash.
+ */
+void UdsServer::update()
+{
+    if (session < 0)
+        return;
+
+    if (pendingSid && !responseReady)
+    {
+        if (pendingSid == UDS_REQUEST_TRANSFER_EXIT)
+            checkExit();
+        else
+            collectResults();
+    }
+
+    // The final response waits for the response pending frame to leave
+    if (responseReady && !tp.txBusy(session))
+    {
+        if (pendingNrc)
+            sendNegative(pendingSid, pendingNrc);
+        else if (responseLen)
+            tp.send(session, response, responseLen);
+        responseReady = false;
+        pendingSid = 0;
+    }
+
+    // ECUReset: only after its response is out
+    if (resetPending && !tp.txBusy(session))
+    {
+        resetPending = false;
+        resetHandler();
+    }
+
+    if (!pendingSid && tp.available(session) && !tp.txBusy(session) &&
+        handleRequest(tp.data(session), tp.length(session)))
+    {
+        numRequests++;
+        held = heldPending = false;
+        tp.release(session);
+    }
+}
+
+void UdsServer::printStatus()
+{
+    Serial.println((String) "UDS requests: " + numRequests + " negative: " + numNegative + " BQ reads: " + numBqReads +
+                   (ota ? (String) " blocks held: " + numHeld : (String) ""));
+    bq.printStatus();
+}
+
+// false if the request has to stay in the buffer for now
+bool UdsServer::handleRequest(const uint8_t *req, uint16_t len)
+{
+    pendingSid = req[0];
+    pendingNrc = 0;
+    responseLen = 0;
+    numTxns = numSubmitted = numDone = 0;
+    sequence = (sequence + 1) & 0x0F;
+
+    switch (req[0])
+    {
+    case UDS_READ_DATA_BY_ID:
+        pendingNrc = readDataByIdentifier(req, len);
+        break;
+    case UDS_WRITE_DATA_BY_ID:
+        pendingNrc = writeDataByIdentifier(req, len);
+        break;
+    case UDS_READ_MEMORY_BY_ADDRESS:
+        pendingNrc = readMemoryByAddress(req, len);
+        break;
+    case UDS_REQUEST_DOWNLOAD:
+        pendingNrc = requestDownload(req, len);
+        break;
+    case UDS_TRANSFER_DATA:
+        pendingNrc = transferData(req, len);
+        if (pendingNrc == CanOta::OTA_BUSY)
+            return holdRequest(req[0]);
+        break;
+    case UDS_REQUEST_TRANSFER_EXIT:
+        pendingNrc = requestTransferExit(req, len);
+        break;
+    case UDS_ECU_RESET:
+        pendingNrc = ecuReset(req, len);
+        break;
+    case UDS_TESTER_PRESENT:
+        if (len != 2)
+            pendingNrc = UDS_NRC_INCORRECT_LENGTH;
+        else if (req[1] & 0x7F)
+            pendingNrc = UDS_NRC_SUBFUNCTION_NOT_SUPPORTED;
+        else if (!(req[1] & 0x80)) // suppressPosRspMsgIndicationBit
+        {
+            response[0] = UDS_TESTER_PRESENT + 0x40;
+            response[1] = 0;
+            responseLen = 2;
+        }
+        break;
+    default:
+        pendingNrc = UDS_NRC_SERVICE_NOT_SUPPORTED;
+        break;
+    }
+
+    bool exitPending = (pendingSid == UDS_REQUEST_TRANSFER_EXIT) && !pendingNrc;
+    if (pendingNrc || ((numTxns == 0) && !exitPending))
+    {
+        responseReady = true;
+        return true;
+    }
+
+    // The registers are read after the next scan, the image is checked by the writer task: well beyond P2
+    tPending = millis();
+    sendNegative(pendingSid, UDS_NRC_RESPONSE_PENDING);
+    if (exitPending)
+        checkExit();
+    else
+        collectResults();
+    return true;
+}
+
+uint8_t UdsServer::readDataByIdentifier(const uint8_t *req, uint16_t len)
+{
+    if ((len < 3) || !(len & 1) || ((len - 1) / 2 > UDS_MAX_DIDS))
+        return UDS_NRC_INCORRECT_LENGTH;
+
+    uint16_t pos = 0;
+    response[pos++] = UDS_READ_DATA_BY_ID + 0x40;
+    for (uint16_t i = 1; i < len; i += 2)
+    {
+        uint16_t did = (req[i] << 8) | req[i + 1];
+        if (pos + 3 > UDS_MAX_RESPONSE)
+            return UDS_NRC_RESPONSE_TOO_LONG;
+        response[pos++] = req[i];
+        response[pos++] = req[i + 1];
+
+        if ((did & 0xE000) == UDS_REG_DID)
+        {
+            uint8_t board = (did >> 10) & 0x07; // boards 0..7, see UDS_REG_DID
+            uint16_t reg = did & 0x03FF;
+            if ((board >= TOTALBOARDS) || (reg > UDS_REG_LAST))
+                return UDS_NRC_REQUEST_OUT_OF_RANGE;
+            addTransaction(board, reg, 1, pos, 3); // DID + value per register
+            pos++;
+            continue;
+        }
+
+        unsigned d = 0;
+        while ((d < numLocalDids) && (localDids[d].did != did))
+            d++;
+        if (d == numLocalDids)
+            return UDS_NRC_REQUEST_OUT_OF_RANGE;
+        uint16_t n = localDids[d].read(response + pos, UDS_MAX_RESPONSE - pos);
+        if (n == 0)
+            return UDS_NRC_RESPONSE_TOO_LONG;
+        pos += n;
+    }
+    responseLen = pos;
+    return 0;
+}
+
+// The BQ79606 registers are read only from here
+uint8_t UdsServer::writeDataByIdentifier(const uint8_t *req, uint16_t len)
+{
+    if (len < 4)
+        return UDS_NRC_INCORRECT_LENGTH;
+
+    uint16_t did = (req[1] << 8) | req[2];
+    unsigned d = 0;
+    while ((d < numLocalDids) && (localDids[d].did != did))
+        d++;
+    if ((d == numLocalDids) || !localDids[d].write)
+        return UDS_NRC_REQUEST_OUT_OF_RANGE;
+
+    uint8_t nrc = localDids[d].write(req + 3, len - 3);
+    if (nrc)
+        return nrc;
+    response[0] = UDS_WRITE_DATA_BY_ID + 0x40;
+    response[1] = req[1];
+    response[2] = req[2];
+    responseLen = 3;
+    return 0;
+}
+
+uint8_t UdsServer::readMemoryByAddress(const uint8_t *req, uint16_t len)
+{
+    if (len < 2)
+        return UDS_NRC_INCORRECT_LENGTH;
+
+    // addressAndLengthFormatIdentifier: bytes of the size in the high nibble, of the address in the low one
+    uint8_t sizeBytes = req[1] >> 4, addrBytes = req[1] & 0x0F;
+    if ((addrBytes < 1) || (addrBytes > 4) || (sizeBytes < 1) || (sizeBytes > 2))
+        return UDS_NRC_REQUEST_OUT_OF_RANGE;
+    if (len != 2 + addrBytes + sizeBytes)
+        return UDS_NRC_INCORRECT_LENGTH;
+
+    uint32_t address = 0;
+    uint16_t size = 0;
+    for (uint8_t i = 0; i < addrBytes; i++)
+        address = (address << 8) | req[2 + i];
+    for (uint8_t i = 0; i < sizeBytes; i++)
+        size = (size << 8) | req[2 + addrBytes + i];
+
+    uint32_t board = address >> 16;
+    uint16_t reg = address & 0xFFFF;
+    if ((board >= TOTALBOARDS) || (size == 0) || (size > BQ_TXN_MAX_BYTES) || (reg + size - 1 > UDS_REG_LAST))
+        return UDS_NRC_REQUEST_OUT_OF_RANGE;
+
+    response[0] = UDS_READ_MEMORY_BY_ADDRESS + 0x40;
+    addTransaction(board, reg, size, 1, 1);
+    responseLen = 1 + size;
+    return 0;
+}
+
+uint8_t UdsServer::requestDownload(const uint8_t *req, uint16_t len)
+{
+    if (!ota)
+        return UDS_NRC_SERVICE_NOT_SUPPORTED;
+    if (len < 3)
+        return UDS_NRC_INCORRECT_LENGTH;
+
+    // dataFormatIdentifier 0: neither compressed nor encrypted
+    uint8_t sizeBytes = req[2] >> 4, addrBytes = req[2] & 0x0F;
+    if ((req[1] != 0) || (addrBytes < 1) || (addrBytes > 4) || (sizeBytes < 1) || (sizeBytes > 4))
+        return UDS_NRC_REQUEST_OUT_OF_RANGE;
+    if (len != 3 + addrBytes + sizeBytes)
+        return UDS_NRC_INCORRECT_LENGTH;
+
+    uint32_t address = 0, size = 0;
+    for (uint8_t i = 0; i < addrBytes; i++)
+        address = (address << 8) | req[3 + i];
+    for (uint8_t i = 0; i < sizeBytes; i++)
+        size = (size << 8) | req[3 + addrBytes + i];
+
+    uint16_t maxBlock;
+    uint8_t nrc = ota->requestDownload(address, size, maxBlock);
+    if (nrc)
+        return nrc;
+
+    // lengthFormatIdentifier: maxNumberOfBlockLength in 2 bytes
+    response[0] = UDS_REQUEST_DOWNLOAD + 0x40;
+    response[1] = 0x20;
+    response[2] = maxBlock >> 8;
+    response[3] = maxBlock & 0xFF;
+    responseLen = 4;
+    return 0;
+}
+
+uint8_t UdsServer::transferData(const uint8_t *req, uint16_t len)
+{
+    if (!ota)
+        return UDS_NRC_SERVICE_NOT_SUPPORTED;
+    if (len < 3)
+        return UDS_NRC_INCORRECT_LENGTH;
+
+    uint8_t nrc = ota->transferData(req[1], req + 2, len - 2);
+    if (nrc)
+        return nrc;
+    response[0] = UDS_TRANSFER_DATA + 0x40;
+    response[1] = req[1];
+    responseLen = 2;
+    return 0;
+}
+
+uint8_t UdsServer::requestTransferExit(const uint8_t *req, uint16_t len)
+{
+    if (!ota)
+        return UDS_NRC_SERVICE_NOT_SUPPORTED;
+
+    uint8_t nrc = ota->requestExit(req + 1, len - 1);
+    if (nrc)
+        return nrc;
+    response[0] = UDS_REQUEST_TRANSFER_EXIT + 0x40;
+    responseLen = 1;
+    return 0;
+}
+
+// Only hardReset (0x01), never while the downloaded image is being checked
+uint8_t UdsServer::ecuReset(const uint8_t *req, uint16_t len)
+{
+    if (len != 2)
+        return UDS_NRC_INCORRECT_LENGTH;
+    if ((req[1] & 0x7F) != 0x01)
+        return UDS_NRC_SUBFUNCTION_NOT_SUPPORTED;
+    if (!resetHandler || (ota && ota->isFinishing()))
+        return UDS_NRC_CONDITIONS_NOT_CORRECT;
+
+    resetPending = true;
+    if (!(req[1] & 0x80))
+    {
+        response[0] = UDS_ECU_RESET + 0x40;
+        response[1] = req[1] & 0x7F;
+        responseLen = 2;
+    }
+    return 0;
+}
+
+// The tester is told to wait if the block is held for longer than P2
+bool UdsServer::holdRequest(uint8_t sid)
+{
+    pendingSid = 0;
+    if (!held)
+    {
+        numHeld++;
+        held = true;
+        tHeld = millis();
+    }
+    else if (!heldPending && ((millis() - tHeld) > UDS_P2_SERVER))
+    {
+        heldPending = true;
+        sendNegative(sid, UDS_NRC_RESPONSE_PENDING);
+    }
+    return false;
+}
+
+// Final response of RequestTransferExit once the writer task has checked the image
+void UdsServer::checkExit()
+{
+    uint8_t nrc = ota->exitResult();
+    if (nrc == CanOta::OTA_BUSY)
+        return;
+    pendingNrc = nrc;
+    responseReady = true;
+}
+
+// Extends the last transaction when the registers follow it on the same board and in the response
+bool UdsServer::addTransaction(uint8_t board, uint16_t addr, uint8_t len, uint16_t pos, uint8_t stride)
+{
+    if (numTxns > 0)
+    {
+        Transaction &last = txns[numTxns - 1];
+        if ((last.board == board) && (last.addr + last.len == addr) && (last.stride == stride) &&
+            (last.pos + last.len * stride == pos) && (last.len + len <= BQ_TXN_MAX_BYTES))
+        {
+            last.len += len;
+            return true;
+        }
+    }
+    if (numTxns >= UDS_MAX_DIDS)
+        return false;
+    txns[numTxns++] = {board, addr, len, pos, stride};
+    return true;
+}
+
+/**
+ * Submits what still fits in the queue and places the results in the
+ * response. A failed read turns the whole response negative.
+ */
+void UdsServer::collectResults()
+{
+    while (numSubmitted < numTxns)
+    {
+        const Transaction &t = txns[numSubmitted];
+        if (!bq.submit({t.board, t.addr, t.len, (uint8_t)((sequence << 4) | numSubmitted)}))
+            break;
+        numSubmitted++;
+    }
+
+    BqResult res;
+    while (bq.poll(res))
+    {
+        if ((res.tag >> 4) != sequence)
+            continue; // Left by a request that timed out
+        const Transaction &t = txns[res.tag & 0x0F];
+        numBqReads++;
+        numDone++;
+        if (res.status == BQ_TXN_LINK_DOWN)
+            pendingNrc = UDS_NRC_CONDITIONS_NOT_CORRECT;
+        else if (res.status)
+            pendingNrc = UDS_NRC_GENERAL_REJECT;
+        else
+            for (uint8_t i = 0; i < t.len; i++)
+                response[t.pos + i * t.stride] = res.data[i];
+    }
+
+    if (numDone >= numTxns)
+    {
+        responseReady = true;
+    }
+    else if ((millis() - tPending) > UDS_PENDING_TIMEOUT)
+    {
+        pendingNrc = UDS_NRC_GENERAL_REJECT;
+        responseReady = true;
+        sequence = (sequence + 1) & 0x0F;
+    }
+}
+
+void UdsServer::sendNegative(uint8_t sid, uint8_t nrc)
+{
+    negative[0] = UDS_NEGATIVE_RESPONSE;
+    negative[1] = sid;
+    negative[2] = nrc;
+    if (nrc != UDS_NRC_RESPONSE_PENDING)
+        numNegative++;
+    tp.send(session, negative, sizeof(negative));
+}
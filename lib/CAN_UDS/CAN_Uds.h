@@ -0,0 +1,156 @@
+//********MART UDS DIAGNOSTIC SERVER LIBRARY
+#ifndef CANUDS_H
+#define CANUDS_H
+
+#include <Arduino.h>
+#include "CAN_IsoTp.h"
+#include "BQ_Queue.h"
+
+class CanOta;
+
+#define UDS_MAX_REQUEST     2050 // Longest request (ISO-TP receive buffer), a TransferData block
+#define UDS_MAX_RESPONSE    512  // Longest response
+#define UDS_MAX_DIDS        16   // Identifiers in one ReadDataByIdentifier request
+#define UDS_MAX_LOCAL_DIDS  8    // Identifiers served by the application
+#define UDS_PENDING_TIMEOUT 2000 // ms waiting for the acquisition task before giving up
+#define UDS_P2_SERVER       40   // ms a request can wait for the server before it sends "response pending"
+
+// ReadDataByIdentifier of one BQ79606 register: UDS_REG_DID | board << 10 | register.
+// The board has 3 bits: boards 8 and up of a longer stack are only reachable through ReadMemoryByAddress
+#define UDS_REG_DID         0x8000
+#define UDS_REG_LAST        0x02E2 // Last register of the BQ79606 map
+
+// Service identifiers, the positive response is the SID + 0x40
+#define UDS_ECU_RESET              0x11
+#define UDS_READ_DATA_BY_ID        0x22
+#define UDS_READ_MEMORY_BY_ADDRESS 0x23
+#define UDS_WRITE_DATA_BY_ID       0x2E
+#define UDS_REQUEST_DOWNLOAD       0x34
+#define UDS_TRANSFER_DATA          0x36
+#define UDS_REQUEST_TRANSFER_EXIT  0x37
+#define UDS_TESTER_PRESENT         0x3E
+#define UDS_NEGATIVE_RESPONSE      0x7F
+
+// Negative response codes
+#define UDS_NRC_GENERAL_REJECT          0x10
+#define UDS_NRC_SERVICE_NOT_SUPPORTED   0x11
+#define UDS_NRC_SUBFUNCTION_NOT_SUPPORTED 0x12
+#define UDS_NRC_INCORRECT_LENGTH        0x13
+#define UDS_NRC_RESPONSE_TOO_LONG       0x14
+#define UDS_NRC_CONDITIONS_NOT_CORRECT  0x22
+#define UDS_NRC_SEQUENCE_ERROR          0x24
+#define UDS_NRC_REQUEST_OUT_OF_RANGE    0x31
+#define UDS_NRC_DOWNLOAD_NOT_ACCEPTED   0x70
+#define UDS_NRC_TRANSFER_SUSPENDED      0x71
+#define UDS_NRC_PROGRAMMING_FAILURE     0x72
+#define UDS_NRC_WRONG_BLOCK_COUNTER     0x73
+#define UDS_NRC_RESPONSE_PENDING        0x78
+
+/**
+ * Diagnostic server (ISO 14229 subset) on an ISO-TP session:
+ * ReadDataByIdentifier, WriteDataByIdentifier (application identifiers
+ * only), ReadMemoryByAddress and TesterPresent. The BQ79606
+ * register space is reached through the BqTransactionQueue, never from the
+ * CAN task: the server answers "response pending" and sends the data when
+ * the acquisition task has read it. Registers that follow each other in a
+ * request are read in one transaction.
+ *
+ * ReadMemoryByAddress: the address is board << 16 | register, up to
+ * BQ_TXN_MAX_BYTES bytes of one board.
+ *
+ * With setDownload() it also takes firmware images (RequestDownload,
+ * TransferData, RequestTransferExit, see CanOta) and ECUReset hard reset.
+ */
+class UdsServer
+{
+public:
+    // Fills buf with the data of an application identifier, returns its length (0 if it does not fit)
+    typedef uint16_t (*DataReader)(uint8_t *buf, uint16_t max);
+    // Takes the data of a WriteDataByIdentifier, returns 0 or a negative response code
+    typedef uint8_t (*DataWriter)(const uint8_t *data, uint16_t len);
+
+    UdsServer(IsoTp &_tp, BqTransactionQueue &_bq) : tp(_tp), bq(_bq) {}
+
+    // Opens the ISO-TP session, requests come from rxId and responses go to txId
+    bool begin(unsigned long txId, unsigned long rxId, bool extended = false);
+
+    bool addDataIdentifier(uint16_t did, DataReader read, DataWriter write = nullptr);
+
+    // Enables the download services
+    void setDownload(CanOta *_ota) { ota = _ota; }
+    // Called by ECUReset once its positive response has been sent
+    void setResetHandler(void (*handler)()) { resetHandler = handler; }
+
+    // Serves the requests and collects the register reads, in the task that owns the bus
+    void update();
+
+    // A request is arriving, being served or its response is still leaving. It can be polled from
+    // another task: a stale answer only moves the end of the activity by one poll
+    bool isBusy() const { return (session >= 0) && (pendingSid || responseReady || resetPending || tp.busy(session)); }
+
+    void printStatus();
+
+    //** SERVER DATA **//
+    unsigned long numRequests = 0, numNegative = 0, numBqReads = 0;
+    unsigned long numHeld = 0; // TransferData blocks that had to wait for a flash buffer
+
+private:
+    // Register block read in one transaction, the bytes go to response[pos + i * stride]
+    struct Transaction
+    {
+        uint8_t board;
+        uint16_t addr;
+        uint8_t len;
+        uint16_t pos;
+        uint8_t stride;
+    };
+    struct LocalDid
+    {
+        uint16_t did;
+        DataReader read;
+        DataWriter write;
+    };
+
+    IsoTp &tp;
+    BqTransactionQueue &bq;
+    CanOta *ota = nullptr;
+    void (*resetHandler)() = nullptr;
+    int session = -1;
+    uint8_t request[UDS_MAX_REQUEST];
+
+    LocalDid localDids[UDS_MAX_LOCAL_DIDS];
+    unsigned numLocalDids = 0;
+
+    uint8_t response[UDS_MAX_RESPONSE];
+    uint16_t responseLen = 0;
+    uint8_t negative[3]; // Negative responses go from here, the response may still be in use
+
+    // Request waiting for the acquisition task
+    Transaction txns[UDS_MAX_DIDS];
+    unsigned numTxns = 0, numSubmitted = 0, numDone = 0;
+    uint8_t sequence = 0; // High nibble of the tags, results of an abandoned request are ignored
+    uint8_t pendingSid = 0, pendingNrc = 0;
+    unsigned long tPending = 0;
+    bool responseReady = false;
+    bool resetPending = false;
+
+    // TransferData left in the ISO-TP buffer until the flash writer has a free buffer
+    unsigned long tHeld = 0;
+    bool held = false, heldPending = false;
+
+    bool handleRequest(const uint8_t *req, uint16_t len);
+    uint8_t readDataByIdentifier(const uint8_t *req, uint16_t len);
+    uint8_t writeDataByIdentifier(const uint8_t *req, uint16_t len);
+    uint8_t readMemoryByAddress(const uint8_t *req, uint16_t len);
+    uint8_t requestDownload(const uint8_t *req, uint16_t len);
+    uint8_t transferData(const uint8_t *req, uint16_t len);
+    uint8_t requestTransferExit(const uint8_t *req, uint16_t len);
+    uint8_t ecuReset(const uint8_t *req, uint16_t len);
+    bool holdRequest(uint8_t sid);
+    void checkExit();
+    bool addTransaction(uint8_t board, uint16_t addr, uint8_t len, uint16_t pos, uint8_t stride);
+    void collectResults();
+    void sendNegative(uint8_t sid, uint8_t nrc);
+};
+
+#endif
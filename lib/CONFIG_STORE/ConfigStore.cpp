@@ -0,0 +1,147 @@
+#include "ConfigStore.h"
+
+#define CONFIG_MAX_BYTES 1024 // Longest record read back, newer schemas included
+
+static const char *slotKeys[2] = {"cfg0", "cfg1"};
+
+/**
+ * Both slots are read and the valid one with the highest generation wins.
+ * Only its first sizeof(NodeConfig) bytes are used, so a record written by
+ * a newer firmware still loads after going back to an older one.
+ */
+bool ConfigStore::begin(const NodeConfig &factory)
+{
+    factoryConfig = canonical(factory);
+    config = factoryConfig;
+    newest = -1;
+    generation = 0;
+    loadedSchema = 0;
+
+    if (!prefs.begin(CONFIG_NAMESPACE, false))
+    {
+        Serial.println("Config: NVS no disponible, configuracion de fabrica");
+        return false;
+    }
+
+    NodeConfig cfg;
+    Header header;
+    uint32_t crc;
+    for (uint8_t slot = 0; slot < 2; slot++)
+    {
+        if (!readSlot(slot, header, cfg, crc) || ((newest >= 0) && ((int32_t)(header.generation - generation) <= 0)))
+            continue;
+        newest = slot;
+        generation = header.generation;
+        loadedSchema = header.schema;
+        storedCrc = ((header.schema == CONFIG_SCHEMA) && (header.size == sizeof(NodeConfig))) ? crc : 0;
+        config = cfg;
+    }
+    return newest >= 0;
+}
+
+bool ConfigStore::save(const NodeConfig &newConfig)
+{
+    if (!isValid(newConfig))
+        return false;
+
+    NodeConfig cfg = canonical(newConfig);
+    uint32_t crc = crc32Update(0, (const uint8_t *)&cfg, sizeof(cfg));
+    if ((newest >= 0) && storedCrc && (crc == storedCrc))
+    {
+        numSkipped++;
+        return true;
+    }
+
+    uint8_t record[sizeof(Header) + sizeof(NodeConfig) + 4];
+    Header header = {CONFIG_SCHEMA, sizeof(NodeConfig), generation + 1};
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), &cfg, sizeof(cfg));
+    uint32_t recordCrc = crc32Update(0, record, sizeof(header) + sizeof(cfg));
+    memcpy(record + sizeof(header) + sizeof(cfg), &recordCrc, 4);
+
+    uint8_t slot = (newest == 0) ? 1 : 0;
+    if (prefs.putBytes(slotKeys[slot], record, sizeof(record)) != sizeof(record))
+        return false;
+
+    newest = slot;
+    generation = header.generation;
+    storedCrc = crc;
+    numSaves++;
+    return true;
+}
+
+bool ConfigStore::isValid(const NodeConfig &cfg)
+{
+    if ((cfg.canNodeId < 1) || (cfg.canNodeId > CONFIG_MAX_NODE_ID))
+        return false;
+    if ((cfg.canKbps != 125) && (cfg.canKbps != 250) && (cfg.canKbps != 500) && (cfg.canKbps != 1000))
+        return false;
+    if ((cfg.cellOvCode <= 0) || (cfg.auxTolerance < 0) || (cfg.cellFiltered > 1))
+        return false;
+
+    // The diagnostic session is on standard IDs, it must not share them with the data frames
+    if ((cfg.diagRxId > 0x7FF) || (cfg.diagTxId > 0x7FF) || (cfg.diagRxId == cfg.diagTxId))
+        return false;
+    if ((cfg.canCurrentId > 0x1FFFFFFF) || (cfg.canSocId > 0x1FFFFFFF - TOTALBOARDS))
+        return false;
+    const uint32_t diagIds[2] = {cfg.diagRxId, cfg.diagTxId};
+    for (uint32_t id : diagIds)
+    {
+        if ((id == cfg.canCurrentId) || ((id >= cfg.canSocId) && (id <= cfg.canSocId + TOTALBOARDS)) ||
+            ((id >= STATUS_START_MASTER_ID) && (id < STATUS_START_MASTER_ID + STATUS_NUM_IDS)))
+            return false;
+    }
+    return true;
+}
+
+NodeConfig ConfigStore::canonical(const NodeConfig &cfg)
+{
+    NodeConfig out;
+    memset(&out, 0, sizeof(out));
+    out.uvThresh = cfg.uvThresh;
+    out.ovThresh = cfg.ovThresh;
+    out.cellOvCode = cfg.cellOvCode;
+    out.canNodeId = cfg.canNodeId;
+    out.canKbps = cfg.canKbps;
+    out.canCurrentId = cfg.canCurrentId;
+    out.canSocId = cfg.canSocId;
+    out.diagRxId = cfg.diagRxId;
+    out.diagTxId = cfg.diagTxId;
+    memcpy(out.cellOffset, cfg.cellOffset, sizeof(out.cellOffset));
+    memcpy(out.cellGain, cfg.cellGain, sizeof(out.cellGain));
+    out.cellFiltered = cfg.cellFiltered;
+    out.auxTolerance = cfg.auxTolerance;
+    return out;
+}
+
+void ConfigStore::print()
+{
+    Serial.println((String) "Config: " + (loadedSchema ? (String) "schema " + loadedSchema + " gen " + generation + " slot " + newest
+                                                       : (String) "fabrica") +
+                   ", node " + config.canNodeId + " at " + config.canKbps + " kbps, UV/OV 0x" + String(config.uvThresh, HEX) +
+                   "/0x" + String(config.ovThresh, HEX) + ", saves: " + numSaves + " skipped: " + numSkipped);
+}
+
+// Reads a record over the factory configuration; false if it is missing, too old, fails the CRC or is out of range
+bool ConfigStore::readSlot(uint8_t slot, Header &header, NodeConfig &cfg, uint32_t &crc)
+{
+    size_t len = prefs.getBytesLength(slotKeys[slot]);
+    if ((len < sizeof(Header) + 4) || (len > CONFIG_MAX_BYTES))
+        return false;
+
+    uint8_t record[CONFIG_MAX_BYTES];
+    if (prefs.getBytes(slotKeys[slot], record, len) != len)
+        return false;
+    memcpy(&header, record, sizeof(header));
+    uint32_t recordCrc;
+    memcpy(&recordCrc, record + len - 4, 4);
+    if ((header.size != len - sizeof(Header) - 4) || (header.schema < CONFIG_SCHEMA_MIN) ||
+        (crc32Update(0, record, len - 4) != recordCrc))
+        return false;
+
+    cfg = factoryConfig;
+    memcpy(&cfg, record + sizeof(header), min((size_t)header.size, sizeof(cfg)));
+    cfg = canonical(cfg);
+    crc = crc32Update(0, record + sizeof(header), header.size);
+    return isValid(cfg);
+}
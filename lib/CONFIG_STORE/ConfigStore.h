@@ -0,0 +1,95 @@
+//********MART NODE CONFIGURATION STORE
+#ifndef CONFIGSTORE_H
+#define CONFIGSTORE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "PackSnapshot.h"
+#include "common.h"
+#include "crc32.h"
+
+#define CONFIG_SCHEMA     2      // Version of NodeConfig written by this firmware
+#define CONFIG_SCHEMA_MIN 1      // Oldest version that can still be read (fields are only ever appended)
+#define CONFIG_NAMESPACE  "mart" // NVS namespace, the record alternates between the keys "cfg0" and "cfg1"
+#define CONFIG_MAX_NODE_ID (STATUS_NUM_IDS / STATUS_NUM_PAQUETS) // Status frames of every node below 0x7FF
+
+/**
+ * Everything that differs from one node to another. New fields go at the
+ * end and CONFIG_SCHEMA goes up: a record written by an older firmware is
+ * read over the defaults, so the new fields keep their factory values.
+ * TOTALBOARDS stays a build constant, it sizes every per-board array.
+ */
+struct NodeConfig
+{
+    // Stack
+    uint8_t uvThresh, ovThresh; // UV_THRESH / OV_THRESH comparator codes
+    int16_t cellOvCode;         // Protection trip of the BMS_OK line, 190.73 uV/LSB
+
+    // CAN map
+    uint8_t canNodeId;
+    uint16_t canKbps;
+    uint32_t canCurrentId, canSocId;
+    uint32_t diagRxId, diagTxId;
+
+    // Calibration
+    int16_t cellOffset[TOTALBOARDS][CELLS_PER_BOARD]; // Added to the cell codes, 190.73 uV/LSB
+
+    // Schema 2
+    int16_t cellGain[TOTALBOARDS][CELLS_PER_BOARD]; // Gain correction, 2^-CAL_GAIN_SHIFT/LSB (0: none)
+    uint8_t cellFiltered;                           // Cells read from the low pass filtered registers (VCELLx_HF)
+    int16_t auxTolerance;                           // Largest main/AUX ADC difference of a cell, 190.73 uV/LSB
+};
+
+/**
+ * NodeConfig in NVS. Each save goes to the slot not holding the newest
+ * record, with a generation number and a CRC-32, so a reset in the middle
+ * of a write leaves the previous configuration in place. NVS spreads the
+ * writes over its pages by itself; saving the configuration that is
+ * already stored writes nothing at all.
+ *
+ * begin() reads it once at boot, afterwards get() is a plain reference to
+ * the RAM copy. save() does not change that copy: a new configuration is
+ * applied by the next boot, never under the feet of a running task.
+ */
+class ConfigStore
+{
+public:
+    // Loads the newest valid record, or the factory configuration if there is none. false: factory
+    bool begin(const NodeConfig &factory);
+
+    const NodeConfig &get() const { return config; }
+
+    // Writes cfg to NVS for the next boot, false if it is not valid or the write failed
+    bool save(const NodeConfig &cfg);
+
+    // Every field in range: node ID, bit rate, CAN IDs that do not collide, flags
+    static bool isValid(const NodeConfig &cfg);
+
+    // Same fields with the padding bytes zeroed, what the CRC and NVS see
+    static NodeConfig canonical(const NodeConfig &cfg);
+
+    void print();
+
+    //** STORE DATA **//
+    uint32_t generation = 0;   // Of the newest record, 0 if none
+    uint16_t loadedSchema = 0; // Schema of the record loaded at boot, 0 for the factory configuration
+    unsigned long numSaves = 0, numSkipped = 0;
+
+private:
+    struct Header
+    {
+        uint16_t schema;
+        uint16_t size; // Bytes of NodeConfig that follow
+        uint32_t generation;
+    };
+
+    NodeConfig config;
+    NodeConfig factoryConfig;
+    Preferences prefs;
+    int8_t newest = -1;  // Slot of the newest valid record
+    uint32_t storedCrc = 0;
+
+    bool readSlot(uint8_t slot, Header &header, NodeConfig &cfg, uint32_t &crc);
+};
+
+#endif
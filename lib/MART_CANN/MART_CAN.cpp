@@ -1,8 +1,9 @@
 #include "MART_CAN.h"
+#include "CAN_IsoTp.h"
 
 /**
  * Reads a message from the CAN bus if available.
- * It checks for the availability of a message using the interrupt pin.
+ * It asks the controller for pending events (the MCP2515 only when its interrupt pin is low).
  * If a message is available, it reads the message ID, length, and data bytes
  * into the DataIN structure. It also determines whether the message uses an
  * extended ID and if it is a Remote Request Frame (RRF).
@@ -10,34 +11,18 @@
  */
 bool CAN_BUS::readBytes()
 {
-    bool ok = false;
-    if (!digitalRead(_CAN.pinINT) && !config.simulating)
-    {
-        byte rxBuf[8];
-        _CAN.readMsgBuf(&DataIN.dataRaw.id, &DataIN.dataRaw.size, DataIN.dataRaw.bytes); // Read data: len = data length, buf = data byte(s)
-        if ((DataIN.dataRaw.id>0x7FF))
-            DataIN.dataRaw.typeExtendedId = 1;
-        else
-            DataIN.dataRaw.typeExtendedId = 0;
-
-        if ((DataIN.dataRaw.id & 0x40000000) == 0x40000000)
-        {
-            unsigned long mask = ~(1UL << 30);
-            // Clear the bit at bitPosition
-            DataIN.dataRaw.id &= mask;
-            DataIN.dataRaw.rrf = true;
-            DEBUG_PRINTLN("Received RRF");
-        }
-        else
-            DataIN.dataRaw.rrf = false;
-
-        ok = true;
-    }
-    else
-    {
-        ok = false;
-    }
-    return (ok || config.simulating);
+    // The error events come through the same interrupt as the frames
+    uint8_t events = controller.poll();
+    if (events & ~CAN_EVENT_RX)
+        errorSupervisor.onEvents(events);
+    if (!(events & CAN_EVENT_RX) || !controller.read(DataIN.dataRaw))
+        return false;
+
+    metrics.onRx(DataIN.dataRaw.id & 0x1FFFFFFF, DataIN.dataRaw.typeExtendedId, DataIN.dataRaw.rrf, DataIN.dataRaw.size,
+                 DataIN.dataRaw.bytes);
+    if (trace)
+        trace->record(DataIN.dataRaw, false, traceBus);
+    return true;
 }
 
 /**
@@ -50,16 +35,22 @@ bool CAN_BUS::readBytes()
 bool CAN_BUS::writeBytes()
 {
     bool ok;
-    byte sndStat = _CAN.sendMsgBuf(DataOUT.dataRaw.id, DataOUT.dataRaw.typeExtendedId, 8, DataOUT.dataRaw.bytes);
-    if (sndStat == CAN_OK)
+    if (!errorSupervisor.canTransmit())
+        return false;
+    if (controller.write(DataOUT.dataRaw.id, DataOUT.dataRaw.typeExtendedId, false, 8, DataOUT.dataRaw.bytes))
     {
+        metrics.onTx(DataOUT.dataRaw.id, DataOUT.dataRaw.typeExtendedId, false, 8, DataOUT.dataRaw.bytes);
+        if (trace)
+            trace->record(micros(), DataOUT.dataRaw.id, DataOUT.dataRaw.typeExtendedId, false, true, 8, DataOUT.dataRaw.bytes, traceBus);
+        errorSupervisor.onTxSuccess();
         ok = true;
     }
     else
     {
+        errorSupervisor.onTxFailure();
         ok = false;
     }
-    return (ok || config.simulating);
+    return ok;
 }
 
 /**
@@ -71,24 +62,19 @@ bool CAN_BUS::writeBytes()
  */
 bool CAN_BUS::send()
 {
-    bool success = true;
+    DeviceLock guard(deviceLock);
+    // Pending RRF responses go first
+    bool success = flushTxQueue();
 
     unsigned long currentTime = millis();
 
+    updateMetrics();
+
     //Send status data if the timer reaches PT and the ESP is configured accordingly
     if (((millis() - previousStatusIntervalTime) >= (intervalTime / 3)) && (config.sendStatusData))
     {
-        numCurrentSamples++;
         setCANStatusData();
         previousStatusIntervalTime = millis();
-
-        if (numCurrentSamples > 3)
-        {
-            // numRXPaqOK = 0;
-            // numTXPaqOK = 0;
-            // numTxPaqError = 0;
-            // numCurrentSamples = 1;
-        }
     }
 
     DataOUT.forEachPacket([this, &success, currentTime](CanPacketRawData &packet)
@@ -107,30 +93,21 @@ bool CAN_BUS::send()
             }
         }
 
-        if (readyToSend && !packet.WaitForRRF) {
+        // Held back while the controller is bus-off or backing off after failures
+        if (readyToSend && !packet.WaitForRRF && errorSupervisor.canTransmit()) {
 
-            //Store the packet ID before the possible ID change if the packet is a RRF
-            unsigned long idAux=packet.id;
-            byte buf[8];
-            // Copy data to buffer
-            std::copy(std::begin(packet.bytes), std::end(packet.bytes), std::begin(buf));
-           // this->printByteArray(buf, 8);
-            if(packet.rrf)
-            {
-            unsigned long mask = 1UL << 30;
-
-              // Set the bit at bitPosition
-              packet.id |= mask;
-            }
-            // Attempt to send the packet
-            if (_CAN.sendMsgBuf(packet.id, packet.size, buf) != CAN_OK) {
-              //  this->printByteArray(buf,8);
+            // Attempt to send the packet (a remote frame if it is a RRF)
+            if (!controller.write(packet.id, packet.id > 0x7FF, packet.rrf, packet.size, packet.bytes)) {
                 ERROR_PRINTLN("Error sending message");
                 success = false; // Mark failure but continue sending the rest
                 numTxPaqError++;
+                errorSupervisor.onTxFailure();
             } else {
               DEBUG_PRINTLN((String)"Packet sent ID = " + packet.id);
-                packet.id=idAux;
+                metrics.onTx(packet.id, packet.id > 0x7FF, packet.rrf, packet.size, packet.bytes);
+                if (trace)
+                    trace->record(micros(), packet.id, packet.id > 0x7FF, packet.rrf, true, packet.size, packet.bytes, traceBus);
+                errorSupervisor.onTxSuccess();
                 // Update the next send time for this packet if it has a timer
                 for (auto& timer : packetTimers) {
                     if (timer.packetID == packet.id) {
@@ -159,25 +136,31 @@ bool CAN_BUS::send()
  */
 bool CAN_BUS::send(unsigned long id)
 {
+    DeviceLock guard(deviceLock);
     bool success = true;
 
     const CanPacketRawData *packet = DataOUT.getPacketById(id);
     DEBUG_PRINT((String) "Sending packet with id " + id);
-    if (packet != nullptr)
+    if ((packet != nullptr) && !errorSupervisor.canTransmit())
     {
-        byte len = packet->size;
-        byte buf[8];
-
-        // Copy data to buffer
-        std::copy(std::begin(packet->bytes), std::end(packet->bytes), std::begin(buf));
-        if (_CAN.sendMsgBuf(packet->id, packet->size, buf))
+        success = false;
+    }
+    else if (packet != nullptr)
+    {
+        if (!controller.write(packet->id, packet->id > 0x7FF, packet->rrf, packet->size, packet->bytes))
         {
             ERROR_PRINTLN("Error sending message");
             success = false; // Mark failure but continue sending the rest
+            numTxPaqError++;
+            errorSupervisor.onTxFailure();
         }
         else
         {
             DEBUG_PRINTLN(" sent OK");
+            metrics.onTx(packet->id, packet->id > 0x7FF, packet->rrf, packet->size, packet->bytes);
+            if (trace)
+                trace->record(micros(), packet->id, packet->id > 0x7FF, packet->rrf, true, packet->size, packet->bytes, traceBus);
+            errorSupervisor.onTxSuccess();
         }
     }
     else
@@ -189,19 +172,27 @@ bool CAN_BUS::send(unsigned long id)
     return success;
 }
 
+/**
+ * Answers a remote request. The in ID is looked up in the RRF dispatch
+ * table (direct index for standard IDs) and the span of preresolved
+ * DataOUT packets is queued and sent, without searching or allocating.
+ * return false if there is no rule for that ID or a response could not be sent
+ */
 bool CAN_BUS::sendRequestedRRF(unsigned long id)
 {
     bool ok = true;
-    auto outIds = getOutIdsByInId(id);
-    if (outIds)
+    const RRFSpan *span = findRRFSpan(id);
+    if (span != nullptr)
     {
         DEBUG_PRINTLN("Sending messages for OUTRRFids associated with INRRFid 0x");
         DEBUG_PRINTLN(id);
-        for (unsigned long id : outIds.value())
+        for (unsigned i = 0; i < span->count; i++)
         {
-            if (!send(id))
-                ok = false; // Call the send method for each OUTRRFid
+            if (!queueTx(rrfSlots[span->first + i]))
+                ok = false;
         }
+        if (!flushTxQueue())
+            ok = false;
     }
     else
     {
@@ -210,7 +201,132 @@ bool CAN_BUS::sendRequestedRRF(unsigned long id)
         DEBUG_PRINTLN(id);
     }
     // returns ok if all the ids that ere config using setRRFId are found and sent correctly
-    return (ok || config.simulating);
+    return ok;
+}
+
+// Finds the responses of an in ID, rebuilding the table first if the rules or DataOUT changed
+const CAN_BUS::RRFSpan *CAN_BUS::findRRFSpan(unsigned long inId)
+{
+    if (rrfDirty || (rrfGeneration != DataOUT.generation))
+        buildRRFTable();
+
+    unsigned long rawId = inId & 0x1FFFFFFF;
+    if (!(inId & 0x80000000) && (rawId < CAN_STD_IDS))
+    {
+        uint8_t index = rrfStdIndex[rawId];
+        return index ? &rrfSpans[index - 1] : nullptr;
+    }
+
+    auto it = std::lower_bound(rrfExtIndex.begin(), rrfExtIndex.end(), rawId,
+                               [](const std::pair<unsigned long, uint8_t> &a, unsigned long id)
+                               {
+                                   return a.first < id;
+                               });
+    if ((it != rrfExtIndex.end()) && (it->first == rawId))
+        return &rrfSpans[it->second];
+    return nullptr;
+}
+
+/**
+ * Resolves every RRF rule to DataOUT packet indexes. Out IDs that have no
+ * packet yet are skipped; setPacket() inserting them changes the DataOUT
+ * generation, so they are picked up by the next rebuild.
+ */
+void CAN_BUS::buildRRFTable()
+{
+    memset(rrfStdIndex, 0, sizeof(rrfStdIndex));
+    rrfExtIndex.clear();
+    rrfSpans.clear();
+    rrfSlots.clear();
+
+    for (const auto &rrfIds : rrfIdsList)
+    {
+        if (rrfSpans.size() >= 255)
+        {
+            ERROR_PRINTLN("Error: too many RRF rules");
+            break;
+        }
+        RRFSpan span = {(uint16_t)rrfSlots.size(), 0};
+        for (unsigned long outId : rrfIds.OUTRRFid)
+        {
+            int index = DataOUT.indexOf(outId);
+            if (index >= 0)
+            {
+                rrfSlots.push_back(index);
+                span.count++;
+            }
+        }
+        rrfSpans.push_back(span);
+
+        for (unsigned long inId : rrfIds.INRRFid)
+        {
+            if (inId < CAN_STD_IDS)
+                rrfStdIndex[inId] = rrfSpans.size();
+            else
+                rrfExtIndex.push_back({inId, (uint8_t)(rrfSpans.size() - 1)});
+        }
+    }
+    std::sort(rrfExtIndex.begin(), rrfExtIndex.end());
+
+    rrfGeneration = DataOUT.generation;
+    rrfDirty = false;
+}
+
+bool CAN_BUS::queueTx(uint16_t slot)
+{
+    uint8_t next = (txHead + 1) % CAN_TX_QUEUE_SIZE;
+    if (next == txTail)
+    {
+        ERROR_PRINTLN("Error: TX queue full");
+        return false;
+    }
+    txQueue[txHead] = {slot, DataOUT.packetAt(slot).id, DataOUT.generation, (uint32_t)micros()};
+    txHead = next;
+    return true;
+}
+
+/**
+ * Sends the queued responses in order. Stops at the first frame the
+ * MCP2515 does not accept, leaving it queued for the next call.
+ * return true if the queue is empty
+ */
+bool CAN_BUS::flushTxQueue()
+{
+    while (txTail != txHead)
+    {
+        TxEntry &entry = txQueue[txTail];
+        if (entry.generation != DataOUT.generation)
+        {
+            int index = DataOUT.indexOf(entry.id);
+            if (index < 0)
+            {
+                txTail = (txTail + 1) % CAN_TX_QUEUE_SIZE; // Packet removed, nothing to send
+                continue;
+            }
+            entry.slot = index;
+            entry.generation = DataOUT.generation;
+        }
+
+        if (!errorSupervisor.canTransmit())
+            return false;
+
+        CanPacketRawData &packet = DataOUT.packetAt(entry.slot);
+        if (!controller.write(packet.id, packet.typeExtendedId, false, packet.size, packet.bytes))
+        {
+            ERROR_PRINTLN("Error sending message");
+            numTxPaqError++;
+            errorSupervisor.onTxFailure();
+            return false;
+        }
+        errorSupervisor.onTxSuccess();
+        numTXPaqOK++;
+        metrics.onTx(packet.id, packet.typeExtendedId, false, packet.size, packet.bytes);
+        metrics.onTxWait(micros() - entry.queuedAt);
+        if (trace)
+            trace->record(micros(), packet.id, packet.typeExtendedId, false, true, packet.size, packet.bytes, traceBus);
+        txTail = (txTail + 1) % CAN_TX_QUEUE_SIZE;
+    }
+    return true;
 }
 
 /**
@@ -218,19 +334,27 @@ bool CAN_BUS::sendRequestedRRF(unsigned long id)
  * This method repeatedly calls readBytes() to read any available CAN messages.
  * Each read message is added to the DataIN structure for later processing.
  */
-void CAN_BUS::receive()
+bool CAN_BUS::receive()
 {
+    DeviceLock guard(deviceLock);
     previousStatusRuntimeTime = millis();
-    if (readBytes() || config.simulating)
+    if (readBytes())
     {
-        //Store packet in memory if is not in the IDs set by the filter or if are no ids stored
-        if ((filterIDs.empty())||(std::binary_search(filterIDs.begin(), filterIDs.end(), DataIN.dataRaw.id)))
+        numRXPaqOK++;
+        // Segments of a transport message are not single packets, they are reassembled in the session buffer
+        if (isoTp && isoTp->onFrame(DataIN.dataRaw))
+            return true;
+
+        //Store packet in memory if is accepted by the filter or if are no ids stored
+        if (filter.empty() || filter.accepts(DataIN.dataRaw.id, DataIN.dataRaw.typeExtendedId))
         {
             //Serial.println("ADDED");
             DataIN.addPacket(DataIN.dataRaw);
         }
+        else
+            numRXFiltered++;
 
-         Serial.println((String) "Rx ID: " + DataIN.dataRaw.id);
+        DEBUG_PRINTLN((String) "Rx ID: " + DataIN.dataRaw.id);
         //  Respond to RRF if the option is enabled
         if (DataIN.dataRaw.rrf && config.respondToRRF)
         {      
@@ -242,8 +366,30 @@ void CAN_BUS::receive()
                 DataIN.removePacket(DataIN.dataRaw.id);
             }
         }
-        numRXPaqOK++;
+        return true;
     }
+    return false;
+}
+
+bool CAN_BUS::sendFrame(unsigned long id, bool extended, uint8_t len, const uint8_t *data)
+{
+    DeviceLock guard(deviceLock);
+    if (!errorSupervisor.canTransmit())
+        return false;
+
+    if (!controller.write(id, extended, false, len, data))
+    {
+        ERROR_PRINTLN("Error sending message");
+        numTxPaqError++;
+        errorSupervisor.onTxFailure();
+        return false;
+    }
+    errorSupervisor.onTxSuccess();
+    metrics.onTx(id, extended, false, len, data);
+    if (trace)
+        trace->record(micros(), id, extended, false, true, len, data, traceBus);
+    numTXPaqOK++;
+    return true;
 }
 
 // Configures the RRF pairs
@@ -275,59 +421,110 @@ void CAN_BUS::setRRFId(unsigned long inId, unsigned long outId)
                                           });
         rrfIdsList.insert(insertPos, newIds);
     }
+
+    auto outPos = std::lower_bound(rrfOutIds.begin(), rrfOutIds.end(), outId);
+    if ((outPos == rrfOutIds.end()) || (*outPos != outId))
+        rrfOutIds.insert(outPos, outId);
+    rrfDirty = true;
+
+    // The request has to get through the controller filters
+    if (!filter.empty())
+        syncHwFilter();
 }
 
-std::optional<std::vector<unsigned long>> CAN_BUS::getOutIdsByInId(unsigned long inId)
+// Checks if a packet is the response of a RRF rule (binary search over the out IDs of every rule)
+bool CAN_BUS::searchOutId(unsigned long outId)
 {
-    for (const auto &rrfIds : rrfIdsList)
-    {
-        // Check if the inId is in the INRRFid vector
-        if (std::find(rrfIds.INRRFid.begin(), rrfIds.INRRFid.end(), inId) != rrfIds.INRRFid.end())
-        {
-            // If inId is found, return the associated OUTRRFid vector
-            return rrfIds.OUTRRFid;
-        }
-    }
-    return std::nullopt; // inId not found
+    return std::binary_search(rrfOutIds.begin(), rrfOutIds.end(), outId);
 }
 
-bool CAN_BUS::searchOutId(unsigned long outId)
+// Only frames with these IDs are stored, the controller filters are updated
+bool CAN_BUS::setFilters(const unsigned long ids[], unsigned size)
 {
-    bool ok;
-    for (const auto &rrfIds : rrfIdsList)
+    for (unsigned i = 0; i < size; i++)
     {
-        // Check if the outId is in the OUTRRFid vector
-        if (std::find(rrfIds.OUTRRFid.begin(), rrfIds.OUTRRFid.end(), outId) != rrfIds.OUTRRFid.end())
-        {
-            ok = true;
-        }
-        else
-        {
-            ok = false; // outId not found in any vector
-        }
+        unsigned long id = ids[i] & 0x1FFFFFFF;
+        filter.addId(id, (ids[i] & 0x80000000) || (id > 0x7FF));
     }
-    return (ok);
+    syncHwFilter();
+    return true;
 }
 
-// Calculates and writes the masks and filters to the MCP2515 registers given a set of IDs
-bool CAN_BUS::setFilters(const unsigned long ids[], unsigned size)
+void CAN_BUS::addFilterRange(unsigned long first, unsigned long last, bool extended)
+{
+    filter.addRange(first, last, extended);
+    syncHwFilter();
+}
+
+void CAN_BUS::addFilterMask(unsigned long match, unsigned long mask, bool extended)
+{
+    filter.addMask(match, mask, extended);
+    syncHwFilter();
+}
+
+/**
+ * match and mask follow the received id (bit 31 set for extended frames),
+ * a rule that can match both kinds of frames admits both.
+ */
+void CAN_BUS::admitFrames(unsigned long match, unsigned long mask)
+{
+    if (!(match & mask & 0x9FFFF800))
+        admittedIds.addMask(match, mask, false);
+    if (!(mask & 0x80000000) || (match & 0x80000000))
+        admittedIds.addMask(match, mask, true);
+    if (!filter.empty())
+        syncHwFilter();
+}
+
+/**
+ * The controller has to admit everything the node reacts to, not only the
+ * stored frames: RRF requests are answered even if they are not kept.
+ * Without a software filter every frame is stored, so the controller
+ * admits them all.
+ */
+void CAN_BUS::syncHwFilter()
 {
-    for (int i = 0; i < size; i++)
+    DeviceLock guard(deviceLock);
+    if (filter.empty())
     {
-        filterIDs.push_back(ids[i]);
+        hwFiltering = controller.applyFilter(filter);
+        return;
     }
-    sort(filterIDs.begin(), filterIDs.end());
-    return true;
+
+    CanIdFilter hw = filter;
+    hw.add(admittedIds);
+    for (const RRFIds &rule : rrfIdsList)
+    {
+        unsigned long inId = rule.INRRFid[0];
+        hw.addId(inId & 0x1FFFFFFF, (inId & 0x80000000) || ((inId & 0x1FFFFFFF) > 0x7FF));
+    }
+    hwFiltering = controller.applyFilter(hw);
 }
 
 void CAN_BUS::printFilters()
 {
-    configurator.printCalculatedValues();
+    if (filter.empty())
+        Serial.println("No filter, every frame is stored");
+    else
+        filter.print();
+    Serial.println(hwFiltering ? "Controller filters enabled" : "Controller admits every frame");
+    Serial.println((String) "Frames dropped by the software filter: " + numRXFiltered);
 }
 
 void CAN_BUS::testFilters(const std::vector<uint16_t> &testIds)
 {
-    configurator.testFilters(testIds);
+    for (auto id : testIds)
+    {
+        bool sw = filter.empty() || filter.accepts(id, false);
+        bool hw = controller.hwAccepts(id, false);
+        Serial.print("ID 0x");
+        Serial.print(id, HEX);
+        Serial.print(sw ? " is accepted" : " is blocked");
+        Serial.print(hw ? ", the controller admits it" : ", the controller drops it");
+        if (sw && !hw)
+            Serial.print(" (filters out of sync)");
+        Serial.println();
+    }
 }
 
 void CAN_BUS::setPacketTimer(unsigned long packetID, unsigned long time)
@@ -347,15 +544,25 @@ void CAN_BUS::setPacketTimer(unsigned long packetID, unsigned long time)
 }
 
 //** CAN STATUS **//
+/**
+ * Stores the status frames of this node. d0 and d1 carry the frames
+ * counted since the previous status frames, d2 the bus load in 0.1 % and
+ * the MCP2515 error state packed as REC << 16 | TEC << 8 | EFLG.
+ */
 void CAN_BUS::setCANStatusData()
 {
     int d0[2]; // runtimeTime,numTxPaqError
     int d1[2]; // numRXPaqOK,numTXPaqOK
-    int d2[2] = {0, 0};
+    int d2[2]; // busLoad,errors
     d0[0] = runtimeTime;
-    d0[1] = numTxPaqError / numCurrentSamples;
-    d1[0] = numRXPaqOK / numCurrentSamples;
-    d1[1] = numTXPaqOK / numCurrentSamples;
+    d0[1] = numTxPaqError - lastStatusTxError;
+    d1[0] = numRXPaqOK - lastStatusRX;
+    d1[1] = numTXPaqOK - lastStatusTX;
+    d2[0] = metrics.getBusLoad();
+    d2[1] = (metrics.rec << 16) | (metrics.tec << 8) | metrics.eflg;
+    lastStatusTxError = numTxPaqError;
+    lastStatusRX = numRXPaqOK;
+    lastStatusTX = numTXPaqOK;
 
     DEBUG_PRINTLN("Offset: ");
     DEBUG_PRINTLN(statusPacketOffset);
@@ -365,6 +572,26 @@ void CAN_BUS::setCANStatusData()
     this->setPacket(statusPacketOffset + 2, d2);
 }
 
+void CAN_BUS::updateMetrics()
+{
+    DeviceLock guard(deviceLock);
+    if ((millis() - lastErrorSample) >= CAN_METRICS_SAMPLE_MS)
+    {
+        byte eflg = controller.getErrorFlags();
+        metrics.sampleErrors(controller.errorCountRX(), controller.errorCountTX(), eflg);
+        errorSupervisor.update(eflg);
+        lastErrorSample = millis();
+    }
+    metrics.update();
+}
+
+void CAN_BUS::printMetrics()
+{
+    Serial.println((String) "NodeId: " + nodeID + " rx: " + numRXPaqOK + " tx: " + numTXPaqOK + " tx errors: " + numTxPaqError);
+    metrics.print();
+    errorSupervisor.printStatus();
+}
+
 void CAN_BUS::getCANStatusData(unsigned _nodeid, int _d0[], int _d1[], int _d2[], bool &ok)
 {
 
@@ -391,6 +618,8 @@ void CAN_BUS::getCANStatusData(unsigned _nodeid, int _d0[], int _d1[], int _d2[]
             d0[1] = numTxPaqError;
             d1[0] = numRXPaqOK;
             d1[1] = numTXPaqOK;
+            d2[0] = metrics.getBusLoad();
+            d2[1] = (metrics.rec << 16) | (metrics.tec << 8) | metrics.eflg;
             printArray(d0);
             ok = true;
         }
@@ -405,7 +634,7 @@ void CAN_BUS::getCANStatusData(unsigned _nodeid, int _d0[], int _d1[], int _d2[]
     _d1[0] = d1[0];
     _d1[1] = d1[1];
     _d2[0] = d2[0];
-    _d2[1] = d2[0];
+    _d2[1] = d2[1];
 }
 bool CAN_BUS::getCANStatusData(unsigned _nodeid, int d[])
 {
@@ -441,6 +670,8 @@ void CAN_BUS::printStatusData(unsigned _nodeID)
         Serial.println((String) "numTxPaqError: " + d0[1]);
         Serial.println((String) "numRXPaqOK: " + d1[0]);
         Serial.println((String) "numTXPaqOK: " + d1[1]);
+        Serial.println((String) "busLoad: " + (d2[0] / 10.0) + " %");
+        Serial.println((String) "REC: " + ((d2[1] >> 16) & 0xFF) + " TEC: " + ((d2[1] >> 8) & 0xFF) + " EFLG: " + (d2[1] & 0xFF));
     }
 }
 void CAN_BUS::printReceivedIds()
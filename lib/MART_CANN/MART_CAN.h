@@ -6,18 +6,47 @@
 #include <bitset>
 #include <cstring>
 #include <optional>
-#include <EEPROM.h>
-#include "mcp_can.h"
+#include "CAN_Backend.h"
+#include "CAN_MCP2515.h"
 #include "CAN_DATA.h"
 #include "common.h"
-#include "MCP2515_Config.h"
+#include "CAN_Filter.h"
+#include "CAN_Metrics.h"
+#include "CAN_ErrorSupervisor.h"
+#include "CAN_Trace.h"
+
+#define CAN_TX_QUEUE_SIZE 32   // Responses waiting for a free MCP2515 TX buffer
+
+class IsoTp;
+
+// Holds a device lock (recursive mutex) for the lifetime of the object, nothing if no lock is set
+class DeviceLock
+{
+public:
+    DeviceLock(SemaphoreHandle_t _lock) : lock(_lock)
+    {
+        if (lock)
+            xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    }
+    ~DeviceLock()
+    {
+        if (lock)
+            xSemaphoreGiveRecursive(lock);
+    }
+
+private:
+    SemaphoreHandle_t lock;
+};
 
 class CAN_BUS
 {
+private:
+    std::optional<Mcp2515Backend> mcpBackend; // Controller built by the MCP2515 constructors
 
 public:
     // CONVERTER converter;
-    MCP_CAN _CAN;
+    CanBackend &controller;
+    CanErrorSupervisor errorSupervisor{controller}; // Error state, TX backoff and bus-off recovery of the controller
     CAN_DATA DataIN, DataOUT;
     bool mcpInitOK=false;
 
@@ -25,48 +54,40 @@ public:
     {
         bool respondToRRF;            // Automaticaly respond to a RRF
         bool autoRemoveRRFPacket;     // Automaticaly delete a received rrf when the requested data is sent
-        bool simulating;              // Set to true for testing when no MCP2515 are connected to the microcontroller
         bool autoRemoveStoredFilters; // Removes the stored masks and filters when applied to the MCP2515 registers to save memory
         bool sendStatusData;          // Send status data such as runtime time, number of sent, received and collided paquets.
     } config;
 
     // Constructor: Initializes the MCP_CAN instance and sets up the CAN interface
-    CAN_BUS(int pinCs) : _CAN(pinCs)
+    CAN_BUS(int pinCs) : mcpBackend(std::in_place, pinCs), controller(*mcpBackend)
     {
-        if (_CAN.begin(MCP_ANY, CAN_1000KBPS, MCP_8MHZ) == CAN_OK)
+        if (controller.begin(1000))
             Serial.println("MCP2515 Initialized Successfully!");
         else
             Serial.println("Error Initializing MCP2515...");
-        _CAN.setMode(MCP_NORMAL); // Change to normal mode to allow messages to be transmitted
 
         // Default configuration
         config.respondToRRF = true;
         config.autoRemoveRRFPacket = true;
-        config.simulating = false;
         config.autoRemoveStoredFilters = true;
         config.sendStatusData = false;
     }
 
     // Constructor: Initializes the MCP_CAN instance and sets up the CAN interface
-    CAN_BUS(int pinCs, int _nodeID) : _CAN(pinCs)
+    CAN_BUS(int pinCs, int _nodeID) : mcpBackend(std::in_place, pinCs), controller(*mcpBackend)
     {
        
-        if (_CAN.begin(MCP_ANY, CAN_1000KBPS, MCP_8MHZ) == CAN_OK)
+        if (controller.begin(1000))
             Serial.println("MCP2515 Initialized Successfully!");
         else
             Serial.println("Error Initializing MCP2515...");
-        _CAN.setMode(MCP_NORMAL); // Change to normal mode to allow messages to be transmitted
 
         // Default configuration
         config.respondToRRF = true;
         config.autoRemoveRRFPacket = true;
-        config.simulating = false;
         config.autoRemoveStoredFilters = true;
         config.sendStatusData = false;
 
-        // EEPROM.begin(100);
-        // EEPROM.writeUInt(eepromAddressCount,_nodeID);
-
         // unsigned long int rIDS[STATUS_NUM_IDS];
         // for(unsigned long i=0;i<STATUS_NUM_IDS;i++)
         // {
@@ -87,71 +108,62 @@ public:
         previousStatusRuntimeTime = millis();
         intervalTime = STATUS_DATA_TIME_CALC;
         nodeID = _nodeID;
+        statusPacketOffset = STATUS_START_MASTER_ID + (_nodeID - 1) * STATUS_NUM_PAQUETS;
     }
-    CAN_BUS(int pinCs, int _nodeID, int kbps) : _CAN(pinCs)
+    CAN_BUS(int pinCs, int _nodeID, int kbps) : mcpBackend(std::in_place, pinCs), controller(*mcpBackend)
     {
-        if (kbps == 250)
-        {
-            if (_CAN.begin(MCP_ANY, CAN_250KBPS, MCP_8MHZ) == CAN_OK)
-            {
-                mcpInitOK=true;
-            }
-               // Serial.println("MCP2515 Initialized Successfully! 250kbps");
-            else
-                Serial.println("Error Initializing MCP2515...");
-            _CAN.setMode(MCP_NORMAL); // Change to normal mode to allow messages to be transmitted
-        }
-        if (kbps == 125)
-        {
-            if (_CAN.begin(MCP_ANY, CAN_125KBPS, MCP_8MHZ) == CAN_OK)
-            {
-                mcpInitOK=true;
-            }
-               // Serial.println("MCP2515 Initialized Successfully! 250kbps");
-            else
-                Serial.println("Error Initializing MCP2515...");
-            _CAN.setMode(MCP_NORMAL); // Change to normal mode to allow messages to be transmitted
-        }
-         if (kbps == 500)
-        {
-            if (_CAN.begin(MCP_ANY, CAN_500KBPS, MCP_8MHZ) == CAN_OK)
-            {
-                mcpInitOK=true;
-            }
-               // Serial.println("MCP2515 Initialized Successfully! 250kbps");
-            else
-                Serial.println("Error Initializing MCP2515...");
-            _CAN.setMode(MCP_NORMAL); // Change to normal mode to allow messages to be transmitted
-        }
-        else
-        {
-            if (_CAN.begin(MCP_ANY, CAN_1000KBPS, MCP_8MHZ) == CAN_OK)
-            {
-                Serial.println("MCP2515 Initialized Successfully!");
-                mcpInitOK=true;
-            }
-                
-            else
-                Serial.println("Error Initializing MCP2515...");
-            _CAN.setMode(MCP_NORMAL); // Change to normal mode to allow messages to be transmitted
-        }
+        init(_nodeID, kbps);
+    }
 
-        // Default configuration
+    // Constructor for a controller on its own SPI host or sharing one with other MCP2515s (see CanManager)
+    CAN_BUS(SPIClass *spi, int pinCs, int pinInt, int _nodeID, int kbps)
+        : mcpBackend(std::in_place, spi, pinCs, pinInt), controller(*mcpBackend)
+    {
+        init(_nodeID, kbps);
+    }
+
+    // Constructor for any other controller (TWAI), owned by the caller
+    CAN_BUS(CanBackend &_controller, int _nodeID, int kbps) : controller(_controller)
+    {
+        init(_nodeID, kbps);
+    }
+
+    // Constructors for global objects: the controller is not touched (no SPI, no driver) until begin()
+    CAN_BUS(SPIClass *spi, int pinCs, int pinInt) : mcpBackend(std::in_place, spi, pinCs, pinInt), controller(*mcpBackend)
+    {
         config.respondToRRF = true;
         config.autoRemoveRRFPacket = true;
-        config.simulating = false;
         config.autoRemoveStoredFilters = true;
         config.sendStatusData = false;
+    }
 
-        previousStatusIntervalTime = millis();
-        previousStatusRuntimeTime = millis();
-        intervalTime = STATUS_DATA_TIME_CALC;
-        nodeID = _nodeID;
+    CAN_BUS(CanBackend &_controller) : controller(_controller)
+    {
+        config.respondToRRF = true;
+        config.autoRemoveRRFPacket = true;
+        config.autoRemoveStoredFilters = true;
+        config.sendStatusData = false;
+    }
+
+    // Starts the controller of the constructors above, from setup(). Call it before setting filters or config
+    bool begin(int _nodeID, int kbps)
+    {
+        mcpInitOK = false;
+        init(_nodeID, kbps);
+        return mcpInitOK;
     }
 
     // Destructor
     ~CAN_BUS() {}
 
+    // Node ID and bit rate known only at boot (ConfigStore): restarts the controller, call it before setting filters or config
+    bool setNode(int _nodeID, int kbps)
+    {
+        mcpInitOK = false;
+        init(_nodeID, kbps);
+        return mcpInitOK;
+    }
+
     // Sends all stored data packets in DataOUT
     bool send();
 
@@ -161,8 +173,21 @@ public:
     // Sends a specific stored data packet in DataOUT
     bool sendRequestedRRF(unsigned long id);
 
-    // Receives data packets and stores them in DataIN
-    void receive();
+    // Receives data packets and stores them in DataIN. return true if a frame was read (it stays in DataIN.dataRaw)
+    bool receive();
+
+    // Sends one frame straight from the caller's buffer, without storing it in DataOUT
+    bool sendFrame(unsigned long id, bool extended, uint8_t len, const uint8_t *data);
+
+    // Nothing left to send: the RRF queue is empty and the controller has sent every frame
+    bool txIdle()
+    {
+        DeviceLock guard(deviceLock);
+        return (txHead == txTail) && controller.txIdle();
+    }
+
+    // Serialises every access to the controller (several tasks or a shared SPI host), set by CanManager
+    void setLock(SemaphoreHandle_t lock) { deviceLock = lock; }
 
     // Retrieves a packet with a specific CAN ID and unpacks its data
     template <typename... Args>
@@ -190,7 +215,7 @@ public:
                 ok = false;
             }
         }
-        return (ok || config.simulating);
+        return ok;
     }
 
     // Retrieves the last received packet and unpacks its data
@@ -208,7 +233,7 @@ public:
             ERROR_PRINTLN("Error: No packet has been added yet.");
             ok = false;
         }
-        return (ok || config.simulating);
+        return ok;
     }
 
     // Packs provided data into a CAN packet and stores it in DataOUT
@@ -316,28 +341,76 @@ public:
     // Configures the RRF pairs
     void setRRFId(unsigned long inId, unsigned long outId);
 
-    // Calculates and writes the masks and filters to the MCP2515 registers given a set of IDs
+    // Only frames with these IDs are stored (IDs above 0x7FF are extended), the controller filters are updated
     bool setFilters(const unsigned long ids[], unsigned size);
+    void addFilterRange(unsigned long first, unsigned long last, bool extended);
+    void addFilterMask(unsigned long match, unsigned long mask, bool extended);
+
+    // Frames the node handles without storing them (gateway sources), they must get through the controller filters
+    void admitFrames(unsigned long match, unsigned long mask);
 
-    // Prints the calculated masks and filters
+    // Prints the software filter and whether the controller filters too
     void printFilters();
 
-    // Test by software if the given IDs are accepted by the created filters or not
+    // Shows if the given IDs are accepted by the software and by the controller filters
     void testFilters(const std::vector<uint16_t> &testIds);
 
     void setPacketTimer(unsigned long packetID, unsigned long time);
     void printStatusData(unsigned _nodeID);
     void printReceivedIds();
 
+    //** CAN METRICS **//
+    CanMetrics metrics;
+
+    // Samples REC/TEC/EFLG every CAN_METRICS_SAMPLE_MS, checks the error state and closes the bus load window (called by send())
+    void updateMetrics();
+
+    // Prints the metrics and the status counters
+    void printMetrics();
+
+    // Records every frame received and sent in trace as channel bus (nullptr stops recording)
+    void setTrace(CanTrace *_trace, uint8_t bus = 0)
+    {
+        trace = _trace;
+        traceBus = bus;
+    }
+
+    // Frames of the ISO-TP sessions go to isoTp instead of DataIN (nullptr to stop)
+    void setIsoTp(IsoTp *_isoTp) { isoTp = _isoTp; }
+
     //** CAN STATUS DATA**//
     bool getCANStatusData(unsigned _nodeid, int d[]);
 
     //** CAN BUS STATUS DATA **//
     unsigned nodeID, statusPacketOffset;                                                             // IDs
-    unsigned runtimeTime, numRXPaqOK, numTXPaqOK, numTxPaqError;                                     // Actual data
-    unsigned previousStatusIntervalTime, previousStatusRuntimeTime, intervalTime, numCurrentSamples; // Aux data
+    unsigned runtimeTime = 0, numRXPaqOK = 0, numTXPaqOK = 0, numTxPaqError = 0;                     // Actual data
+    unsigned numRXFiltered = 0;                                                                      // Read but dropped by the software filter
+    unsigned previousStatusIntervalTime, previousStatusRuntimeTime, intervalTime;                    // Aux data
 
 private:
+    // Initialises the controller at kbps (125, 250, 500, anything else 1000) and the default configuration
+    void init(int _nodeID, int kbps)
+    {
+        if (controller.begin(kbps))
+            mcpInitOK=true;
+        else
+            Serial.println("Error Initializing CAN controller...");
+
+        // Default configuration
+        config.respondToRRF = true;
+        config.autoRemoveRRFPacket = true;
+        config.autoRemoveStoredFilters = true;
+        config.sendStatusData = false;
+
+        metrics.setBitrate(((kbps == 125) || (kbps == 250) || (kbps == 500)) ? kbps * 1000UL : 1000000UL);
+
+        previousStatusIntervalTime = millis();
+        previousStatusRuntimeTime = millis();
+        intervalTime = STATUS_DATA_TIME_CALC;
+        nodeID = _nodeID;
+        statusPacketOffset = STATUS_START_MASTER_ID + (_nodeID - 1) * STATUS_NUM_PAQUETS;
+    }
+
     struct RRFIds
     {
         std::vector<unsigned long> INRRFid;
@@ -350,20 +423,59 @@ private:
     };
     std::vector<PacketTimer> packetTimers;
 
-    std::vector<RRFIds> rrfIdsList;       // Vector holding INRRFid and OUTRRFid vectors
-    std::vector<unsigned long> filterIDs; // Vector holding INRRFid and OUTRRFid vectors
-    MCP2515Configurator configurator;
+    SemaphoreHandle_t deviceLock = nullptr;
+
+    CanTrace *trace = nullptr;
+    uint8_t traceBus = 0;
+    IsoTp *isoTp = nullptr;
+
+    // Counters at the previous status frame, the frames carry the increments
+    unsigned lastStatusRX = 0, lastStatusTX = 0, lastStatusTxError = 0;
+    unsigned long lastErrorSample = 0;
 
-    // EEPROM
-    unsigned eepromAddressCount = 0;
+    std::vector<RRFIds> rrfIdsList;       // Vector holding INRRFid and OUTRRFid vectors
+    CanIdFilter filter;      // Frames stored in DataIN, empty = every frame
+    CanIdFilter admittedIds; // Frames that are not stored but must reach the node
+    bool hwFiltering = false; // The controller drops frames the node does not want
 
     bool readBytes();
     bool writeBytes();
-    // Method to search for an InID and return the associated OUTids vector
-    std::optional<std::vector<unsigned long>> getOutIdsByInId(unsigned long inId);
-
     // Method to search for an OUTid and return true if found
     bool searchOutId(unsigned long outId);
+    // Gives the controller the union of the stored, RRF request and admitted IDs
+    void syncHwFilter();
+
+    //** RRF DISPATCH TABLE **//
+    // Every RRF rule resolved to a contiguous span of DataOUT packet indexes. Standard in IDs are
+    // looked up directly in rrfStdIndex, extended ones with a binary search in rrfExtIndex.
+    // The table is rebuilt when a rule is added or DataOUT inserts/removes packets.
+    struct RRFSpan
+    {
+        uint16_t first; // First entry in rrfSlots
+        uint16_t count;
+    };
+    uint8_t rrfStdIndex[CAN_STD_IDS];                           // Standard in ID -> rrfSpans index + 1 (0 = no rule)
+    std::vector<std::pair<unsigned long, uint8_t>> rrfExtIndex; // Extended in ID -> rrfSpans index, sorted
+    std::vector<RRFSpan> rrfSpans;
+    std::vector<uint16_t> rrfSlots;       // DataOUT packet indexes
+    std::vector<unsigned long> rrfOutIds; // Every out ID with a rule, sorted
+    bool rrfDirty = true;
+    unsigned long rrfGeneration = 0;
+    void buildRRFTable();
+    const RRFSpan *findRRFSpan(unsigned long inId);
+
+    //** TX QUEUE **//
+    struct TxEntry
+    {
+        uint16_t slot;             // DataOUT packet index
+        unsigned long id;          // To resolve the index again if DataOUT changed
+        unsigned long generation;  // DataOUT generation the slot belongs to
+        uint32_t queuedAt;         // micros() when it was queued
+    };
+    TxEntry txQueue[CAN_TX_QUEUE_SIZE]; // Sent before the periodic packets
+    uint8_t txHead = 0, txTail = 0;
+    bool queueTx(uint16_t slot);
+    bool flushTxQueue();
 
     // Method to print all RRFIds
     void printRRFIds()
@@ -1388,6 +1388,66 @@ INT8U MCP_CAN::getGPI(void)
     return (res >> 3);
 }
 
+/*********************************************************************************************************
+** Function name:           getInterruptFlags
+** Descriptions:            Public function, Returns CANINTF
+*********************************************************************************************************/
+INT8U MCP_CAN::getInterruptFlags(void)
+{
+    return mcp2515_readRegister(MCP_CANINTF);
+}
+
+/*********************************************************************************************************
+** Function name:           clearInterruptFlags
+** Descriptions:            Public function, Clears the CANINTF bits set in mask
+*********************************************************************************************************/
+void MCP_CAN::clearInterruptFlags(INT8U mask)
+{
+    mcp2515_modifyRegister(MCP_CANINTF, mask, 0);
+}
+
+/*********************************************************************************************************
+** Function name:           setInterruptMask
+** Descriptions:            Public function, Sets the CANINTE bits in mask to the value in enable
+*********************************************************************************************************/
+void MCP_CAN::setInterruptMask(INT8U mask, INT8U enable)
+{
+    mcp2515_modifyRegister(MCP_CANINTE, mask, enable);
+}
+
+/*********************************************************************************************************
+** Function name:           clearRXOverflow
+** Descriptions:            Public function, Clears the RX buffer overflow flags (the only writable EFLG bits)
+*********************************************************************************************************/
+void MCP_CAN::clearRXOverflow(void)
+{
+    mcp2515_modifyRegister(MCP_EFLG, MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR, 0);
+}
+
+/*********************************************************************************************************
+** Function name:           clearAbortTX
+** Descriptions:            Public function, Clears ABAT, needed after abortTX to transmit again
+*********************************************************************************************************/
+void MCP_CAN::clearAbortTX(void)
+{
+    mcp2515_modifyRegister(MCP_CANCTRL, ABORT_TX, 0);
+}
+
+/*********************************************************************************************************
+** Function name:           txPending
+** Descriptions:            Public function, Returns how many TX buffers have TXREQ set
+*********************************************************************************************************/
+INT8U MCP_CAN::txPending(void)
+{
+    const INT8U ctrl[3] = {MCP_TXB0CTRL, MCP_TXB1CTRL, MCP_TXB2CTRL};
+    INT8U n = 0;
+    for (INT8U i = 0; i < 3; i++)
+    {
+        if (mcp2515_readRegister(ctrl[i]) & MCP_TXB_TXREQ_M)
+            n++;
+    }
+    return n;
+}
 
 /*********************************************************************************************************
   END FILE
@@ -135,6 +135,12 @@ public:
     INT8U abortTX(void);                                                // Abort queued transmission(s)
     INT8U setGPO(INT8U data);                                           // Sets GPO
     INT8U getGPI(void);                                                 // Reads GPI
+    INT8U getInterruptFlags(void);                                      // Reads CANINTF
+    void clearInterruptFlags(INT8U mask);                               // Clears CANINTF bits
+    void setInterruptMask(INT8U mask, INT8U enable);                    // Enables/disables CANINTE bits
+    void clearRXOverflow(void);                                         // Clears EFLG RX0OVR/RX1OVR
+    void clearAbortTX(void);                                            // Clears ABAT so transmissions can resume after abortTX
+    INT8U txPending(void);                                              // TX buffers still waiting to be sent (0-3)
     //Métodos MART
     unsigned pinINT=21;
     void read(long unsigned int &rxId,unsigned char &len,char msgString[]);
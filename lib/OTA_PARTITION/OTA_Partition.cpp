@@ -0,0 +1,55 @@
+#include "OTA_Partition.h"
+
+uint32_t OtaPartitionSink::maxSize()
+{
+    const esp_partition_t *next = esp_ota_get_next_update_partition(nullptr);
+    return next ? next->size : 0;
+}
+
+bool OtaPartitionSink::begin(uint32_t size)
+{
+    if (open)
+        abort();
+    partition = esp_ota_get_next_update_partition(nullptr);
+    if (!partition || (size > partition->size))
+        return false;
+    open = check(esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle));
+    return open;
+}
+
+bool OtaPartitionSink::write(const uint8_t *data, size_t len)
+{
+    return open && check(esp_ota_write(handle, data, len));
+}
+
+/**
+ * esp_ota_end() releases the handle whether the image is valid or not, the
+ * boot partition only changes when it is.
+ */
+bool OtaPartitionSink::end()
+{
+    if (!open)
+        return false;
+    open = false;
+    if (!check(esp_ota_end(handle)))
+        return false;
+    if (!check(esp_ota_set_boot_partition(partition)))
+        return false;
+    Serial.println((String) "OTA image written to " + partition->label + ", boots after the next reset");
+    return true;
+}
+
+void OtaPartitionSink::abort()
+{
+    if (open)
+        esp_ota_abort(handle);
+    open = false;
+}
+
+bool OtaPartitionSink::check(esp_err_t err)
+{
+    lastError = err;
+    if (err != ESP_OK)
+        Serial.println((String) "OTA error: " + esp_err_to_name(err));
+    return err == ESP_OK;
+}
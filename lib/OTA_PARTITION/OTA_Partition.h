@@ -0,0 +1,41 @@
+//********MART OTA PARTITION LIBRARY
+#ifndef OTAPARTITION_H
+#define OTAPARTITION_H
+
+#include <Arduino.h>
+#include "esp_ota_ops.h"
+#include "CAN_Ota.h"
+
+/**
+ * Firmware sink on the ESP32: the image goes to the OTA partition that is
+ * not running. Sectors are erased as the writes reach them
+ * (OTA_WITH_SEQUENTIAL_WRITES), so begin() returns at once instead of
+ * erasing the whole partition. While a sector is erased or programmed the
+ * flash cache is off on both cores and only IRAM code runs, so the writer
+ * task must not share a priority with the acquisition.
+ *
+ * end() has the IDF check the image (header, segments and the SHA-256
+ * appended by the build) and only then switches the otadata entry, a single
+ * sector write: a reset at any point boots either the old or the new image.
+ */
+class OtaPartitionSink : public FirmwareSink
+{
+public:
+    uint32_t maxSize() override;
+    bool begin(uint32_t size) override;
+    bool write(const uint8_t *data, size_t len) override;
+    bool end() override;
+    void abort() override;
+
+    // Last IDF error, ESP_OK if none
+    esp_err_t lastError = ESP_OK;
+
+private:
+    const esp_partition_t *partition = nullptr;
+    esp_ota_handle_t handle = 0;
+    bool open = false;
+
+    bool check(esp_err_t err);
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "PackSnapshot.h"
+
+static const int16_t (*cellGain)[CELLS_PER_BOARD] = nullptr;
+static const int16_t (*cellOffset)[CELLS_PER_BOARD] = nullptr;
+
+void setCellCalibration(const int16_t (*gain)[CELLS_PER_BOARD], const int16_t (*offset)[CELLS_PER_BOARD])
+{
+    cellGain = gain;
+    cellOffset = offset;
+}
+
+void beginScan(PackSnapshot &snap)
+{
+    snap.cellValid = 0;
+    snap.gpioValid = 0;
+    snap.batValid = 0;
+    snap.sequence++;
+
+    snap.minCell = INT16_MAX;
+    snap.maxCell = INT16_MIN;
+    snap.minCellIndex = 0;
+    snap.maxCellIndex = 0;
+    snap.sumCell = 0;
+    snap.numCells = 0;
+    snap.minGpio = INT16_MAX;
+    snap.maxGpio = INT16_MIN;
+}
+
+/**
+ * Decodes the 6 cell codes of a board (big endian, two's complement) and
+ * updates min/max/sum in the same loop, so no consumer has to walk the
+ * pack again to find the extreme cells. The calibration is one multiply,
+ * one shift and two adds per cell.
+ */
+void decodeCells(PackSnapshot &snap, byte board, const byte *frame)
+{
+    const byte *data = &frame[4];
+    for (unsigned i = 0; i < CELLS_PER_BOARD; i++)
+    {
+        int16_t code = (int16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+        if (cellGain)
+            code = calibrateCell(code, cellGain[board][i], cellOffset[board][i]);
+        snap.cellCode[board][i] = code;
+        snap.sumCell += code;
+        if (code < snap.minCell)
+        {
+            snap.minCell = code;
+            snap.minCellIndex = board * CELLS_PER_BOARD + i;
+        }
+        if (code > snap.maxCell)
+        {
+            snap.maxCell = code;
+            snap.maxCellIndex = board * CELLS_PER_BOARD + i;
+        }
+    }
+    snap.numCells += CELLS_PER_BOARD;
+    snap.timestamp[board] = micros();
+    snap.cellValid |= (1UL << board);
+}
+
+void decodeGPIO(PackSnapshot &snap, byte board, const byte *frame)
+{
+    const byte *data = &frame[4];
+    for (unsigned i = 0; i < GPIOS_PER_BOARD; i++)
+    {
+        int16_t code = (int16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+        snap.gpioCode[board][i] = code;
+        if (code < snap.minGpio)
+            snap.minGpio = code;
+        if (code > snap.maxGpio)
+            snap.maxGpio = code;
+    }
+    snap.timestamp[board] = micros();
+    snap.gpioValid |= (1UL << board);
+}
+
+void decodeBAT(PackSnapshot &snap, byte board, const byte *frame)
+{
+    snap.batCode[board] = (int16_t)((frame[4] << 8) | frame[5]);
+    snap.batValid |= (1UL << board);
+}
+
+/**
+ * Board of the n-th frame of a stack response, -1 if it has to be skipped.
+ * The frames are walked in the order they arrived and each one goes to the
+ * device address it carries: a board that did not answer leaves no gap, so
+ * the position says nothing about whose frame it is.
+ */
+static int stackFrameBoard(const byte *response, unsigned n, byte len, uint32_t failMask)
+{
+    int board = FrameBoard(&response[n * (len + 6)], len);
+    if ((board < 0) || (board >= TOTALBOARDS) || (failMask & (1UL << board)))
+        return -1;
+    return board;
+}
+
+void decodeCellStack(PackSnapshot &snap, const byte *response, uint32_t failMask)
+{
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = stackFrameBoard(response, n, MAXBYTES, failMask);
+        if (board >= 0)
+            decodeCells(snap, board, &response[n * (MAXBYTES + 6)]);
+    }
+}
+
+void decodeGPIOStack(PackSnapshot &snap, const byte *response, uint32_t failMask)
+{
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = stackFrameBoard(response, n, MAXBYTES, failMask);
+        if (board >= 0)
+            decodeGPIO(snap, board, &response[n * (MAXBYTES + 6)]);
+    }
+}
+
+void decodeBATStack(PackSnapshot &snap, const byte *response, uint32_t failMask)
+{
+    for (unsigned n = 0; n < TOTALBOARDS; n++)
+    {
+        int board = stackFrameBoard(response, n, 2, failMask);
+        if (board >= 0)
+            decodeBAT(snap, board, &response[n * (2 + 6)]);
+    }
+}
+
+void endScan(PackSnapshot &snap)
+{
+    thermistorConvert(&snap.gpioCode[0][0], &snap.gpioTemp[0][0], TOTALBOARDS * GPIOS_PER_BOARD);
+    if (snap.gpioValid)
+    {
+        snap.maxTemp = thermistorToDeciC(snap.minGpio);
+        snap.minTemp = thermistorToDeciC(snap.maxGpio);
+    }
+}
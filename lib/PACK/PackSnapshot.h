@@ -0,0 +1,141 @@
+//********PACK MEASUREMENT SNAPSHOT
+#ifndef PACKSNAPSHOT_H
+#define PACKSNAPSHOT_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "BQ79606.h"
+#include "BQ_Temp.h"
+
+#define CELLS_PER_BOARD 6
+#define GPIOS_PER_BOARD 6
+#define TOTALCELLS (TOTALBOARDS * CELLS_PER_BOARD)
+#define CAL_GAIN_SHIFT  20 // Cell gain correction LSB: 2^-20 (about 1 ppm, +-3.1 % range)
+
+// Raw ADC codes of the whole pack, one array per quantity so every consumer walks contiguous memory
+struct PackSnapshot
+{
+    int16_t cellCode[TOTALBOARDS][CELLS_PER_BOARD]; // Cell voltage codes, 190.73 uV/LSB
+    int16_t gpioCode[TOTALBOARDS][GPIOS_PER_BOARD]; // GPIO codes (ratiometric for thermistors)
+    int16_t gpioTemp[TOTALBOARDS][GPIOS_PER_BOARD]; // GPIO thermistor temperatures in 0.1 C
+    int16_t batCode[TOTALBOARDS];                   // Stack (BAT) voltage codes
+    uint32_t timestamp[TOTALBOARDS];                // micros() when the board was last decoded
+    uint32_t cellValid;                             // bit n = board n cells decoded with a good CRC in this scan
+    uint32_t gpioValid;                             // bit n = board n GPIOs decoded with a good CRC in this scan
+    uint32_t batValid;                              // bit n = board n BAT decoded with a good CRC in this scan
+    uint8_t cellDrift[TOTALBOARDS];                 // bit n = cell n+1 disagreed with the AUX ADC when last checked
+    uint32_t sequence;                              // Scan number
+
+    // Reductions over the boards decoded in this scan, computed while decoding
+    int16_t minCell, maxCell;
+    uint8_t minCellIndex, maxCellIndex; // board * CELLS_PER_BOARD + cell
+    int32_t sumCell;
+    uint16_t numCells;
+    int16_t minGpio, maxGpio;
+    int16_t maxTemp, minTemp; // From the extreme GPIO codes (the NTC code falls as the temperature rises)
+
+    // State of charge in 0.01 %, written by the SocEstimator before the snapshot is published
+    uint16_t cellSoC[TOTALBOARDS][CELLS_PER_BOARD];
+    uint16_t socAverage, socMin, socMax;
+    uint8_t socMinCell;
+
+    bool allValid() const
+    {
+        const uint32_t all = (TOTALBOARDS >= 32) ? 0xFFFFFFFF : ((1UL << TOTALBOARDS) - 1);
+        return (cellValid & all) == all;
+    }
+};
+
+// Calibrated cell code: code + code * gain / 2^CAL_GAIN_SHIFT + offset, rounded, integer only
+inline int16_t calibrateCell(int16_t code, int16_t gain, int16_t offset)
+{
+    int32_t c = code + offset + (((int32_t)code * gain + (1L << (CAL_GAIN_SHIFT - 1))) >> CAL_GAIN_SHIFT);
+    return (int16_t)constrain(c, INT16_MIN, INT16_MAX);
+}
+
+// Per cell gain and offset applied by decodeCells() (nullptr: raw codes). The tables must outlive the scans
+void setCellCalibration(const int16_t (*gain)[CELLS_PER_BOARD], const int16_t (*offset)[CELLS_PER_BOARD]);
+
+// Clears the validity bits and reductions before decoding a new scan
+void beginScan(PackSnapshot &snap);
+
+// Decodes one response frame (MAXBYTES+6 bytes, ReadReg layout) of a board
+void decodeCells(PackSnapshot &snap, byte board, const byte *frame);
+void decodeGPIO(PackSnapshot &snap, byte board, const byte *frame);
+void decodeBAT(PackSnapshot &snap, byte board, const byte *frame);
+
+// Decodes a FRMWRT_ALL_R response by the device address in each frame, skipping the boards in failMask
+void decodeCellStack(PackSnapshot &snap, const byte *response, uint32_t failMask);
+void decodeGPIOStack(PackSnapshot &snap, const byte *response, uint32_t failMask);
+void decodeBATStack(PackSnapshot &snap, const byte *response, uint32_t failMask);
+
+// Converts every GPIO code to temperature in one pass and closes the scan
+void endScan(PackSnapshot &snap);
+
+/**
+ * Single writer, multiple reader publication of the pack snapshot.
+ * Two buffers are used: the writer decodes into the one readers are not
+ * pointed at and flips the front index when it is done. Each buffer has a
+ * sequence counter (odd while being written), so a reader that was
+ * overtaken by two scans detects it and retries. Readers work on the
+ * published buffer in place, nothing is copied on the read side.
+ */
+class SnapshotPublisher
+{
+public:
+    SnapshotPublisher()
+    {
+        memset(buffers, 0, sizeof(buffers));
+        seq[0].store(0);
+        seq[1].store(0);
+        front.store(0);
+        writing = 1;
+    }
+
+    // Starts a new snapshot, initialised with the last published one so stale boards keep their values
+    PackSnapshot &beginWrite()
+    {
+        uint8_t f = front.load(std::memory_order_relaxed);
+        writing = f ^ 1;
+        seq[writing].store(seq[writing].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); // Odd
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(&buffers[writing], &buffers[f], sizeof(PackSnapshot));
+        return buffers[writing];
+    }
+
+    // Makes the snapshot started with beginWrite() visible to the readers
+    void publish()
+    {
+        seq[writing].store(seq[writing].load(std::memory_order_relaxed) + 1, std::memory_order_release); // Even
+        front.store(writing, std::memory_order_release);
+    }
+
+    // Calls func(const PackSnapshot &) on a coherent snapshot. func may run again if the
+    // writer overtook it, so it must only read the snapshot and keep its results in locals
+    template <typename Func>
+    void read(Func func) const
+    {
+        for (;;)
+        {
+            uint8_t f = front.load(std::memory_order_acquire);
+            uint32_t s = seq[f].load(std::memory_order_acquire);
+            if (s & 1)
+                continue;
+            func(buffers[f]);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq[f].load(std::memory_order_relaxed) == s)
+                return;
+        }
+    }
+
+    // Sequence number of the last published snapshot
+    uint32_t lastSequence() const { return buffers[front.load(std::memory_order_acquire)].sequence; }
+
+private:
+    PackSnapshot buffers[2];
+    std::atomic<uint32_t> seq[2];
+    std::atomic<uint8_t> front;
+    uint8_t writing;
+};
+
+#endif
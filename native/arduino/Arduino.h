@@ -0,0 +1,192 @@
+//********NATIVE ARDUINO SHIM
+// Just enough of the Arduino core and FreeRTOS to build the CAN libraries on the host ([env:native]).
+// Time is virtual: it only moves with delay(), delayMicroseconds() and simAdvance(), so a simulation
+// runs as fast as the host allows and always gives the same result.
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <type_traits>
+#include <stdarg.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+using std::max;
+using std::min;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define FALLING 2
+#define DEC 10
+#define HEX 16
+#define BIN 2
+#define IRAM_ATTR
+#define F(s) (s)
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+//** TIME **//
+inline uint64_t &simClock()
+{
+    static uint64_t us = 0;
+    return us;
+}
+inline void simAdvance(uint64_t us) { simClock() += us; }
+inline unsigned long micros() { return (unsigned long)(uint32_t)simClock(); }
+inline unsigned long millis() { return (unsigned long)(uint32_t)(simClock() / 1000); }
+inline void delay(unsigned long ms) { simAdvance((uint64_t)ms * 1000); }
+inline void delayMicroseconds(unsigned int us) { simAdvance(us); }
+inline void yield() {}
+
+//** GPIO: no hardware, every line idle (high) **//
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return HIGH; }
+inline int digitalPinToInterrupt(int pin) { return pin; }
+inline void attachInterrupt(uint8_t, void (*)(void), int) {}
+inline void attachInterruptArg(uint8_t, void (*)(void *), void *, int) {}
+inline void detachInterrupt(uint8_t) {}
+
+//** STRING **//
+class String : public std::string
+{
+public:
+    String() {}
+    String(const char *s) : std::string(s ? s : "") {}
+    String(const std::string &s) : std::string(s) {}
+    String(char c) : std::string(1, c) {}
+    String(unsigned char v, int base = DEC) : std::string(number(v, base)) {}
+    String(int v, int base = DEC) : std::string(base == DEC ? std::to_string(v) : number((unsigned long)v, base)) {}
+    String(unsigned v, int base = DEC) : std::string(number(v, base)) {}
+    String(long v, int base = DEC) : std::string(base == DEC ? std::to_string(v) : number((unsigned long)v, base)) {}
+    String(unsigned long v, int base = DEC) : std::string(number(v, base)) {}
+    String(long long v) : std::string(std::to_string(v)) {}
+    String(unsigned long long v) : std::string(std::to_string(v)) {}
+    String(double v, int decimals = 2)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.*f", decimals, v);
+        assign(buf);
+    }
+    String(float v, int decimals = 2) : String((double)v, decimals) {}
+    String(bool v) : std::string(v ? "1" : "0") {}
+
+    template <typename T>
+    friend String operator+(const String &a, const T &b)
+    {
+        return String(static_cast<const std::string &>(a) + static_cast<const std::string &>(String(b)));
+    }
+
+    static std::string number(unsigned long long v, int base)
+    {
+        char buf[72];
+        int n = sizeof(buf) - 1;
+        buf[n] = 0;
+        do
+        {
+            buf[--n] = "0123456789ABCDEF"[v % base];
+            v /= base;
+        } while (v);
+        return std::string(buf + n);
+    }
+};
+
+//** SERIAL: stdout. Other ports (the BQ79606 UART) discard what is written and return what simReceive() queued **//
+class Print
+{
+public:
+    size_t print(const String &s) { return fwrite(s.data(), 1, s.size(), stdout); }
+    size_t print(const char *s) { return print(String(s)); }
+    size_t print(char c) { return print(String(c)); }
+    size_t print(double v, int decimals = 2) { return print(String(v, decimals)); }
+    template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+    size_t print(T v, int base = DEC)
+    {
+        return print(base == DEC ? String(v) : String(String::number((unsigned long long)v, base)));
+    }
+    template <typename T>
+    size_t println(const T &v) { return print(v) + println(); }
+    template <typename T>
+    size_t println(T v, int base) { return print(v, base) + println(); }
+    size_t println() { return print("\n"); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t write(uint8_t c) { return fputc(c, stdout) != EOF; }
+    size_t write(const uint8_t *buf, size_t n) { return fwrite(buf, 1, n, stdout); }
+
+};
+
+inline size_t Print::printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n > 0 ? n : 0;
+}
+
+#define SERIAL_8N1 0x800001c
+class HardwareSerial : public Print
+{
+public:
+    HardwareSerial(int _port = 0) : port(_port) {}
+    void begin(unsigned long, uint32_t = 0, int8_t = -1, int8_t = -1) {}
+    void end() {}
+    void setTimeout(unsigned long) {}
+    int available() { return rx.size() - rxPos; }
+    int read() { return available() ? rx[rxPos++] : -1; }
+    size_t readBytes(uint8_t *buf, size_t n)
+    {
+        n = min(n, (size_t)available());
+        memcpy(buf, rx.data() + rxPos, n);
+        rxPos += n;
+        return n;
+    }
+    size_t write(uint8_t c) { return port ? 1 : Print::write(c); }
+    size_t write(const uint8_t *buf, size_t n) { return port ? n : Print::write(buf, n); }
+    void flush() { fflush(stdout); }
+    operator bool() { return true; }
+
+    // Bytes the next reads return, as if a device had answered
+    void simReceive(const uint8_t *data, size_t n)
+    {
+        rx.erase(rx.begin(), rx.begin() + rxPos);
+        rxPos = 0;
+        rx.insert(rx.end(), data, data + n);
+    }
+
+private:
+    int port;
+    std::vector<uint8_t> rx;
+    size_t rxPos = 0;
+};
+inline HardwareSerial Serial;
+
+//** FREERTOS: one thread, locks and notifications do nothing **//
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+#define pdFALSE 0
+#define pdTRUE 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) (ms)
+#define portYIELD_FROM_ISR(x) (void)(x)
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return nullptr; }
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return nullptr; }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t) { return pdTRUE; }
+inline void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t *) {}
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdTRUE; }
+
+#endif
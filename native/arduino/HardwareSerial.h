@@ -0,0 +1,8 @@
+//********NATIVE HARDWARESERIAL SHIM
+// HardwareSerial lives in Arduino.h, this header only exists for the libraries that include it
+#ifndef NATIVE_HARDWARESERIAL_H
+#define NATIVE_HARDWARESERIAL_H
+
+#include "Arduino.h"
+
+#endif
@@ -0,0 +1,26 @@
+//********NATIVE SPI SHIM
+// No SPI devices on the host: transfers read back 0xFF (nothing answering on MISO)
+#ifndef NATIVE_SPI_H
+#define NATIVE_SPI_H
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+struct SPISettings
+{
+    SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+class SPIClass
+{
+public:
+    void begin(int8_t = -1, int8_t = -1, int8_t = -1, int8_t = -1) {}
+    void beginTransaction(SPISettings) {}
+    void endTransaction() {}
+    uint8_t transfer(uint8_t) { return 0xFF; }
+};
+inline SPIClass SPI;
+
+#endif
@@ -1,22 +1,182 @@
 #include <Arduino.h>
 //#include <BQ79606.h>
 #include "BQ79606.h"
-
+#include "BQ_Link.h"
+#include "BQ_ADC.h"
+#include "BQ_Temp.h"
+#include "PackSnapshot.h"
+#include "BQ_SoC.h"
+#include "MART_CAN.h"
+#include "CAN_Manager.h"
+#include "CAN_Trace.h"
+#include "CAN_IsoTp.h"
+#include "CAN_Uds.h"
+#include "BQ_Queue.h"
+#include "CAN_Ota.h"
+#include "OTA_Partition.h"
+#include "ConfigStore.h"
+#include "BQ_Cal.h"
+#include "BQ_Bist.h"
+#include "BQ_OpenWire.h"
+#include "BQ_Power.h"
+#include "BQ_Shadow.h"
+
+//#define CAN_USE_TWAI            //vehicle bus on the on-chip TWAI controller instead of the MCP2515
+#ifdef CAN_USE_TWAI
+#include "CAN_TWAI.h"
+#endif
+#include "spscQueue.h"
+#include "latencyHistogram.h"
+
+#define CELL_OV_CODE 22021   //4.2 V / 190.73 uV
+
+//Factory values below, each node may have its own in NVS (ConfigStore, DID_NODE_CONFIG)
+
+#define CAN_CS          10      //MCP2515 chip select
+#define CAN_INT         21      //MCP2515 interrupt line
+#define CAN_TWAI_TX     4       //TWAI pins to the transceiver
+#define CAN_TWAI_RX     5
+#define CAN_NODE_ID     1
+#define CAN_KBPS        500
+#define CAN_CURRENT_ID  0x3C2   //Pack current from the current sensor, int32 mA (positive charging)
+#define CAN_SOC_ID      0x400   //SoC packets: 0x400 pack, 0x401.. one per board
+#define CAN2_CS         9       //Charger bus MCP2515, same SPI host
+#define CAN2_INT        14
+#define CAN2_NODE_ID    2
+#define CHARGER_STATUS_ID 0x18FF50E5 //Charger status, forwarded to the vehicle bus
+#define CAN_TRACE_SIZE  512     //Last frames of the vehicle bus, 't' on the serial port dumps them (candump -l)
+//#define CAN_TRACE_FILE  "/can.trc"  //Streams the trace to LittleFS instead (binary TraceRecords)
+#define CAN_TRACE_FILE_MAX 262144   //Bytes before the file is rotated to CAN_TRACE_FILE ".1"
+#ifdef CAN_TRACE_FILE
+#include <LittleFS.h>
+#endif
+#define CAN_DIAG_RX_ID  0x7E0   //UDS requests from the tester (ISO-TP)
+#define CAN_DIAG_TX_ID  0x7E8   //UDS responses
+#define DID_PACK_SNAPSHOT 0x0100 //ReadDataByIdentifier: the whole PackSnapshot
+#define DID_NODE_CONFIG  0x0200  //Read/WriteDataByIdentifier: schema (2 bytes) + NodeConfig, applied at the next boot
+#define DID_BIST_RESULT  0x0201  //Read: last comparator BIST of the stack, Write (any byte): run one in the next idle scan
+#define DID_OPEN_WIRE    0x0202  //Read: last open wire check, Write (any byte): run one in the next idle scan
+#define CAN_TELEMETRY_MS 100
+#define CAN_RX_BURST     16      //frames handled per wake up
+#define RESET_TX_TIMEOUT_MS 50   //ECUReset: longest wait for the response to be sent
+
+#define SCAN_PERIOD_MS    100
+#define PARKED_SCAN_PERIOD_MS 5000 //Scan period while parked, stack and ESP32 asleep in between
+#define BIST_PERIOD_MS    60000 //OV/UV and OT/UT comparator self-test of the whole stack
+#define OPEN_WIRE_PERIOD_MS 60000 //Sense wire check, delays one scan by about 30 ms
+#define ACQ_TASK_STACK    8192
+#define ACQ_TASK_PRIORITY 3
+#define CAN_TASK_STACK    8192
+#define CAN_TASK_PRIORITY 4
+#define OTA_TASK_STACK    4096
+#define OTA_TASK_PRIORITY 2   //below the CAN task on core 0: blocks keep arriving while the flash is busy
+
+void ConfigureStack();
+void AcquisitionTask(void *parameter);
+void CanTask(void *parameter);
+void OtaTask(void *parameter);
+void ResetForUpdate();
+uint16_t ReadSnapshotDid(uint8_t *buf, uint16_t max);
+uint16_t ReadConfigDid(uint8_t *buf, uint16_t max);
+uint8_t WriteConfigDid(const uint8_t *data, uint16_t len);
+uint16_t ReadBistDid(uint8_t *buf, uint16_t max);
+uint8_t WriteBistDid(const uint8_t *data, uint16_t len);
+uint16_t ReadOpenWireDid(uint8_t *buf, uint16_t max);
+uint8_t WriteOpenWireDid(const uint8_t *data, uint16_t len);
+
+//What the stack measures on every scan
+const AdcPlan adcPlan = {
+  0x3F,   //cells: all 6
+  0x3F,   //gpios: all 6
+  0x3F,   //ratiometric: all GPIOs are thermistors
+  false,  //bat
+  256,    //cellDecimation
+  256,    //auxDecimation
+  7,      //cellLPF: 1.2 Hz (VCELLx_HF/LF, read instead of VCELLxH/L when nodeConfig.cellFiltered)
+  true,   //continuous
+  0       //interval: minimum
+};
+
+AdcSequencer adc;
+CellCalibration cellCal;                    //Per cell gain/offset from the configuration, checked with the AUX ADC
+BistRunner bist;                            //Comparator self-test, in the spare time of the scans
+OpenWireCheck openWire;                     //Broken sense wires, pull down/pull up measurements
+PowerManager power;                         //Parked mode: slow scans, stack in SLEEP and ESP32 in light sleep
+RegisterShadow regShadow;                   //Configuration registers of every device, as last written or read
+
+//Configuration until one is written to NVS
+const NodeConfig factoryConfig = {
+  0x53,             //uvThresh: 2.8 V
+  0x5B,             //ovThresh: 4.3 V
+  CELL_OV_CODE,     //cellOvCode
+  CAN_NODE_ID,      //canNodeId
+  CAN_KBPS,         //canKbps
+  CAN_CURRENT_ID,   //canCurrentId
+  CAN_SOC_ID,       //canSocId
+  CAN_DIAG_RX_ID,   //diagRxId
+  CAN_DIAG_TX_ID,   //diagTxId
+  {},               //cellOffset: none
+  {},               //cellGain: none
+  0,                //cellFiltered: corrected registers, not the filtered ones
+  CAL_AUX_TOLERANCE //auxTolerance
+};
+
+ConfigStore configStore;
+const NodeConfig &nodeConfig = configStore.get();   //read from NVS once, at the start of setup()
+
+SnapshotPublisher packData;                 //Last coherent measurement of the whole pack
+
+LinkSupervisor bqLink(ConfigureStack);     //Recovers the daisy chain when boards stop answering
+
+SocEstimator socEngine;                     //Per cell SoC, updated once per scan
+
+#ifdef CAN_USE_TWAI
+TwaiBackend twai(CAN_TWAI_TX, CAN_TWAI_RX);
+CAN_BUS can(twai);
+#else
+CAN_BUS can(&SPI, CAN_CS, CAN_INT);
+#endif
+CAN_BUS charger(&SPI, CAN2_CS, CAN2_INT);     //both controllers are started in setup(), after Serial
+CanManager canBuses;                         //Both MCP2515s: locking, merged INT lines and gateway
+#ifdef CAN_TRACE_FILE
+CanTrace canTrace(CAN_TRACE_SIZE);           //Drained to flash by loop()
+#else
+CanTrace canTrace(CAN_TRACE_SIZE, true);     //Flight recorder: keeps the last frames
+#endif
+
+IsoTp diag(can);                             //Large transfers on the vehicle bus
+BqTransactionQueue bqQueue;                  //CAN task -> acquisition task: register reads for the diagnostics
+UdsServer uds(diag, bqQueue);
+OtaPartitionSink otaSink;                    //Firmware images from the tester go to the inactive OTA partition
+CanOta ota(otaSink);
+
+TaskHandle_t acqTaskHandle = nullptr, canTaskHandle = nullptr, otaTaskHandle = nullptr;
+SpscQueue<int32_t, 8> currentQueue;          //CAN task -> acquisition task: pack current samples
+LatencyHistogram canLatency, scanLatency;
+volatile bool metricsRequested = false;      //'m' on the serial port, printed by the CAN task
 
 
 void setup() {
 
  bool ok=false;
   Ini_ESP();
+  configStore.begin(factoryConfig);
+  configStore.print();
+  cellCal.begin(nodeConfig.cellGain, nodeConfig.cellOffset, nodeConfig.auxTolerance);
+  bist.begin(BIST_PERIOD_MS);
+  bist.request();                                       //first one right after the first scans
+  openWire.begin(adc, adcPlan.continuous, OPEN_WIRE_PERIOD_MS);
+  openWire.request();
+  power.begin(adc, adcPlan.continuous);
 
   
   while(!ok)
   {
     Wake79606();
-    CommReset(BAUDRATE);
-    ok= AutoAddress();
+    ok= (NegotiateBaud(BAUDRATE) != 0) && AutoAddress(100, 0, true);  //readdressing from the link supervisor stays quiet
   }
 
+  Serial.println((String)"Baudrate: "+dwBaudRate);
   Serial.print("Addres: ");
 	delay(10);
 
@@ -37,57 +197,299 @@ void setup() {
 
 	}
 
-  InitDevices();
-
-  WriteReg(0, SYSFLT1_FLT_RST, 0xFFFFFF, 3, FRMWRT_ALL_NR);   //reset system faults
-  WriteReg(0, SYSFLT1_FLT_MSK, 0xFFFFFF, 3, FRMWRT_ALL_NR);
-  WriteReg(0, CONTROL2, 0x10, 1, FRMWRT_ALL_NR);          //tsref activo
+  regShadow.attach();                                   //from here on every register write is recorded
+  bqQueue.setShadow(&regShadow);
+  ConfigureStack();
+
+  if(!can.begin(nodeConfig.canNodeId, nodeConfig.canKbps)) Serial.println("Error iniciando el controlador CAN del vehiculo");
+  if(!charger.begin(CAN2_NODE_ID, CAN_KBPS)) Serial.println("Error iniciando el MCP2515 del cargador");
+  const unsigned long canInIds[] = {nodeConfig.canCurrentId};
+  can.setFilters(canInIds, sizeof(canInIds)/sizeof(canInIds[0]));
+  can.DataIN.setRemovableIds(canInIds, sizeof(canInIds)/sizeof(canInIds[0]));   //read once: only a new frame is stored again
+  uds.begin(nodeConfig.diagTxId, nodeConfig.diagRxId);
+  uds.addDataIdentifier(DID_PACK_SNAPSHOT, ReadSnapshotDid);
+  uds.addDataIdentifier(DID_NODE_CONFIG, ReadConfigDid, WriteConfigDid);
+  uds.addDataIdentifier(DID_BIST_RESULT, ReadBistDid, WriteBistDid);
+  uds.addDataIdentifier(DID_OPEN_WIRE, ReadOpenWireDid, WriteOpenWireDid);
+  uds.setDownload(&ota);                                //RequestDownload/TransferData/RequestTransferExit, then ECUReset
+  uds.setResetHandler(ResetForUpdate);
+  can.setIsoTp(&diag);
+  can.config.sendStatusData = true;                     //bus load, error counters and frame counts every second
+
+  canBuses.addController(can);                          //index 0: vehicle bus
+  canBuses.addController(charger);                      //index 1: charger bus
+  canBuses.addGatewayRule({1, 0, CHARGER_STATUS_ID, 0x1FFFFFFF, 0});
+  can.setTrace(&canTrace, 0);
+  power.addWakePin(can.controller.interruptPin());      //any frame on either bus ends the light sleep
+  power.addWakePin(charger.controller.interruptPin());
+#ifdef CAN_TRACE_FILE
+  if(!LittleFS.begin(true)) Serial.println("LittleFS no disponible, la traza CAN no se guarda");
+#endif
+
+  delay(adc.getConversionTime()/1000+1);                //waiting for first ADC conversion to complete
+  if(cellCal.validate(adc.getConversionTime())) Serial.println("Calibracion fuera de tolerancia respecto al ADC AUX");
+  cellCal.print();
+
+  //BMS acquisition and protection on core 1, CAN on core 0 (loop() stays on core 1 at priority 1, printing)
+  xTaskCreatePinnedToCore(CanTask, "CAN", CAN_TASK_STACK, nullptr, CAN_TASK_PRIORITY, &canTaskHandle, 0);
+  xTaskCreatePinnedToCore(AcquisitionTask, "BMS", ACQ_TASK_STACK, nullptr, ACQ_TASK_PRIORITY, &acqTaskHandle, 1);
+  xTaskCreatePinnedToCore(OtaTask, "OTA", OTA_TASK_STACK, nullptr, OTA_TASK_PRIORITY, &otaTaskHandle, 0);
+  canBuses.setTaskToNotify(canTaskHandle);
+  ota.setWriterTask(otaTaskHandle);
+  
   
-  //SET UP MAIN ADC
-  WriteReg(0, CELL_ADC_CTRL, 0x3F, 1, FRMWRT_ALL_NR);     //enable conversions for all cells
-  WriteReg(0, CELL_ADC_CONF2, 0x08, 1, FRMWRT_ALL_NR);    //set continuous ADC conversions, and set minimum conversion interval
+//Serial2.println("OK");*/
+}
+
+//ACQUISITION TASK (core 1): daisy chain reads, SoC and protection. The UART waits of the
+//BQ79606 only delay this task, the CAN task keeps answering on the other core
+void AcquisitionTask(void *parameter)
+{
+  static byte stack_frame[(MAXBYTES+6)*TOTALBOARDS];
+  int Bytesleidos = 0;
+  TickType_t lastWake = xTaskGetTickCount();
+
+  for(;;)
+  {
+    //parked: the tick count stops in light sleep, the period starts again from the wake up.
+    //A BIST started in the wake up scan finishes at the full scan rate before the stack sleeps again
+    if(power.isParked() && !bist.isRunning() && power.sleep(PARKED_SCAN_PERIOD_MS)) lastWake = xTaskGetTickCount();
+    else vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(SCAN_PERIOD_MS));
+
+    if(!adcPlan.continuous){
+      adc.start();
+      vTaskDelay(pdMS_TO_TICKS(adc.getConversionTime()/1000+1));
+    }
+
+    //last current received by the CAN task
+    int32_t current;
+    while(currentQueue.pop(current)){
+      socEngine.setCurrent(current);
+      power.setCurrent(current);
+    }
+
+    unsigned long tScan = micros();
+
+    //at most one recovery step per scan while the daisy chain is not answering. Readdressing and
+    //reconfiguring take ~100 ms each with 16 boards and go in different scans; meanwhile the
+    //devices keep their own OV/UV comparators from the last configuration
+    if(bqLink.update()){
+      //one stack read per quantity, decoded straight into the next snapshot. ReadReg fails the whole
+      //read if any board fails; the boards that did answer are decoded, the others stay stale
+      PackSnapshot &snap = packData.beginWrite();
+      beginScan(snap);
+
+      Bytesleidos = ReadReg(0, nodeConfig.cellFiltered ? VCELL1_HF : VCELL1H, stack_frame, MAXBYTES, 0, FRMWRT_ALL_R);
+      bqLink.reportStack(Bytesleidos);
+      decodeCellStack(snap, stack_frame, dwTimeoutMask | dwCRCFaultMask);
+
+      Bytesleidos = ReadReg(0, AUX_GPIO1H, stack_frame, MAXBYTES, 0, FRMWRT_ALL_R);
+      bqLink.reportStack(Bytesleidos);
+      decodeGPIOStack(snap, stack_frame, dwTimeoutMask | dwCRCFaultMask);
+
+      if(adcPlan.bat){
+        Bytesleidos = ReadReg(0, AUX_BATH, stack_frame, 2, 0, FRMWRT_ALL_R);
+        bqLink.reportStack(Bytesleidos);
+        decodeBATStack(snap, stack_frame, dwTimeoutMask | dwCRCFaultMask);
+      }
 
-  WriteReg(0, GPIO1_CONF, 0x20, 1, FRMWRT_ALL_NR);       //GPIO is an input
-  WriteReg(0, GPIO2_CONF, 0x20, 1, FRMWRT_ALL_NR);       //GPIO is an input
-  WriteReg(0, GPIO3_CONF, 0x20, 1, FRMWRT_ALL_NR);       //GPIO is an input
-  WriteReg(0, GPIO4_CONF, 0x20, 1, FRMWRT_ALL_NR);       //GPIO is an input
-  WriteReg(0, GPIO5_CONF, 0x20, 1, FRMWRT_ALL_NR);       //GPIO is an input
-  WriteReg(0, GPIO6_CONF, 0x20, 1, FRMWRT_ALL_NR);       //GPIO is an input
+      //one cell position checked against the AUX ADC, the next one selected for the following scan
+      bqLink.reportStack(cellCal.rotate(snap));
 
-  WriteReg(0, AUX_ADC_CTRL1, 0xF0, 1, FRMWRT_ALL_NR);       //GPIO is an input
-  WriteReg(0, AUX_ADC_CTRL2, 0x03, 1, FRMWRT_ALL_NR);       //GPIO is an input
+      endScan(snap);
+      socEngine.update(snap);                 //coulomb counting plus voltage correction, on the snapshot being written
 
+      //PROTECTION
+      if((snap.numCells > 0) && (snap.maxCell >= nodeConfig.cellOvCode)){
+        digitalWrite(BMS_OK, LOW);
+      }
 
-  WriteReg(0, CONTROL2, 0x13, 1, FRMWRT_ALL_NR);          //CELL_ADC_GO = 1 Y tsref y AUX_ADC_GO = 1
+      packData.publish();
+    }
 
+    scanLatency.record(micros() - tScan);
 
-  delay(3*TOTALBOARDS+901);                             //3us of re-clocking delay per board + 901us waiting for first ADC conversion to complete
-  
-  
-//Serial2.println("OK");*/
+    //diagnostic register reads, a few per scan with a short timeout
+    unsigned served = bqQueue.serve(BQ_TXN_PER_SCAN, bqLink);
+
+    //self-test: one access per scan, only started when no diagnostic read used this one
+    bist.step(served == 0, bqLink);
+
+    //open wire check, blocking but bounded: never in the same scan as a diagnostic read or a BIST access
+    openWire.step((served == 0) && !bist.isRunning(), bqLink);
+
+    //full scan rate while a tester is using the stack or the diagnostics (also a multi-frame response of a
+    //local DID) or a download is running; the periodic self-tests are not activity, they run in the parked wake ups
+    power.update((served > 0) || uds.isBusy() || ota.isBusy() || !bqLink.isUp());
+  }
 }
 
-void loop() {
-    delay(10);
-    //VARIABLES
-    byte response_frame[(MAXBYTES+6)];
-    byte response_frame2[(MAXBYTES+6)];
-    int currentBoard = 0;
-    int Bytesleidos = 0;
-    int i = 0;
+//DID_PACK_SNAPSHOT: last published snapshot, copied straight into the UDS response
+uint16_t ReadSnapshotDid(uint8_t *buf, uint16_t max)
+{
+  if(max < sizeof(PackSnapshot)) return 0;
+  packData.read([buf](const PackSnapshot &snap){ memcpy(buf, &snap, sizeof(snap)); });
+  return sizeof(PackSnapshot);
+}
+
+//DID_NODE_CONFIG: the configuration loaded at boot
+uint16_t ReadConfigDid(uint8_t *buf, uint16_t max)
+{
+  if(max < 2 + sizeof(NodeConfig)) return 0;
+  buf[0] = CONFIG_SCHEMA >> 8;
+  buf[1] = CONFIG_SCHEMA & 0xFF;
+  memcpy(buf + 2, &nodeConfig, sizeof(NodeConfig));
+  return 2 + sizeof(NodeConfig);
+}
+
+//Saved from the CAN task: one NVS write of a few hundred bytes, only when the tester sends a new configuration
+uint8_t WriteConfigDid(const uint8_t *data, uint16_t len)
+{
+  if(len != 2 + sizeof(NodeConfig)) return UDS_NRC_INCORRECT_LENGTH;
+  if(((data[0] << 8) | data[1]) != CONFIG_SCHEMA) return UDS_NRC_REQUEST_OUT_OF_RANGE;
+  NodeConfig cfg;
+  memcpy(&cfg, data + 2, sizeof(cfg));
+  if(!ConfigStore::isValid(cfg)) return UDS_NRC_REQUEST_OUT_OF_RANGE;   //a node ID, bit rate or diag ID that would lose the node
+  return configStore.save(cfg) ? 0 : UDS_NRC_PROGRAMMING_FAILURE;
+}
+
+//DID_BIST_RESULT: runs, failed runs, pass/fail/missing masks (big endian), then OVUV/OTUT_BIST_FAULT of each board
+uint16_t ReadBistDid(uint8_t *buf, uint16_t max)
+{
+  if(max < 20 + 2*TOTALBOARDS) return 0;
+  const uint32_t words[5] = {(uint32_t)bist.numRuns, (uint32_t)bist.numFailedRuns, bist.passMask, bist.failMask, bist.missingMask};
+  for(int i=0; i<5; i++)
+    for(int j=0; j<4; j++) buf[4*i+j] = words[i] >> (24 - 8*j);
+  for(int b=0; b<TOTALBOARDS; b++){
+    buf[20 + 2*b] = bist.ovuvFault[b];
+    buf[21 + 2*b] = bist.otutFault[b];
+  }
+  return 20 + 2*TOTALBOARDS;
+}
+
+uint8_t WriteBistDid(const uint8_t *data, uint16_t len)
+{
+  if(len != 1) return UDS_NRC_INCORRECT_LENGTH;
+  bist.request();
+  return 0;
+}
+
+//DID_OPEN_WIRE: checks, detections, boards with an open wire, missing boards (big endian), then the open wires of each board
+uint16_t ReadOpenWireDid(uint8_t *buf, uint16_t max)
+{
+  if(max < 16 + TOTALBOARDS) return 0;
+  const uint32_t words[4] = {(uint32_t)openWire.numRuns, (uint32_t)openWire.numDetections, openWire.boardMask, openWire.missingMask};
+  for(int i=0; i<4; i++)
+    for(int j=0; j<4; j++) buf[4*i+j] = words[i] >> (24 - 8*j);
+  memcpy(buf + 16, openWire.openMask, TOTALBOARDS);
+  return 16 + TOTALBOARDS;
+}
+
+uint8_t WriteOpenWireDid(const uint8_t *data, uint16_t len)
+{
+  if(len != 1) return UDS_NRC_INCORRECT_LENGTH;
+  openWire.request();
+  return 0;
+}
+
+//CAN TASK (core 0): receives, answers RRFs and sends the telemetry of the last published snapshot
+void CanTask(void *parameter)
+{
+  unsigned long lastTelemetry = 0;
+  uint32_t lastSequence = 0;
+
+  for(;;)
+  {
+    //woken by any MCP2515 INT line, or every ms to keep the periodic packets going
+    bool notified = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1)) > 0;
+
+    //INT also signals errors; receive() clears them, the burst limit keeps a busy bus from starving the other
+    if(canBuses.dispatch(CAN_RX_BURST) > 0){
+      if(notified) canLatency.record(micros() - canBuses.lastInterruptTime);   //INT edge to RX handled, RRFs answered and frames forwarded
+
+      //the current packet is removed when read, it is only there again if a new frame arrived
+      int current[1];
+      if((can.DataIN.indexOf(nodeConfig.canCurrentId) >= 0) && can.getPacket((unsigned long)nodeConfig.canCurrentId, current))
+        currentQueue.push(current[0]);
+    }
+
+    uds.update();                               //register reads come back from the acquisition task
+    diag.update();                              //consecutive frames at the pace the tester asked for
+
+    if(millis() - lastTelemetry >= CAN_TELEMETRY_MS){
+      lastTelemetry = millis();
+      if(packData.lastSequence() != lastSequence){
+        packData.read([&](const PackSnapshot &snap){
+          SocEstimator::publish(can, snap, nodeConfig.canSocId);
+          lastSequence = snap.sequence;
+        });
+      }
+      can.send();                               //also the status frames and the metrics sampling
+      charger.send();
+    }
+
+    if(metricsRequested){
+      metricsRequested = false;
+      can.printMetrics();
+      canBuses.printStatus();
+      diag.printStatus();
+      uds.printStatus();
+      ota.printStatus();
+      configStore.print();
+    }
+  }
+}
 
-    //reset variables
-        memset(response_frame, 0, sizeof(response_frame));
-        i = 0;
-        currentBoard=0;
+//OTA TASK (core 0): programs the blocks the CAN task has buffered. Flash writes stop the cache on both
+//cores for a few ms, the acquisition only notices it as a late scan
+void OtaTask(void *parameter)
+{
+  for(;;)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));   //a new block, or once a second for the inactivity timeout
+    while(ota.service()){}
+  }
+}
 
-        
+//ECUReset from the tester, after its response; the new image boots if the download was accepted.
+//Refused by the UDS server while the image is being checked
+void ResetForUpdate()
+{
+  digitalWrite(BMS_OK, LOW);                  //contactor open on purpose, the pins float during the restart
 
-        WriteReg(0, CONTROL2, 0x13, 1, FRMWRT_ALL_NR);
+  unsigned long tStart = millis();            //the positive response still has to leave the controller
+  while(!can.txIdle() && (millis() - tStart < RESET_TX_TIMEOUT_MS)) delay(1);
+  ESP.restart();
+}
 
+//loop() only prints, at the lowest priority
+void loop() {
         delay(2000);
 
-        
+        while(Serial.available()){
+          char c = Serial.read();
+          if(c == 'm') metricsRequested = true;
+#ifndef CAN_TRACE_FILE
+          if(c == 't'){
+            canTrace.stop();                      //the CAN task keeps running, nothing is recorded while dumping
+            canTrace.exportCandump(Serial);
+            canTrace.start();
+          }
+#endif
+        }
+
+#ifdef CAN_TRACE_FILE
+        File traceFile = LittleFS.open(CAN_TRACE_FILE, FILE_APPEND);
+        if(traceFile){
+          canTrace.flush(traceFile);
+          bool full = traceFile.size() > CAN_TRACE_FILE_MAX;
+          traceFile.close();
+          if(full){
+            LittleFS.remove(CAN_TRACE_FILE ".1");
+            LittleFS.rename(CAN_TRACE_FILE, CAN_TRACE_FILE ".1");
+          }
+        }
+#endif
 
         /*
          * ***********************************************
@@ -97,66 +499,67 @@ void loop() {
          * IS NOT GUARANTEED TO WORK ON ALL SYSTEMS.
          * ***********************************************
         */
-        
-        if(Bytesleidos == -1){
-          Serial.println("No se ha podido leer los datos, se ha excedido el tiempo");
-          //delay(1000);
+
+        if(!bqLink.isUp()){
+          Serial.println("No se ha podido leer los datos, recuperando la comunicacion");
         }
-        else{
-
-        
-          //PARSE, FORMAT, AND PRINT THE DATA
-          for(currentBoard = 0; currentBoard<TOTALBOARDS; currentBoard++)
-          {   
-              memset(response_frame, 0, sizeof(response_frame));
-              memset(response_frame2, 0, sizeof(response_frame));
-              //read back data (6 cells and 2 bytes each cell)
-              Bytesleidos = ReadReg(currentBoard, VCELL1H, response_frame, MAXBYTES, 0, FRMWRT_SGL_R);
-              Bytesleidos = ReadReg(currentBoard, AUX_GPIO1H, response_frame2, MAXBYTES, 0, FRMWRT_SGL_R);
-              //response frame actually starts with top of stack, so currentBoard is actually inverted from what it should be
-              Serial.println((String)"Num board= "+currentBoard);
-
-              //go through each byte in the current board (12 bytes = 6 cells * 2 bytes each)
-              for(i=0; i<12; i+=2)
-              {
-                //each board responds with 32 data bytes + 6 header bytes
-                //so need to find the start of each board by doing that * currentBoard
-
-
-                //convert the two individual bytes of each cell into a single 16 bit data item (by bit shifting)
-                uint16_t rawData = (response_frame[i+4] << 8) | response_frame[i+5];
-
-                //do the two's complement of the resultant 16 bit data item, and multiply by 190.73uV to get an actual voltage
-                float cellVoltage = Complement(rawData,0.00019073);
-                
-                if(cellVoltage >= 4.2){
-                  digitalWrite(BMS_OK, LOW);
-                  Serial.println("Fallo de tensión");
-                }
-                //print the voltages - it is i/2 because cells start from 1 up to 6
-                //and there are 2 bytes per cell (i value is twice the cell number),
-                //and it's +1 because cell names start with "Cell1"
-                Serial.println((String)"Cell " +(i/2)+" voltage= " +cellVoltage);
-              }
-
-
-              //go through each byte in the current board (12 bytes = 6 GPIO * 2 bytes each)
-              for(i=0; i<12; i+=2)
-              {
-                //each board responds with 32 data bytes + 6 header bytes
-
-                //convert the two individual bytes of each cell into a single 16 bit data item (by bit shifting)
-                uint16_t rawData = (response_frame2[i+4] << 8) | response_frame2[i+5];
-
-                //do the two's complement of the resultant 16 bit data item, and multiply by 190.73uV to get an actual voltage
-                float GPIOVoltage = Complement(rawData,0.00019073);
-
-                //print the voltages - it is i/2 because cells start from 1 up to 6
-                //and there are 2 bytes per cell (i value is twice the cell number),
-                //and it's +1 because cell names start with "Cell1"
-                Serial.println((String)"GPIO " +(i/2)+" Voltage= " +GPIOVoltage);
-              }
-          }
-      }
 
+        //PARSE, FORMAT, AND PRINT THE DATA (last good values, flagged if stale)
+        //copied first: printing takes longer than a scan, read() would run it again
+        PackSnapshot snap;
+        packData.read([&snap](const PackSnapshot &last){ snap = last; });
+
+        if((snap.numCells > 0) && (snap.maxCell >= nodeConfig.cellOvCode)){
+          Serial.println("Fallo de tensión");
+        }
+
+        Serial.println((String)"Scan " + snap.sequence + " min cell= " + Complement(snap.minCell,0.00019073) +
+                       " max cell= " + Complement(snap.maxCell,0.00019073) + " max temp= " + (snap.maxTemp/10.0));
+        SocEstimator::printSoC(snap);
+
+        for(int currentBoard = 0; currentBoard<TOTALBOARDS; currentBoard++)
+        {
+            Serial.println((String)"Num board= "+currentBoard+(((snap.cellValid >> currentBoard) & 1) ? "" : " (stale)")+
+                           (snap.cellDrift[currentBoard] ? (String)" AUX drift 0x"+String(snap.cellDrift[currentBoard], HEX) : ""));
+
+            for(int i=0; i<CELLS_PER_BOARD; i++)
+            {
+              //two's complement code times 190.73uV to get an actual voltage
+              float cellVoltage = Complement(snap.cellCode[currentBoard][i],0.00019073);
+              Serial.println((String)"Cell " +i+" voltage= " +cellVoltage);
+            }
+
+            //print the GPIO thermistor temperatures
+            for(int i=0; i<GPIOS_PER_BOARD; i++)
+            {
+              Serial.println((String)"GPIO " +i+" Temp= " +(snap.gpioTemp[currentBoard][i]/10.0));
+            }
+        }
+
+        canLatency.print("CAN response latency");
+        scanLatency.print("BMS scan time");
+        cellCal.print();
+        bist.print();
+        openWire.print();
+        power.print();
+        regShadow.print();
+}
+
+
+
+//Writes the whole stack configuration, also used by the link supervisor after readdressing
+void ConfigureStack()
+{
+  regShadow.invalidate();                                 //the devices may have been reset, nothing is known
+  InitDevices(nodeConfig.uvThresh, nodeConfig.ovThresh);
+  cellCal.restart();                                      //the AUX ADC is back on cell 1
+
+  WriteReg(0, SYSFLT1_FLT_RST, 0xFFFFFF, 3, FRMWRT_ALL_NR);   //reset system faults
+  regShadow.write(0, SYSFLT1_FLT_MSK, 0xFFFFFF, 3, FRMWRT_ALL_NR);  //only the masks InitDevices() left different
+
+  //SET UP MAIN AND AUX ADC
+  adc.invalidate();                                       //the devices may have been reset, write every ADC register
+  adc.compile(adcPlan);
+  adc.apply();
+  adc.start();                                            //CELL_ADC_GO Y tsref y AUX_ADC_GO
 }
@@ -0,0 +1,461 @@
+// Host load test of the CAN stack on the virtual bus ([env:native], pio run -e native && .pio/build/native/program)
+//   program [seconds] [error ppm] [seed] [candump file]
+//   program replay <candump file> [speed]
+//   program ota [kB] [error ppm] [seed]
+// BMS node: periodic cell frames and RRF responses. Master: an RRF request every 2 ms. Load: extended frames
+// on every send(), and an ISO-TP transfer of ISOTP_BLOB_SIZE bytes from the BMS each time the master asks
+// for it. The run fails if the bus load estimated by the nodes drifts from the bits counted on the wire.
+// Everything runs on virtual time, so a run is repeatable for a given seed. The wire can be
+// saved in candump -l format (can0 = BMS, can1 = master, can2 = load); replay feeds a log (from the
+// simulation or from candump on a real bus) to the BMS node, speed 0 as fast as possible to measure throughput.
+// ota: a tester downloads an image to an ECU node through UDS (RequestDownload, TransferData, RequestTransferExit
+// with the CRC-32, ECUReset) on a bus of their own; the ECU flash takes the write and erase times of the ESP32-S3.
+//   program stack
+// stack: FRMWRT_ALL_R cell reads with boards missing or corrupted, decoded by the address each frame carries.
+#include <Arduino.h>
+#include <chrono>
+#include "MART_CAN.h"
+#include "CAN_Sim.h"
+#include "CAN_Trace.h"
+#include "CAN_IsoTp.h"
+#include "CAN_Uds.h"
+#include "CAN_Ota.h"
+
+#define SIM_KBPS         1000
+#define SIM_STEP_US      20      //Clock step between two polls of the nodes
+#define SIM_TASK_MS      1       //send() period of every node, as the CAN task
+#define SIM_LOAD_TOLERANCE 5.0   //Bus load of a node without filters against the wire, in %: frames lost in RX overflows are not seen
+#define BMS_CELL_ID      0x100   //0x100.. one per board, 10 ms
+#define BMS_NUM_CELL_IDS 16
+#define BMS_CELL_MS      10
+#define RRF_REQUEST_ID   0x200
+#define RRF_REQUEST_MS   2
+#define RRF_RESPONSE_ID  0x300   //0x300..0x303 answer RRF_REQUEST_ID
+#define RRF_NUM_RESPONSES 4
+#define LOAD_ID          0x18FF0000
+#define LOAD_NUM_IDS     2
+#define WIRE_TRACE_SIZE  4096    //Frames between two writes of the wire trace to the file
+#define ISOTP_REQUEST_ID 0x7E0   //Master -> BMS
+#define ISOTP_RESPONSE_ID 0x7E8  //BMS -> master
+#define ISOTP_REQUEST_MS 100
+#define ISOTP_BLOB_SIZE  1024
+#define OTA_IMAGE_KB     256
+#define OTA_TESTER_ID    0x7E0   //Tester -> ECU
+#define OTA_ECU_ID       0x7E8   //ECU -> tester
+#define OTA_P2_MS        100     //Tester timeout for a response
+#define OTA_P2_EXT_MS    5000    //Timeout after "response pending"
+#define OTA_RETRIES      3       //Requests sent again after a timeout before giving up
+#define FLASH_SIZE       0x180000 //OTA partition
+#define FLASH_SECTOR     4096
+#define FLASH_ERASE_US   45000   //Sector erase
+#define FLASH_US_PER_BYTE 3      //Page program, ~0.7 ms per 256 bytes
+
+//fwrite() with the write() of fs::File / Print, for CanTrace
+struct FileWriter
+{
+  FILE *file;
+  size_t write(const uint8_t *buf, size_t n) { return fwrite(buf, 1, n, file); }
+};
+
+VirtualCanBus bus(SIM_KBPS * 1000UL);
+SimBackend bmsPort(bus), masterPort(bus), loadPort(bus);
+CAN_BUS bms(bmsPort, 1, SIM_KBPS), master(masterPort, 2, SIM_KBPS), load(loadPort, 3, SIM_KBPS);
+IsoTp bmsTp(bms), masterTp(master);
+uint8_t bmsRx[8], masterRx[ISOTP_BLOB_SIZE], blob[ISOTP_BLOB_SIZE];
+unsigned long blobsOK = 0, blobsBad = 0;
+
+void ConfigureNodes()
+{
+  for(unsigned i = 0; i < RRF_NUM_RESPONSES; i++){
+    bms.setRRFId(RRF_REQUEST_ID, RRF_RESPONSE_ID + i);
+  }
+  for(unsigned i = 0; i < RRF_NUM_RESPONSES; i++){
+    uint16_t d[4] = {(uint16_t)i, 1, 2, 3};
+    bms.setPacket(RRF_RESPONSE_ID + i, d);
+  }
+  for(unsigned i = 0; i < BMS_NUM_CELL_IDS; i++){
+    uint16_t cells[4] = {3700, 3701, 3702, (uint16_t)i};
+    bms.setPacket(BMS_CELL_ID + i, cells);
+    bms.setPacketTimer(BMS_CELL_ID + i, BMS_CELL_MS);
+  }
+
+  //Master only keeps the responses and one cell frame, the rest is dropped by the software filter
+  unsigned long masterIds[RRF_NUM_RESPONSES + 1];
+  for(unsigned i = 0; i < RRF_NUM_RESPONSES; i++) masterIds[i] = RRF_RESPONSE_ID + i;
+  masterIds[RRF_NUM_RESPONSES] = BMS_CELL_ID;
+  master.setFilters(masterIds, RRF_NUM_RESPONSES + 1);
+  master.setPacket(RRF_REQUEST_ID);
+  master.setPacketTimer(RRF_REQUEST_ID, RRF_REQUEST_MS);
+
+  for(unsigned i = 0; i < LOAD_NUM_IDS; i++){
+    uint32_t d[2] = {i, 0xAAAAAAAA};
+    load.setPacket(LOAD_ID + i, d);
+  }
+  load.config.respondToRRF = false;
+
+  for(unsigned i = 0; i < ISOTP_BLOB_SIZE; i++) blob[i] = i * 7;
+  bmsTp.open(ISOTP_RESPONSE_ID, ISOTP_REQUEST_ID, false, bmsRx, sizeof(bmsRx));
+  masterTp.open(ISOTP_REQUEST_ID, ISOTP_RESPONSE_ID, false, masterRx, sizeof(masterRx), 8, 0xF2);
+  bms.setIsoTp(&bmsTp);
+  master.setIsoTp(&masterTp);
+}
+
+//BMS answers every request with the blob, master checks what arrives and asks again every ISOTP_REQUEST_MS
+void RunIsoTp()
+{
+  static const uint8_t request[2] = {0x22, 0x01};
+  static unsigned long lastRequest = 0;
+
+  if(bmsTp.available(0)){
+    bmsTp.release(0);
+    bmsTp.send(0, blob, sizeof(blob));
+  }
+  if(masterTp.available(0)){
+    bool ok = (masterTp.length(0) == ISOTP_BLOB_SIZE) && !memcmp(masterTp.data(0), blob, ISOTP_BLOB_SIZE);
+    if(ok) blobsOK++; else blobsBad++;
+    masterTp.release(0);
+  }
+  if(millis() - lastRequest >= ISOTP_REQUEST_MS){
+    lastRequest = millis();
+    masterTp.send(0, request, sizeof(request));
+  }
+  bmsTp.update();
+  masterTp.update();
+}
+
+//While a node blocks in a write the others keep reading, as their tasks would. Writes made from here do not nest
+CAN_BUS *nodes[] = {&bms, &master, &load};
+void ServiceOthers(int blocked)
+{
+  static bool inside = false;
+  if(inside) return;
+  inside = true;
+  for(int i = 0; i < 3; i++){
+    if(i != blocked) while(nodes[i]->receive()){}
+  }
+  inside = false;
+}
+
+//ECU flash: keeps the image in memory and stays busy for as long as the real one would
+struct MemorySink : FirmwareSink
+{
+  std::vector<uint8_t> image;
+  uint64_t busyUntil = 0;   //simClock() at the end of the last write
+  bool finished = false;
+
+  uint32_t maxSize() override { return FLASH_SIZE; }
+  bool begin(uint32_t size) override
+  {
+    image.clear();
+    image.reserve(size);
+    finished = false;
+    return true;
+  }
+  bool write(const uint8_t *data, size_t len) override
+  {
+    size_t erased = (image.size() + FLASH_SECTOR - 1) / FLASH_SECTOR;
+    image.insert(image.end(), data, data + len);
+    size_t sectors = (image.size() + FLASH_SECTOR - 1) / FLASH_SECTOR;
+    busyUntil = simClock() + (sectors - erased) * FLASH_ERASE_US + len * FLASH_US_PER_BYTE;
+    return true;
+  }
+  bool end() override { return finished = true; }
+  void abort() override { image.clear(); }
+};
+
+VirtualCanBus otaBus(SIM_KBPS * 1000UL);
+SimBackend ecuPort(otaBus), testerPort(otaBus);
+CAN_BUS ecu(ecuPort, 1, SIM_KBPS), tester(testerPort, 2, SIM_KBPS);
+IsoTp ecuTp(ecu), testerTp(tester);
+BqTransactionQueue ecuBq;                    //Never served, the ECU has no BQ79606 here
+UdsServer ecuUds(ecuTp, ecuBq);
+MemorySink flash;
+CanOta ecuOta(flash);
+bool ecuReset = false;
+
+//Tester: one request at a time, the same one again after a timeout
+enum OtaStep { OTA_DOWNLOAD, OTA_TRANSFER, OTA_EXIT, OTA_RESET, OTA_END, OTA_ERROR };
+std::vector<uint8_t> image;
+uint8_t testerRx[64], otaRequest[UDS_MAX_REQUEST];
+uint16_t otaRequestLen = 0, otaBlock = 0, otaTimeout = 0;
+uint32_t otaPos = 0;
+uint8_t otaCounter = 0;
+int otaStep = OTA_DOWNLOAD, otaRetries = 0;
+bool otaWaiting = false;
+unsigned long otaSent = 0, otaStart = 0, otaEnd = 0;
+
+void OtaSend()
+{
+  if(!testerTp.send(0, otaRequest, otaRequestLen)) return;
+  otaWaiting = true;
+  otaSent = millis();
+  otaTimeout = OTA_P2_MS;
+}
+
+void OtaNextRequest()
+{
+  uint8_t *r = otaRequest;
+  uint32_t size = image.size();
+  uint16_t n;
+  switch(otaStep){
+    case OTA_DOWNLOAD:   //no compression or encryption, 4 bytes of address and of size
+      r[0] = UDS_REQUEST_DOWNLOAD; r[1] = 0x00; r[2] = 0x44;
+      memset(r + 3, 0, 4);
+      r[7] = size >> 24; r[8] = size >> 16; r[9] = size >> 8; r[10] = size;
+      otaRequestLen = 11;
+      break;
+    case OTA_TRANSFER:
+      n = min<uint32_t>(otaBlock, size - otaPos);
+      r[0] = UDS_TRANSFER_DATA; r[1] = otaCounter;
+      memcpy(r + 2, &image[otaPos], n);
+      otaRequestLen = 2 + n;
+      break;
+    case OTA_EXIT: {
+      uint32_t crc = crc32Update(0, image.data(), size);
+      r[0] = UDS_REQUEST_TRANSFER_EXIT;
+      r[1] = crc >> 24; r[2] = crc >> 16; r[3] = crc >> 8; r[4] = crc;
+      otaRequestLen = 5;
+      break;
+    }
+    case OTA_RESET:
+      r[0] = UDS_ECU_RESET; r[1] = 0x01;
+      otaRequestLen = 2;
+      break;
+  }
+  OtaSend();
+}
+
+void RunOtaTester()
+{
+  if(otaStep >= OTA_END) return;
+  if(!otaWaiting){
+    if(!testerTp.txBusy(0)) OtaNextRequest();
+    return;
+  }
+
+  if(testerTp.available(0)){
+    const uint8_t *resp = testerTp.data(0);
+    uint16_t len = testerTp.length(0);
+    if((len >= 3) && (resp[0] == UDS_NEGATIVE_RESPONSE) && (resp[2] == UDS_NRC_RESPONSE_PENDING)){
+      otaSent = millis();
+      otaTimeout = OTA_P2_EXT_MS;
+    }
+    else if(resp[0] != otaRequest[0] + 0x40){
+      Serial.println((String)"OTA: service " + String(otaRequest[0], HEX) + " refused, NRC " + String(resp[len - 1], HEX));
+      otaStep = OTA_ERROR;
+    }
+    else{
+      otaWaiting = false;
+      otaRetries = 0;
+      switch(otaStep){
+        case OTA_DOWNLOAD:
+          otaBlock = ((resp[2] << 8) | resp[3]) - 2;
+          otaPos = 0;
+          otaCounter = 1;
+          otaStart = millis();
+          otaStep = OTA_TRANSFER;
+          break;
+        case OTA_TRANSFER:
+          otaPos += otaRequestLen - 2;
+          otaCounter++;
+          if(otaPos == image.size()) otaStep = OTA_EXIT;
+          break;
+        case OTA_EXIT:
+          otaEnd = millis();
+          otaStep = OTA_RESET;
+          break;
+        case OTA_RESET:
+          otaStep = OTA_END;
+          break;
+      }
+    }
+    testerTp.release(0);
+  }
+  else if(millis() - otaSent > otaTimeout){
+    if(++otaRetries > OTA_RETRIES){
+      Serial.println((String)"OTA: no response to service " + String(otaRequest[0], HEX));
+      otaStep = OTA_ERROR;
+    }
+    else OtaSend();
+  }
+}
+
+//The writer task runs whenever the flash is free, also while the CAN task of the ECU waits for the bus
+void RunOtaWriter()
+{
+  if(simClock() >= flash.busyUntil) ecuOta.service();
+}
+
+CAN_BUS *otaNodes[] = {&ecu, &tester};
+void ServiceOtaNodes(int blocked)
+{
+  static bool inside = false;
+  if(inside) return;
+  inside = true;
+  for(int i = 0; i < 2; i++){
+    if(i != blocked) while(otaNodes[i]->receive()){}
+  }
+  RunOtaWriter();
+  inside = false;
+}
+
+int Ota(uint32_t kB, uint32_t errorPpm, uint32_t seed)
+{
+  image.resize(kB * 1024);
+  uint32_t x = seed ? seed : 1;
+  for(uint8_t &b : image){
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    b = x;
+  }
+
+  ecuUds.begin(OTA_ECU_ID, OTA_TESTER_ID);
+  ecuUds.setDownload(&ecuOta);
+  ecuUds.setResetHandler([]{ ecuReset = true; });
+  ecu.setIsoTp(&ecuTp);
+  testerTp.open(OTA_TESTER_ID, OTA_ECU_ID, false, testerRx, sizeof(testerRx));
+  tester.setIsoTp(&testerTp);
+  otaBus.setSeed(seed);
+  otaBus.injectErrors(errorPpm);
+  otaBus.setWaitHook(ServiceOtaNodes);
+
+  uint64_t limit = simClock() + (uint64_t)kB * 1000000;   //1 s per kB, far below any working rate
+  while((otaStep < OTA_END) && (simClock() < limit)){
+    simAdvance(SIM_STEP_US);
+    for(CAN_BUS *node : otaNodes){
+      while(node->receive()){}
+    }
+    ecuUds.update();
+    ecuTp.update();
+    RunOtaWriter();
+    RunOtaTester();
+    testerTp.update();
+  }
+  //ECUReset is only acted on after its response has gone out
+  for(int i = 0; (i < 100) && !ecuReset; i++){
+    simAdvance(SIM_STEP_US);
+    ecuUds.update();
+  }
+
+  bool ok = (otaStep == OTA_END) && ecuReset && flash.finished && (flash.image == image);
+  double seconds = (otaEnd - otaStart) / 1000.0;
+  Serial.println((String)"OTA " + (ok ? "OK" : "FAILED") + ": " + (unsigned long)image.size() + " bytes in " + seconds +
+                 " s, " + (otaEnd > otaStart ? image.size() / seconds / 1000 : 0.0) + " kB/s");
+  Serial.println((String)"Bus load: " + (otaBus.numBits * 100.0 / (simClock() / 1e6 * otaBus.getBitrate())) + " %");
+  otaBus.printStatus();
+  ecuOta.printStatus();
+  ecuUds.printStatus();
+  ecuTp.printStatus();
+  testerTp.printStatus();
+  return ok ? 0 : 1;
+}
+
+int StackTest();  //StackSim.cpp
+
+//Plays a candump log through a CAN_BUS configured as the BMS node; frames sent by the BMS (can0) are skipped
+int Replay(const char *path, float speed)
+{
+  FILE *file = fopen(path, "r");
+  if(file == nullptr){
+    Serial.println((String)"Cannot open " + path);
+    return 1;
+  }
+  std::vector<TraceRecord> records;
+  char line[128];
+  TraceRecord rec;
+  uint64_t timeUs;
+  while(fgets(line, sizeof(line), file)){
+    if(!CanTrace::parseCandump(line, rec, timeUs)) continue;
+    if(rec.bus == 0) rec.id |= CAN_TRACE_TX;
+    records.push_back(rec);
+  }
+  fclose(file);
+
+  ReplayBackend player;
+  player.load(records);
+  player.setSpeed(speed);
+  CAN_BUS node(player, 1, SIM_KBPS);
+  for(unsigned i = 0; i < RRF_NUM_RESPONSES; i++) node.setRRFId(RRF_REQUEST_ID, RRF_RESPONSE_ID + i);
+  for(unsigned i = 0; i < RRF_NUM_RESPONSES; i++){
+    uint16_t d[4] = {(uint16_t)i, 1, 2, 3};
+    node.setPacket(RRF_RESPONSE_ID + i, d);
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  uint64_t simStart = simClock();
+  while(!player.finished()){
+    if(!node.receive()) simAdvance(SIM_STEP_US);
+  }
+  double hostSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  Serial.println((String)"Replayed " + (unsigned long)records.size() + " records, RX " + node.numRXPaqOK + " frames, " +
+                 player.numTx + " responses in " + (unsigned long)((simClock() - simStart) / 1000) + " ms of bus time");
+  Serial.println((String)"Host time " + (hostSeconds * 1000) + " ms, " + (node.numRXPaqOK / max(hostSeconds, 1e-9)) +
+                 " frames/s");
+  node.printMetrics();
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if((argc > 1) && !strcmp(argv[1], "stack")) return StackTest();
+  if((argc > 2) && !strcmp(argv[1], "replay")) return Replay(argv[2], (argc > 3) ? atof(argv[3]) : 0);
+  if((argc > 1) && !strcmp(argv[1], "ota")){
+    return Ota((argc > 2) ? strtoul(argv[2], nullptr, 0) : OTA_IMAGE_KB, (argc > 3) ? strtoul(argv[3], nullptr, 0) : 0,
+               (argc > 4) ? strtoul(argv[4], nullptr, 0) : 1);
+  }
+
+  unsigned long seconds = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 10;
+  uint32_t errorPpm = (argc > 2) ? strtoul(argv[2], nullptr, 0) : 0;
+  uint32_t seed = (argc > 3) ? strtoul(argv[3], nullptr, 0) : 1;
+  FileWriter log = {(argc > 4) ? fopen(argv[4], "w") : nullptr};
+
+  ConfigureNodes();
+  bus.setSeed(seed);
+  bus.injectErrors(errorPpm);
+  CanTrace wireTrace(WIRE_TRACE_SIZE);
+  if(log.file) bus.setTrace(&wireTrace);
+
+  bus.setWaitHook(ServiceOthers);
+  unsigned long lastTask = 0;
+  uint64_t end = (uint64_t)seconds * 1000000;
+  while(simClock() < end)
+  {
+    simAdvance(SIM_STEP_US);
+    for(CAN_BUS *node : nodes){
+      while(node->receive()){}
+    }
+    RunIsoTp();
+    if(millis() - lastTask >= SIM_TASK_MS){
+      lastTask = millis();
+      for(CAN_BUS *node : nodes) node->send();
+      if(log.file && (wireTrace.size() > WIRE_TRACE_SIZE / 2)) wireTrace.exportCandump(log);
+    }
+  }
+  if(log.file){
+    wireTrace.exportCandump(log);
+    fclose(log.file);
+  }
+
+  bus.printStatus();
+  double wireLoad = bus.numBits * 100.0 / ((double)seconds * bus.getBitrate());
+  Serial.println((String)"Bus load: " + wireLoad + " %");
+  Serial.println((String)"ISO-TP blobs OK: " + blobsOK + " bad: " + blobsBad);
+  bmsTp.printStatus();
+  masterTp.printStatus();
+  const char *names[] = {"BMS", "Master", "Load"};
+  for(unsigned i = 0; i < 3; i++){
+    Serial.println((String)"== " + names[i]);
+    nodes[i]->printMetrics();
+  }
+
+  //BMS and load take every frame: their estimate (last window) can miss frames but never see more bits than the wire
+  bool loadOK = true;
+  CAN_BUS *unfiltered[] = {&bms, &load};
+  for(CAN_BUS *node : unfiltered){
+    double nodeLoad = node->metrics.getBusLoad() / 10.0;
+    bool ok = (nodeLoad <= wireLoad + 1.0) && (nodeLoad >= wireLoad - SIM_LOAD_TOLERANCE);
+    Serial.println((String)"Bus load check: " + nodeLoad + " % against " + wireLoad + " % on the wire " + (ok ? "OK" : "FAILED"));
+    loadOK &= ok;
+  }
+  return loadOK ? 0 : 1;
+}
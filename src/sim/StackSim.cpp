@@ -0,0 +1,81 @@
+// Host check of the stack read path: FRMWRT_ALL_R responses are injected in the BQ79606 UART, read with ReadReg
+// and decoded into a PackSnapshot. Boards are dropped or corrupted on purpose, the frames that still arrive
+// have to land on the board whose address they carry and only the missing boards can be marked as failed.
+#include <Arduino.h>
+#include "BQ79606.h"
+#include "PackSnapshot.h"
+
+extern HardwareSerial BMS_UART;
+
+//Cell code of a board in the injected responses, different for every board and cell
+static int16_t StackCellCode(int board, int cell)
+{
+  return 1000 * (board + 1) + cell;
+}
+
+//Response frame of a board to a VCELL1H read, as the BQ79606 sends it (CRC low byte first)
+static void StackFrame(byte *frame, int board)
+{
+  frame[0] = MAXBYTES - 1;
+  frame[1] = board;
+  frame[2] = VCELL1H >> 8;
+  frame[3] = VCELL1H & 0xFF;
+  for(int i = 0; i < MAXBYTES / 2; i++){
+    frame[4 + 2 * i] = StackCellCode(board, i) >> 8;
+    frame[5 + 2 * i] = StackCellCode(board, i) & 0xFF;
+  }
+  uint16_t crc = CRC16(frame, MAXBYTES + 4);
+  frame[MAXBYTES + 4] = crc & 0xFF;
+  frame[MAXBYTES + 5] = crc >> 8;
+}
+
+//Answers a FRMWRT_ALL_R read with the boards in answerMask (top of stack first), corrupts the CRC of the
+//boards in corruptMask, reads it back and checks the read result and the decoded snapshot
+static bool StackCase(const char *name, uint32_t answerMask, uint32_t corruptMask)
+{
+  byte wire[TOTALBOARDS * (MAXBYTES + 6)];
+  int len = 0;
+  for(int board = TOTALBOARDS - 1; board >= 0; board--){
+    if(!(answerMask & (1UL << board))) continue;
+    StackFrame(&wire[len], board);
+    if(corruptMask & (1UL << board)) wire[len + MAXBYTES + 4] ^= 0xFF;
+    len += MAXBYTES + 6;
+  }
+  BMS_UART.simReceive(wire, len);
+
+  byte response[TOTALBOARDS * (MAXBYTES + 6)];
+  int res = ReadReg(0, VCELL1H, response, MAXBYTES, 1000, FRMWRT_ALL_R);
+
+  const uint32_t all = (1UL << TOTALBOARDS) - 1;
+  uint32_t missing = all & ~answerMask;
+  int expected = missing ? BQ_READ_TIMEOUT : (corruptMask ? BQ_READ_CRC_ERROR : len);
+  bool ok = (res == expected) && (dwTimeoutMask == missing) && (dwCRCFaultMask == corruptMask);
+
+  static PackSnapshot snap;
+  beginScan(snap);
+  decodeCellStack(snap, response, dwTimeoutMask | dwCRCFaultMask);
+  uint32_t good = answerMask & ~corruptMask;
+  ok = ok && (snap.cellValid == good);
+  for(int board = 0; board < TOTALBOARDS; board++){
+    if(!(good & (1UL << board))) continue;
+    for(int cell = 0; cell < CELLS_PER_BOARD; cell++){
+      ok = ok && (snap.cellCode[board][cell] == StackCellCode(board, cell));
+    }
+  }
+
+  printf("%-24s read %d timeout 0x%02X crc 0x%02X cells 0x%02X %s\n", name, res, (unsigned)dwTimeoutMask,
+         (unsigned)dwCRCFaultMask, (unsigned)snap.cellValid, ok ? "ok" : "WRONG");
+  return ok;
+}
+
+int StackTest()
+{
+  const uint32_t all = (1UL << TOTALBOARDS) - 1;
+  bool ok = StackCase("all boards", all, 0);
+  ok &= StackCase("top board dropped", all & ~(1UL << (TOTALBOARDS - 1)), 0);
+  ok &= StackCase("board 1 dropped", all & ~(1UL << 1), 0);
+  ok &= StackCase("board 0 dropped", all & ~1UL, 0);
+  ok &= StackCase("board 2 bad CRC", all, 1UL << 2);
+  printf("STACK %s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}